@@ -0,0 +1,294 @@
+// Compares the TLSF and slab allocators against the system heap behind the Allocator API. Prints one CSV row per
+// benchmark with the p50 and p99 of the samples, and the peak bytes per allocation tag of each allocator as comments.
+//
+// cc -O2 -DNDEBUG -I../sandbox allocator_benchmark.c ../sandbox/allocator.c ../sandbox/tlsf.c ../sandbox/slab.c ../sandbox/fibers_system.c ../sandbox/platform.c -lpthread -o allocator_benchmark
+// ./allocator_benchmark [n_samples] [max_workers]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "allocator.h"
+#include "fibers_system.h"
+#include "platform.h"
+#include "render_resources.h"
+#include "slab.h"
+#include "stretchy_buffer.h"
+
+enum { TLSF_POOL_SIZE = 256 * 1024 * 1024 };
+enum { N_BUFFERS = 4096 };
+enum { N_PUSHES = 1 << 20 };
+enum { N_LIVE = 8192 };
+enum { N_OPERATIONS = 1 << 18 };
+enum { N_RENDER_PACKAGES = 1 << 20 };
+enum { SLAB_POOL_SIZE = 96 * 1024 * 1024 };
+enum { N_SCALING_JOBS = 256 };
+enum { N_JOB_OPERATIONS = 1 << 14 };
+
+typedef struct Benchmark
+{
+	unsigned n_samples;
+	uint64_t *samples;
+	uint32_t random;
+} Benchmark;
+
+static uint32_t next_random(Benchmark *benchmark)
+{
+	uint32_t x = benchmark->random;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return benchmark->random = x;
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+	const uint64_t x = *(const uint64_t *)a;
+	const uint64_t y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+// Samples are divided by per_sample to report the cost of one item.
+static void report(Benchmark *benchmark, const char *name, const char *variant, const char *unit, unsigned per_sample)
+{
+	qsort(benchmark->samples, benchmark->n_samples, sizeof(uint64_t), compare_samples);
+	const unsigned n = benchmark->n_samples;
+	const double p50 = (double)benchmark->samples[n / 2] / per_sample;
+	const double p99 = (double)benchmark->samples[(n * 99) / 100 < n ? (n * 99) / 100 : n - 1] / per_sample;
+	const double min = (double)benchmark->samples[0] / per_sample;
+	const double max = (double)benchmark->samples[n - 1] / per_sample;
+	printf("%s,%s,%u,%s,%.1f,%.1f,%.1f,%.1f\n", name, variant, n, unit, p50, p99, min, max);
+	fflush(stdout);
+}
+
+// Thousands of stretchy buffers growing by doubling at once, a few hot ones get big, then all are freed.
+static void benchmark_stretchy_buffers(Benchmark *benchmark, Allocator *allocator, const char *variant)
+{
+	static unsigned *buffers[N_BUFFERS];
+	for (unsigned s = 0; s < benchmark->n_samples; ++s) {
+		benchmark->random = 0x9e3779b9u;
+		const uint64_t start = platform_time_ns();
+		for (unsigned i = 0; i < N_BUFFERS; ++i)
+			sb_create(allocator, buffers[i], 4);
+		for (unsigned i = 0; i < N_PUSHES; ++i) {
+			const uint32_t r = next_random(benchmark);
+			const unsigned index = (r & 1) ? (r >> 1) % 32 : (r >> 1) % N_BUFFERS;
+			sb_push(buffers[index], i);
+		}
+		allocator_stats_end_frame(allocator);
+		for (unsigned i = 0; i < N_BUFFERS; ++i)
+			sb_free(buffers[i]);
+		benchmark->samples[s] = platform_time_ns() - start;
+	}
+	report(benchmark, "stretchy_buffer_push_1m", variant, "ns", N_PUSHES);
+}
+
+// A live set of random sizes where every operation frees one allocation and makes another.
+static void benchmark_churn(Benchmark *benchmark, Allocator *allocator, const char *variant, unsigned alignment)
+{
+	static void *live[N_LIVE];
+	benchmark->random = 0x2545f491u;
+	for (unsigned i = 0; i < N_LIVE; ++i)
+		live[i] = allocator_realloc(allocator, NULL, 16 + next_random(benchmark) % 2048, alignment);
+
+	for (unsigned s = 0; s < benchmark->n_samples; ++s) {
+		const uint64_t start = platform_time_ns();
+		for (unsigned i = 0; i < N_OPERATIONS; ++i) {
+			const uint32_t r = next_random(benchmark);
+			const unsigned index = r % N_LIVE;
+			allocator_realloc(allocator, live[index], 0, 0);
+			live[index] = allocator_realloc(allocator, NULL, 16 + (r >> 16) % 2048, alignment);
+		}
+		benchmark->samples[s] = platform_time_ns() - start;
+	}
+
+	for (unsigned i = 0; i < N_LIVE; ++i)
+		allocator_realloc(allocator, live[i], 0, 0);
+
+	char name[64];
+	sprintf(name, "alloc_free_churn_align_%u", alignment);
+	report(benchmark, name, variant, "ns", N_OPERATIONS);
+}
+
+// The allocation create_render_package makes for the eight resources of the instanced draw in win_main. Not the
+// function itself, render_resources.c needs D3D11.
+static RenderPackage *create_package(Allocator *allocator, unsigned n_resources)
+{
+	static unsigned tag;
+	if (!tag)
+		tag = allocator_tag("render_resources");
+	RenderPackage *package = allocator_realloc_tagged(allocator, NULL, sizeof(RenderPackage) + sizeof(Resource) * n_resources, 16, tag);
+	package->allocator = allocator;
+	package->resources = (Resource *)(package + 1);
+	package->n_resources = n_resources;
+	for (unsigned i = 0; i < n_resources; ++i)
+		package->resources[i] = resource_encode_handle_type(i + 1, RESOURCE_RAW_BUFFER);
+	return package;
+}
+
+// Creates 1M render packages and destroys them in a shuffled order.
+static void benchmark_render_packages(Benchmark *benchmark, Allocator *allocator, const char *variant)
+{
+	RenderPackage **packages = malloc(sizeof(RenderPackage *) * N_RENDER_PACKAGES);
+	unsigned *order = malloc(sizeof(unsigned) * N_RENDER_PACKAGES);
+	benchmark->random = 0x6a09e667u;
+	for (unsigned i = 0; i < N_RENDER_PACKAGES; ++i)
+		order[i] = i;
+	for (unsigned i = N_RENDER_PACKAGES - 1; i > 0; --i) {
+		const unsigned j = next_random(benchmark) % (i + 1);
+		const unsigned t = order[i];
+		order[i] = order[j];
+		order[j] = t;
+	}
+
+	uint64_t *destroy_samples = malloc(sizeof(uint64_t) * benchmark->n_samples);
+	for (unsigned s = 0; s < benchmark->n_samples; ++s) {
+		const uint64_t start = platform_time_ns();
+		for (unsigned i = 0; i < N_RENDER_PACKAGES; ++i)
+			packages[i] = create_package(allocator, 8);
+		const uint64_t created = platform_time_ns();
+		allocator_stats_end_frame(allocator);
+		const uint64_t sampled = platform_time_ns();
+		for (unsigned i = 0; i < N_RENDER_PACKAGES; ++i)
+			allocator_realloc(allocator, packages[order[i]], 0, 0);
+		benchmark->samples[s] = created - start;
+		destroy_samples[s] = platform_time_ns() - sampled;
+	}
+	report(benchmark, "create_render_package_1m", variant, "ns", N_RENDER_PACKAGES);
+	memcpy(benchmark->samples, destroy_samples, sizeof(uint64_t) * benchmark->n_samples);
+	report(benchmark, "destroy_render_package_1m", variant, "ns", N_RENDER_PACKAGES);
+
+	free(destroy_samples);
+	free(order);
+	free(packages);
+}
+
+// Occupancy of the slab pages in use with every other package destroyed, and after creating the destroyed half again
+// in a different size class.
+static void report_slab_fragmentation(Allocator *allocator)
+{
+	RenderPackage **packages = malloc(sizeof(RenderPackage *) * N_RENDER_PACKAGES);
+	for (unsigned i = 0; i < N_RENDER_PACKAGES; ++i)
+		packages[i] = create_package(allocator, 8);
+
+	SlabStats stats;
+	allocator_slab_stats(allocator, &stats);
+	printf("# slab, 1m packages: %u pages, %.1f%% occupied\n", stats.n_used_pages, 100.0 * stats.used_bytes / stats.page_bytes);
+	for (unsigned i = 0; i < N_RENDER_PACKAGES; i += 2)
+		allocator_realloc(allocator, packages[i], 0, 0);
+	allocator_slab_stats(allocator, &stats);
+	printf("# slab, every other destroyed: %u pages, %.1f%% occupied\n", stats.n_used_pages, 100.0 * stats.used_bytes / stats.page_bytes);
+	for (unsigned i = 0; i < N_RENDER_PACKAGES; i += 2)
+		packages[i] = create_package(allocator, 4);
+	allocator_slab_stats(allocator, &stats);
+	printf("# slab, refilled with 4 resource packages: %u pages, %.1f%% occupied\n", stats.n_used_pages, 100.0 * stats.used_bytes / stats.page_bytes);
+
+	for (unsigned i = 0; i < N_RENDER_PACKAGES; ++i)
+		allocator_realloc(allocator, packages[i], 0, 0);
+	free(packages);
+}
+
+typedef struct ScalingJob
+{
+	Allocator *allocator;
+	uint32_t random;
+} ScalingJob;
+
+// Small allocations with a short lifetime, like the temporaries of a job building a list.
+static void scaling_job(void *data)
+{
+	ScalingJob *job = data;
+	void *live[64] = { 0 };
+	uint32_t x = job->random;
+	for (unsigned i = 0; i < N_JOB_OPERATIONS; ++i) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		const unsigned index = x % 64;
+		if (live[index]) {
+			allocator_realloc(job->allocator, live[index], 0, 0);
+			live[index] = NULL;
+		} else {
+			live[index] = allocator_realloc(job->allocator, NULL, 16 + (x >> 8) % 256, 16);
+		}
+	}
+	for (unsigned i = 0; i < 64; ++i)
+		allocator_realloc(job->allocator, live[i], 0, 0);
+}
+
+// The same allocation heavy jobs on 1, 2, 4... workers, reported per operation over all workers.
+static void benchmark_scaling(Benchmark *benchmark, Allocator *allocator, const char *variant, Allocator *system, unsigned max_workers)
+{
+	static ScalingJob jobs[N_SCALING_JOBS];
+	static FibersSystemJobDecl decls[N_SCALING_JOBS];
+	for (unsigned n_workers = 1; n_workers <= max_workers; n_workers *= 2) {
+		FibersSystem *fibers_system = fibers_system_create(system, (FibersSystemStackPool[]){ { 64 * 1024, 16, 64 }, { 512 * 1024, 0, 4 } }, n_workers);
+		for (unsigned i = 0; i < N_SCALING_JOBS; ++i) {
+			jobs[i] = (ScalingJob){ .allocator = allocator, .random = 0x9e3779b9u * (i + 1) };
+			decls[i] = (FibersSystemJobDecl){ .job_entry = scaling_job, .job_data = &jobs[i] };
+		}
+		for (unsigned s = 0; s < benchmark->n_samples; ++s) {
+			const uint64_t start = platform_time_ns();
+			FibersSystemCounter counter = { 0 };
+			fibers_system_run_jobs(fibers_system, decls, N_SCALING_JOBS, &counter);
+			fibers_system_wait_for_counter(fibers_system, counter, 0);
+			benchmark->samples[s] = platform_time_ns() - start;
+		}
+		fibers_system_destroy(system, fibers_system);
+
+		char name[64];
+		sprintf(name, "job_alloc_free_%u_workers", n_workers);
+		report(benchmark, name, variant, "ns", N_SCALING_JOBS * N_JOB_OPERATIONS);
+	}
+}
+
+// Peaks are sampled where the benchmarks end a frame, once per sample.
+static void report_memory(Allocator *allocator, const char *variant)
+{
+	AllocatorStats stats;
+	allocator_stats(allocator, &stats);
+	for (unsigned i = 0; i < stats.n_tags; ++i) {
+		if (stats.tags[i].peak_bytes)
+			printf("# memory,%s,%s,peak_bytes,%llu\n", variant, stats.tags[i].name, (unsigned long long)stats.tags[i].peak_bytes);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	const unsigned n_samples = argc > 1 && atoi(argv[1]) > 0 ? (unsigned)atoi(argv[1]) : 20;
+	const unsigned max_workers = argc > 2 && atoi(argv[2]) > 0 ? (unsigned)atoi(argv[2]) : platform_processor_count();
+	Benchmark benchmark = { .n_samples = n_samples, .samples = malloc(sizeof(uint64_t) * n_samples) };
+
+	char system_buffer[256];
+	Allocator *system = create_allocator(system_buffer, sizeof(system_buffer));
+	void *tlsf_buffer = malloc(TLSF_POOL_SIZE);
+	Allocator *tlsf = create_tlsf_allocator(tlsf_buffer, TLSF_POOL_SIZE);
+	void *slab_buffer = malloc(SLAB_POOL_SIZE);
+	Allocator *slab = create_slab_allocator(slab_buffer, SLAB_POOL_SIZE, system);
+
+	printf("benchmark,variant,samples,unit,p50,p99,min,max\n");
+	benchmark_stretchy_buffers(&benchmark, system, "system");
+	benchmark_stretchy_buffers(&benchmark, tlsf, "tlsf");
+	benchmark_churn(&benchmark, system, "system", 16);
+	benchmark_churn(&benchmark, tlsf, "tlsf", 16);
+	benchmark_churn(&benchmark, system, "system", 64);
+	benchmark_churn(&benchmark, tlsf, "tlsf", 64);
+	benchmark_render_packages(&benchmark, system, "system");
+	benchmark_render_packages(&benchmark, tlsf, "tlsf");
+	benchmark_render_packages(&benchmark, slab, "slab");
+	report_slab_fragmentation(slab);
+	benchmark_scaling(&benchmark, system, "system", system, max_workers);
+	benchmark_scaling(&benchmark, tlsf, "tlsf", system, max_workers);
+	benchmark_scaling(&benchmark, slab, "slab", system, max_workers);
+	report_memory(system, "system");
+	report_memory(tlsf, "tlsf");
+	report_memory(slab, "slab");
+
+	destroy_allocator(slab);
+	destroy_allocator(tlsf);
+	destroy_allocator(system);
+	free(slab_buffer);
+	free(tlsf_buffer);
+	free(benchmark.samples);
+	return 0;
+}
@@ -0,0 +1,1166 @@
+// Micro-benchmarks for the fibers system. Prints one CSV row per benchmark with the p50 and p99 of the samples.
+//
+// cc -O2 -DNDEBUG -I../sandbox fibers_system_benchmark.c ../sandbox/fibers_system.c ../sandbox/platform.c ../sandbox/allocator.c ../sandbox/tlsf.c ../sandbox/slab.c -lpthread -o fibers_system_benchmark
+// ./fibers_system_benchmark [n_workers] [n_samples] [trace.json]
+// The same with -DFIBERS_SYSTEM_SHARED_QUEUE=1 and -o fibers_system_benchmark_shared_queue gives the queue_scaling rows
+// of one locked queue shared by every worker to compare the deques against. With -DFIBERS_SYSTEM_TRACE=0 the
+// trace_overhead rows are those of tracing compiled out. trace.json gets the Chrome trace of the last traced batch.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "allocator.h"
+#include "fibers_system.h"
+#include "platform.h"
+
+#if defined(_WIN32)
+#include <direct.h>
+#define make_directory(path) _mkdir(path)
+#define remove_directory(path) _rmdir(path)
+typedef SRWLOCK BenchmarkOsMutex;
+static void os_mutex_init(BenchmarkOsMutex *mutex) { InitializeSRWLock(mutex); }
+static void os_mutex_lock(BenchmarkOsMutex *mutex) { AcquireSRWLockExclusive(mutex); }
+static void os_mutex_unlock(BenchmarkOsMutex *mutex) { ReleaseSRWLockExclusive(mutex); }
+// User and kernel time of every thread in the process.
+static uint64_t process_cpu_ns(void)
+{
+	FILETIME creation, exit, kernel, user;
+	GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+	const uint64_t kernel_100ns = ((uint64_t)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime;
+	const uint64_t user_100ns = ((uint64_t)user.dwHighDateTime << 32) | user.dwLowDateTime;
+	return (kernel_100ns + user_100ns) * 100;
+}
+// Dropping a single file from the cache takes unbuffered handles, so there are no cold reads.
+static int evict_file(const char *path)
+{
+	(void)path;
+	return 0;
+}
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#define make_directory(path) mkdir(path, 0755)
+#define remove_directory(path) rmdir(path)
+typedef pthread_mutex_t BenchmarkOsMutex;
+static void os_mutex_init(BenchmarkOsMutex *mutex) { pthread_mutex_init(mutex, NULL); }
+static void os_mutex_lock(BenchmarkOsMutex *mutex) { pthread_mutex_lock(mutex); }
+static void os_mutex_unlock(BenchmarkOsMutex *mutex) { pthread_mutex_unlock(mutex); }
+static uint64_t process_cpu_ns(void)
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return ((uint64_t)usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000ull + ((uint64_t)usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000ull;
+}
+// Writes the file out and drops it from the page cache so the next read goes to the disk, 0 where that can't be done.
+static int evict_file(const char *path)
+{
+#if defined(__linux__)
+	const int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	fdatasync(fd);
+	const int evicted = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0;
+	close(fd);
+	return evicted;
+#else
+	(void)path;
+	return 0;
+#endif
+}
+#endif
+
+typedef struct Benchmark
+{
+	FibersSystem *fibers_system;
+	unsigned n_workers;
+	unsigned n_samples;
+	uint64_t *samples;
+} Benchmark;
+
+static int compare_samples(const void *a, const void *b)
+{
+	const uint64_t x = *(const uint64_t *)a;
+	const uint64_t y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+// Samples are divided by per_sample to report the cost of one item.
+static void report(Benchmark *benchmark, const char *name, const char *variant, const char *unit, unsigned per_sample)
+{
+	qsort(benchmark->samples, benchmark->n_samples, sizeof(uint64_t), compare_samples);
+	const unsigned n = benchmark->n_samples;
+	const double p50 = (double)benchmark->samples[n / 2] / per_sample;
+	const double p99 = (double)benchmark->samples[(n * 99) / 100 < n ? (n * 99) / 100 : n - 1] / per_sample;
+	const double min = (double)benchmark->samples[0] / per_sample;
+	const double max = (double)benchmark->samples[n - 1] / per_sample;
+	printf("%s,%s,%u,%u,%s,%.1f,%.1f,%.1f,%.1f\n", name, variant, benchmark->n_workers, n, unit, p50, p99, min, max);
+	fflush(stdout);
+}
+
+static void run_job_and_wait(FibersSystem *fibers_system, FibersSystemJobEntry entry, void *data)
+{
+	FibersSystemJobDecl declaration = { .job_entry = entry, .job_data = data };
+	FibersSystemCounter counter = { 0 };
+	fibers_system_run_jobs(fibers_system, &declaration, 1, &counter);
+	fibers_system_wait_for_counter(fibers_system, counter, 0);
+}
+
+static void empty_job(void *data)
+{
+	(void)data;
+}
+
+enum { SPAWN_BATCH = 1024 };
+
+static void benchmark_spawn(Benchmark *benchmark)
+{
+	static FibersSystemJobDecl declarations[SPAWN_BATCH];
+	for (unsigned i = 0; i < SPAWN_BATCH; ++i)
+		declarations[i] = (FibersSystemJobDecl){ .job_entry = empty_job, .job_data = benchmark };
+
+	FibersSystemCounter counter = fibers_system_counter_create(benchmark->fibers_system);
+	for (unsigned s = 0; s < benchmark->n_samples; ++s) {
+		const uint64_t start = platform_time_ns();
+		fibers_system_run_jobs(benchmark->fibers_system, declarations, SPAWN_BATCH, &counter);
+		fibers_system_wait_for_counter(benchmark->fibers_system, counter, 0);
+		benchmark->samples[s] = platform_time_ns() - start;
+	}
+	fibers_system_counter_destroy(benchmark->fibers_system, counter);
+	report(benchmark, "spawn_empty_job", "batch_1024", "ns", SPAWN_BATCH);
+}
+
+// The variants are named after the queue the fibers system was built with. Jobs run on the same fibers and idle
+// workers park the same way in both builds, only the queue differs.
+#if FIBERS_SYSTEM_SHARED_QUEUE
+#define QUEUE_SCALING_VARIANT(name) "shared_queue_" name
+#else
+#define QUEUE_SCALING_VARIANT(name) "work_stealing_" name
+#endif
+enum { MAX_SCALING_WORKERS = 16 };
+
+// Parents that each push their children from inside a job, so the queue is hit from every thread at once.
+enum { NESTED_PARENTS = 16, NESTED_CHILDREN = 64 };
+
+typedef struct NestedSpawn
+{
+	FibersSystem *fibers_system;
+	FibersSystemCounter counter;
+	FibersSystemJobDecl children[NESTED_CHILDREN];
+} NestedSpawn;
+
+static void nested_parent_job(void *data)
+{
+	NestedSpawn *spawn = data;
+	fibers_system_run_jobs(spawn->fibers_system, spawn->children, NESTED_CHILDREN, &spawn->counter);
+}
+
+// Spawn throughput of the job queue the fibers system was built with, at 1 to 16 threads whatever the worker count of
+// the rest of the run.
+static void benchmark_queue_scaling(Benchmark *benchmark, Allocator *allocator)
+{
+	static FibersSystemJobDecl batch[SPAWN_BATCH];
+	for (unsigned i = 0; i < SPAWN_BATCH; ++i)
+		batch[i] = (FibersSystemJobDecl){ .job_entry = empty_job, .job_data = benchmark };
+	static NestedSpawn spawn;
+	for (unsigned i = 0; i < NESTED_CHILDREN; ++i)
+		spawn.children[i] = (FibersSystemJobDecl){ .job_entry = empty_job, .job_data = benchmark };
+	FibersSystemJobDecl parents[NESTED_PARENTS];
+	for (unsigned i = 0; i < NESTED_PARENTS; ++i)
+		parents[i] = (FibersSystemJobDecl){ .job_entry = nested_parent_job, .job_data = &spawn };
+
+	Benchmark scaling = *benchmark;
+	FibersSystemStackPool stack_pools[FIBERS_SYSTEM_N_STACK_CLASSES] = { { 64 * 1024, 64, 1024 }, { 512 * 1024, 4, 16 } };
+	for (unsigned n_threads = 1; n_threads <= MAX_SCALING_WORKERS; n_threads *= 2) {
+		scaling.n_workers = n_threads;
+
+		FibersSystem *fibers_system = fibers_system_create(allocator, stack_pools, n_threads);
+		spawn.fibers_system = fibers_system;
+		spawn.counter = fibers_system_counter_create(fibers_system);
+		for (unsigned s = 0; s < scaling.n_samples; ++s) {
+			const uint64_t start = platform_time_ns();
+			fibers_system_run_jobs(fibers_system, batch, SPAWN_BATCH, &spawn.counter);
+			fibers_system_wait_for_counter(fibers_system, spawn.counter, 0);
+			scaling.samples[s] = platform_time_ns() - start;
+		}
+		report(&scaling, "queue_scaling", QUEUE_SCALING_VARIANT("batch_1024"), "ns", SPAWN_BATCH);
+		for (unsigned s = 0; s < scaling.n_samples; ++s) {
+			const uint64_t start = platform_time_ns();
+			fibers_system_run_jobs(fibers_system, parents, NESTED_PARENTS, &spawn.counter);
+			fibers_system_wait_for_counter(fibers_system, spawn.counter, 0);
+			scaling.samples[s] = platform_time_ns() - start;
+		}
+		report(&scaling, "queue_scaling", QUEUE_SCALING_VARIANT("nested_16x64"), "ns", NESTED_PARENTS * NESTED_CHILDREN);
+		fibers_system_counter_destroy(fibers_system, spawn.counter);
+		fibers_system_destroy(allocator, fibers_system);
+	}
+}
+
+// Jobs that read a 40 byte payload, either from a per-job struct the caller keeps alive or copied into the job.
+typedef struct JobPayload
+{
+	volatile int32_t *sum;
+	int32_t values[8];
+} JobPayload;
+
+static void payload_job(void *data)
+{
+	JobPayload *payload = data;
+	int32_t sum = 0;
+	for (unsigned i = 0; i < 8; ++i)
+		sum += payload->values[i];
+	atomic_add_32(payload->sum, sum);
+}
+
+static void benchmark_spawn_payload(Benchmark *benchmark)
+{
+	static JobPayload payloads[SPAWN_BATCH];
+	static FibersSystemJobDecl declarations[SPAWN_BATCH];
+	volatile int32_t sum = 0;
+	for (unsigned i = 0; i < SPAWN_BATCH; ++i) {
+		payloads[i].sum = &sum;
+		for (unsigned j = 0; j < 8; ++j)
+			payloads[i].values[j] = (int32_t)(i + j);
+	}
+
+	const char *variants[] = { "batch_1024_pointer", "batch_1024_inline" };
+	FibersSystemCounter counter = fibers_system_counter_create(benchmark->fibers_system);
+	for (unsigned v = 0; v < 2; ++v) {
+		for (unsigned i = 0; i < SPAWN_BATCH; ++i)
+			declarations[i] = (FibersSystemJobDecl){ .job_entry = payload_job, .job_data = &payloads[i], .job_data_size = v ? sizeof(JobPayload) : 0 };
+		for (unsigned s = 0; s < benchmark->n_samples; ++s) {
+			const uint64_t start = platform_time_ns();
+			fibers_system_run_jobs(benchmark->fibers_system, declarations, SPAWN_BATCH, &counter);
+			fibers_system_wait_for_counter(benchmark->fibers_system, counter, 0);
+			benchmark->samples[s] = platform_time_ns() - start;
+		}
+		report(benchmark, "spawn_payload_job", variants[v], "ns", SPAWN_BATCH);
+	}
+	fibers_system_counter_destroy(benchmark->fibers_system, counter);
+}
+
+static void benchmark_wait_round_trip(Benchmark *benchmark)
+{
+	for (unsigned s = 0; s < benchmark->n_samples; ++s) {
+		const uint64_t start = platform_time_ns();
+		run_job_and_wait(benchmark->fibers_system, empty_job, benchmark);
+		benchmark->samples[s] = platform_time_ns() - start;
+	}
+	report(benchmark, "wait_round_trip", "one_empty_job", "ns", 1);
+}
+
+// Thousands of fibers parked in wait_for_counter while a job round trips through the same workers, then the cost of
+// waking them all. They wait either all on one gate counter, or each on a counter of its own that a continuation of the
+// gate holds open. The gate is a job parked on an event. Needs its own fibers system for a stack pool the parked fibers
+// fit in. The first round trip after parking runs with caches full of the parked stacks, the second one again warm, so
+// a cost that grows with the parked fibers in both would be work done per waiter.
+enum { MAX_PARKED = 4096 };
+
+typedef struct ParkedFibers
+{
+	FibersSystem *fibers_system;
+	FibersSystemCounter gate;
+	FibersSystemCounter counters[MAX_PARKED];
+	volatile int32_t arrived;
+	int32_t n_parked;
+	FiberEvent all_arrived;
+	FiberEvent release;
+} ParkedFibers;
+
+typedef struct ParkedFiber
+{
+	ParkedFibers *parked;
+	FibersSystemCounter *counter;
+} ParkedFiber;
+
+static void gate_job(void *data)
+{
+	ParkedFibers *parked = data;
+	fiber_event_wait(&parked->release);
+}
+
+static void parked_job(void *data)
+{
+	ParkedFiber *fiber = data;
+	ParkedFibers *parked = fiber->parked;
+	if (atomic_add_32(&parked->arrived, 1) == parked->n_parked)
+		fiber_event_set(&parked->all_arrived);
+	fibers_system_wait_for_counter(parked->fibers_system, *fiber->counter, 0);
+}
+
+static void benchmark_parked_fibers(Benchmark *benchmark, Allocator *allocator)
+{
+	FibersSystemStackPool stack_pools[FIBERS_SYSTEM_N_STACK_CLASSES] = { { 32 * 1024, 64, MAX_PARKED + 256 }, { 512 * 1024, 4, 16 } };
+	FibersSystem *fibers_system = fibers_system_create(allocator, stack_pools, benchmark->n_workers);
+	static ParkedFibers parked;
+	static ParkedFiber fibers[MAX_PARKED];
+	static FibersSystemJobDecl declarations[MAX_PARKED];
+	parked.fibers_system = fibers_system;
+	parked.gate = fibers_system_counter_create(fibers_system);
+	for (unsigned i = 0; i < MAX_PARKED; ++i) {
+		parked.counters[i] = fibers_system_counter_create(fibers_system);
+		declarations[i] = (FibersSystemJobDecl){ .job_entry = parked_job, .job_data = &fibers[i] };
+	}
+	FibersSystemJobDecl gate = { .job_entry = gate_job, .job_data = &parked };
+	FibersSystemJobDecl hold = { .job_entry = empty_job, .job_data = &parked };
+
+	Benchmark round_trip = *benchmark;
+	round_trip.n_samples = benchmark->n_samples < 50 ? benchmark->n_samples : 50;
+	Benchmark warm = round_trip;
+	warm.samples = malloc(sizeof(uint64_t) * warm.n_samples);
+	Benchmark wake = round_trip;
+	wake.samples = malloc(sizeof(uint64_t) * wake.n_samples);
+	const unsigned n_parked[] = { 0, 1024, MAX_PARKED };
+	const char *counters[] = { "shared_counter", "distinct_counters" };
+	FibersSystemCounter done = fibers_system_counter_create(fibers_system);
+	for (unsigned distinct = 0; distinct < 2; ++distinct) {
+		for (unsigned i = 0; i < MAX_PARKED; ++i)
+			fibers[i] = (ParkedFiber){ &parked, distinct ? &parked.counters[i] : &parked.gate };
+		for (unsigned n = 0; n < sizeof(n_parked) / sizeof(n_parked[0]); ++n) {
+			// One more run than samples, the first grows the fiber pool and is overwritten.
+			for (unsigned run = 0; run <= round_trip.n_samples; ++run) {
+				const unsigned s = run ? run - 1 : 0;
+				parked.arrived = 0;
+				parked.n_parked = (int32_t)n_parked[n];
+				fiber_event_init(&parked.all_arrived);
+				fiber_event_init(&parked.release);
+				fibers_system_run_jobs(fibers_system, &gate, 1, &parked.gate);
+				for (unsigned i = 0; distinct && i < n_parked[n]; ++i)
+					fibers_system_run_jobs_after(fibers_system, parked.gate, &hold, 1, &parked.counters[i]);
+				if (n_parked[n]) {
+					fibers_system_run_jobs(fibers_system, declarations, n_parked[n], &done);
+					fiber_event_wait(&parked.all_arrived);
+				}
+
+				uint64_t start = platform_time_ns();
+				run_job_and_wait(fibers_system, empty_job, &parked);
+				round_trip.samples[s] = platform_time_ns() - start;
+
+				start = platform_time_ns();
+				run_job_and_wait(fibers_system, empty_job, &parked);
+				warm.samples[s] = platform_time_ns() - start;
+
+				start = platform_time_ns();
+				fiber_event_set(&parked.release);
+				fibers_system_wait_for_counter(fibers_system, done, 0);
+				wake.samples[s] = platform_time_ns() - start;
+				fibers_system_wait_for_counter(fibers_system, parked.gate, 0);
+			}
+			char variant[64];
+			sprintf(variant, "%s_parked_%u", counters[distinct], n_parked[n]);
+			report(&round_trip, "wait_round_trip_with_parked_fibers", variant, "ns", 1);
+			report(&warm, "warm_wait_round_trip_with_parked_fibers", variant, "ns", 1);
+			if (n_parked[n])
+				report(&wake, "wake_parked_fibers", variant, "ns", n_parked[n]);
+		}
+	}
+	fibers_system_counter_destroy(fibers_system, done);
+	for (unsigned i = 0; i < MAX_PARKED; ++i)
+		fibers_system_counter_destroy(fibers_system, parked.counters[i]);
+	fibers_system_counter_destroy(fibers_system, parked.gate);
+	free(warm.samples);
+	free(wake.samples);
+	fibers_system_destroy(allocator, fibers_system);
+}
+
+// Two jobs hand a token back and forth through semaphores, every hand-over parks one fiber and resumes the other.
+enum { PING_PONG_ROUNDS = 256 };
+
+typedef struct PingPong
+{
+	FiberSemaphore ping;
+	FiberSemaphore pong;
+} PingPong;
+
+static void ping_job(void *data)
+{
+	PingPong *ping_pong = data;
+	for (unsigned i = 0; i < PING_PONG_ROUNDS; ++i) {
+		fiber_semaphore_signal(&ping_pong->pong, 1);
+		fiber_semaphore_wait(&ping_pong->ping);
+	}
+}
+
+static void pong_job(void *data)
+{
+	PingPong *ping_pong = data;
+	for (unsigned i = 0; i < PING_PONG_ROUNDS; ++i) {
+		fiber_semaphore_wait(&ping_pong->pong);
+		fiber_semaphore_signal(&ping_pong->ping, 1);
+	}
+}
+
+static void benchmark_switch(Benchmark *benchmark)
+{
+	FibersSystem *fibers_system = benchmark->fibers_system;
+	PingPong ping_pong;
+	uint64_t *switch_counts = malloc(sizeof(uint64_t) * benchmark->n_samples);
+	for (unsigned s = 0; s < benchmark->n_samples; ++s) {
+		fiber_semaphore_init(&ping_pong.ping, 0);
+		fiber_semaphore_init(&ping_pong.pong, 0);
+		FibersSystemJobDecl declarations[2] = { { .job_entry = ping_job, .job_data = &ping_pong }, { .job_entry = pong_job, .job_data = &ping_pong } };
+		FibersSystemCounter counter = { 0 };
+		const uint64_t switches = fibers_system_switch_count(fibers_system);
+		const uint64_t start = platform_time_ns();
+		fibers_system_run_jobs(fibers_system, declarations, 2, &counter);
+		fibers_system_wait_for_counter(fibers_system, counter, 0);
+		benchmark->samples[s] = platform_time_ns() - start;
+		switch_counts[s] = fibers_system_switch_count(fibers_system) - switches;
+	}
+	// Per hand-over, which is one switch on a single worker. POSIX targets other than x86-64 switch with swapcontext,
+	// which adds a system call for the signal mask to every switch.
+	report(benchmark, "fiber_switch", "semaphore_ping_pong", "ns", 2 * PING_PONG_ROUNDS);
+	memcpy(benchmark->samples, switch_counts, sizeof(uint64_t) * benchmark->n_samples);
+	report(benchmark, "fiber_switch", "semaphore_ping_pong", "switches", 2 * PING_PONG_ROUNDS);
+	free(switch_counts);
+}
+
+// Same shape as recursive_update in win_main, each level runs FAN_OUT children and waits for them.
+enum { FAN_OUT = 4 };
+
+typedef struct FanOut
+{
+	FibersSystem *fibers_system;
+	unsigned depth;
+} FanOut;
+
+static void fan_out_job(void *data)
+{
+	FanOut *fan_out = data;
+	if (!fan_out->depth)
+		return;
+
+	FanOut children[FAN_OUT];
+	FibersSystemJobDecl declarations[FAN_OUT];
+	for (unsigned i = 0; i < FAN_OUT; ++i) {
+		children[i] = (FanOut){ .fibers_system = fan_out->fibers_system, .depth = fan_out->depth - 1 };
+		declarations[i] = (FibersSystemJobDecl){ .job_entry = fan_out_job, .job_data = &children[i] };
+	}
+	FibersSystemCounter counter = { 0 };
+	fibers_system_run_jobs(fan_out->fibers_system, declarations, FAN_OUT, &counter);
+	fibers_system_wait_for_counter(fan_out->fibers_system, counter, 0);
+}
+
+static void benchmark_fan_out(Benchmark *benchmark)
+{
+	for (unsigned depth = 1; depth <= 6; ++depth) {
+		FanOut fan_out = { .fibers_system = benchmark->fibers_system, .depth = depth };
+		for (unsigned s = 0; s < benchmark->n_samples; ++s) {
+			const uint64_t start = platform_time_ns();
+			run_job_and_wait(benchmark->fibers_system, fan_out_job, &fan_out);
+			benchmark->samples[s] = platform_time_ns() - start;
+		}
+		char variant[32];
+		sprintf(variant, "depth_%u", depth);
+		report(benchmark, "nested_fan_out", variant, "ns", 1);
+	}
+}
+
+// The position update from win_main over a float array.
+enum { N_POSITIONS = 1 << 20 };
+
+typedef struct PositionUpdate
+{
+	float *positions;
+	const float *directions;
+	float dt;
+} PositionUpdate;
+
+static void update_positions(void *data, unsigned begin, unsigned end)
+{
+	PositionUpdate *update = data;
+	for (unsigned i = begin; i < end; ++i) {
+		update->positions[2 * i + 0] += update->directions[2 * i + 0] * update->dt;
+		update->positions[2 * i + 1] += update->directions[2 * i + 1] * update->dt;
+	}
+}
+
+// The same update at three sizes: small enough that splitting it barely pays, the win_main size and one that doesn't
+// fit in cache.
+static void benchmark_parallel_for(Benchmark *benchmark)
+{
+	enum { MAX_POSITIONS = 10000000 };
+	PositionUpdate update = { .positions = calloc(2 * (size_t)MAX_POSITIONS, sizeof(float)), .directions = NULL, .dt = 0.016f };
+	float *directions = malloc(2 * (size_t)MAX_POSITIONS * sizeof(float));
+	for (unsigned i = 0; i < 2 * MAX_POSITIONS; ++i)
+		directions[i] = (float)(i % 17) - 8.0f;
+	update.directions = directions;
+
+	const unsigned sizes[] = { 10000, N_POSITIONS, MAX_POSITIONS };
+	const char *names[] = { "parallel_for_10k_positions", "parallel_for_1m_positions", "parallel_for_10m_positions" };
+	const unsigned grains[] = { 0, 256, 4096, 65536 };
+	const unsigned n_samples = benchmark->n_samples;
+	FibersSystemCounter counter = fibers_system_counter_create(benchmark->fibers_system);
+	for (unsigned n = 0; n < sizeof(sizes) / sizeof(sizes[0]); ++n) {
+		if (sizes[n] == MAX_POSITIONS)
+			benchmark->n_samples = n_samples < 20 ? n_samples : 20;
+		for (unsigned g = 0; g < sizeof(grains) / sizeof(grains[0]); ++g) {
+			for (unsigned s = 0; s < benchmark->n_samples; ++s) {
+				const uint64_t start = platform_time_ns();
+				fibers_system_parallel_for(benchmark->fibers_system, 0, sizes[n], update_positions, &update, grains[g], &counter);
+				fibers_system_wait_for_counter(benchmark->fibers_system, counter, 0);
+				benchmark->samples[s] = platform_time_ns() - start;
+			}
+			char variant[32];
+			sprintf(variant, "grain_%u", grains[g]);
+			report(benchmark, names[n], variant, "ns", 1);
+		}
+
+		for (unsigned s = 0; s < benchmark->n_samples; ++s) {
+			const uint64_t start = platform_time_ns();
+			update_positions(&update, 0, sizes[n]);
+			benchmark->samples[s] = platform_time_ns() - start;
+		}
+		report(benchmark, names[n], "serial", "ns", 1);
+	}
+	benchmark->n_samples = n_samples;
+	fibers_system_counter_destroy(benchmark->fibers_system, counter);
+
+	free(directions);
+	free(update.positions);
+}
+
+// Jobs that need 4 KB of temporary memory, from the fiber's scratch arena or from the allocator.
+enum { SCRATCH_JOBS = 256, SCRATCH_BYTES = 4096 };
+
+typedef struct ScratchUse
+{
+	FibersSystem *fibers_system;
+	Allocator *allocator;
+	volatile int32_t sum;
+} ScratchUse;
+
+static void use_temporary(ScratchUse *use, unsigned char *temporary)
+{
+	memset(temporary, 1, SCRATCH_BYTES);
+	atomic_add_32(&use->sum, temporary[SCRATCH_BYTES - 1]);
+}
+
+static void scratch_job(void *data)
+{
+	ScratchUse *use = data;
+	use_temporary(use, fibers_system_scratch_alloc(use->fibers_system, SCRATCH_BYTES, 16));
+}
+
+static void allocator_job(void *data)
+{
+	ScratchUse *use = data;
+	unsigned char *temporary = allocator_realloc(use->allocator, NULL, SCRATCH_BYTES, 16);
+	use_temporary(use, temporary);
+	allocator_realloc(use->allocator, temporary, 0, 0);
+}
+
+static void benchmark_scratch(Benchmark *benchmark, Allocator *allocator)
+{
+	ScratchUse use = { .fibers_system = benchmark->fibers_system, .allocator = allocator };
+	const FibersSystemJobEntry entries[] = { scratch_job, allocator_job };
+	const char *variants[] = { "scratch_arena", "allocator_realloc" };
+	FibersSystemJobDecl declarations[SCRATCH_JOBS];
+	for (unsigned v = 0; v < 2; ++v) {
+		for (unsigned i = 0; i < SCRATCH_JOBS; ++i)
+			declarations[i] = (FibersSystemJobDecl){ .job_entry = entries[v], .job_data = &use };
+		for (unsigned s = 0; s < benchmark->n_samples; ++s) {
+			FibersSystemCounter counter = { 0 };
+			const uint64_t start = platform_time_ns();
+			fibers_system_run_jobs(benchmark->fibers_system, declarations, SCRATCH_JOBS, &counter);
+			fibers_system_wait_for_counter(benchmark->fibers_system, counter, 0);
+			benchmark->samples[s] = platform_time_ns() - start;
+		}
+		report(benchmark, "job_temporary_4kb", variants[v], "ns", SCRATCH_JOBS);
+	}
+}
+
+// A chain of dependent jobs, once with a fiber waiting on every link and once with continuations.
+enum { CHAIN_LENGTH = 10000 };
+
+static void chain_wait_job(void *data)
+{
+	FibersSystem *fibers_system = data;
+	for (unsigned i = 0; i < CHAIN_LENGTH; ++i)
+		run_job_and_wait(fibers_system, empty_job, fibers_system);
+}
+
+static void chain_after_job(void *data)
+{
+	FibersSystem *fibers_system = data;
+	FibersSystemJobDecl declaration = { .job_entry = empty_job, .job_data = fibers_system };
+	FibersSystemCounter previous = { 0 };
+	for (unsigned i = 0; i < CHAIN_LENGTH; ++i) {
+		FibersSystemCounter counter = { 0 };
+		fibers_system_run_jobs_after(fibers_system, previous, &declaration, 1, &counter);
+		previous = counter;
+	}
+	fibers_system_wait_for_counter(fibers_system, previous, 0);
+}
+
+static void benchmark_chain(Benchmark *benchmark)
+{
+	const FibersSystemJobEntry entries[] = { chain_wait_job, chain_after_job };
+	const char *variants[] = { "wait_per_link", "run_jobs_after" };
+	uint64_t *switch_counts = malloc(sizeof(uint64_t) * benchmark->n_samples);
+	for (unsigned v = 0; v < 2; ++v) {
+		for (unsigned s = 0; s < benchmark->n_samples; ++s) {
+			const uint64_t switches = fibers_system_switch_count(benchmark->fibers_system);
+			const uint64_t start = platform_time_ns();
+			run_job_and_wait(benchmark->fibers_system, entries[v], benchmark->fibers_system);
+			benchmark->samples[s] = platform_time_ns() - start;
+			switch_counts[s] = fibers_system_switch_count(benchmark->fibers_system) - switches;
+		}
+		report(benchmark, "dependent_chain_10k", variants[v], "ns", CHAIN_LENGTH);
+		memcpy(benchmark->samples, switch_counts, sizeof(uint64_t) * benchmark->n_samples);
+		report(benchmark, "dependent_chain_10k", variants[v], "switches", 1);
+	}
+	free(switch_counts);
+}
+
+// Every job takes the lock a number of times around a short critical section.
+enum { LOCK_JOBS = 64, LOCKS_PER_JOB = 256 };
+
+typedef struct LockContention
+{
+	FiberMutex fiber_mutex;
+	BenchmarkOsMutex os_mutex;
+	volatile uint64_t shared;
+} LockContention;
+
+static void fiber_mutex_job(void *data)
+{
+	LockContention *contention = data;
+	for (unsigned i = 0; i < LOCKS_PER_JOB; ++i) {
+		fiber_mutex_lock(&contention->fiber_mutex);
+		contention->shared = contention->shared * 31 + i;
+		fiber_mutex_unlock(&contention->fiber_mutex);
+	}
+}
+
+static void os_mutex_job(void *data)
+{
+	LockContention *contention = data;
+	for (unsigned i = 0; i < LOCKS_PER_JOB; ++i) {
+		os_mutex_lock(&contention->os_mutex);
+		contention->shared = contention->shared * 31 + i;
+		os_mutex_unlock(&contention->os_mutex);
+	}
+}
+
+static void benchmark_lock_contention(Benchmark *benchmark)
+{
+	LockContention contention;
+	fiber_mutex_init(&contention.fiber_mutex);
+	os_mutex_init(&contention.os_mutex);
+	contention.shared = 0;
+
+	const FibersSystemJobEntry entries[] = { fiber_mutex_job, os_mutex_job };
+	const char *variants[] = { "fiber_mutex", "os_mutex" };
+	FibersSystemJobDecl declarations[LOCK_JOBS];
+	for (unsigned v = 0; v < 2; ++v) {
+		for (unsigned i = 0; i < LOCK_JOBS; ++i)
+			declarations[i] = (FibersSystemJobDecl){ .job_entry = entries[v], .job_data = &contention };
+		for (unsigned s = 0; s < benchmark->n_samples; ++s) {
+			FibersSystemCounter counter = { 0 };
+			const uint64_t start = platform_time_ns();
+			fibers_system_run_jobs(benchmark->fibers_system, declarations, LOCK_JOBS, &counter);
+			fibers_system_wait_for_counter(benchmark->fibers_system, counter, 0);
+			benchmark->samples[s] = platform_time_ns() - start;
+		}
+		report(benchmark, "lock_contention", variants[v], "ns", LOCK_JOBS * LOCKS_PER_JOB);
+	}
+}
+
+// Time from submitting a job to it starting, with a backlog of low priority work queued just before it.
+typedef struct PriorityLatency
+{
+	uint64_t submitted;
+	uint64_t started;
+} PriorityLatency;
+
+static void busy_job(void *data)
+{
+	(void)data;
+	const uint64_t end = platform_time_ns() + 20000;
+	while (platform_time_ns() < end)
+		;
+}
+
+static void latency_job(void *data)
+{
+	PriorityLatency *latency = data;
+	latency->started = platform_time_ns();
+}
+
+static void benchmark_priority(Benchmark *benchmark)
+{
+	enum { N_BACKGROUND = 256 };
+	static FibersSystemJobDecl background[N_BACKGROUND];
+	for (unsigned i = 0; i < N_BACKGROUND; ++i)
+		background[i] = (FibersSystemJobDecl){ .job_entry = busy_job, .job_data = benchmark, .priority = FIBERS_SYSTEM_PRIORITY_LOW };
+
+	const unsigned priorities[] = { FIBERS_SYSTEM_PRIORITY_LOW, FIBERS_SYSTEM_PRIORITY_HIGH };
+	const char *variants[] = { "low_behind_low_backlog", "high_behind_low_backlog" };
+	for (unsigned v = 0; v < 2; ++v) {
+		for (unsigned s = 0; s < benchmark->n_samples; ++s) {
+			PriorityLatency latency = { 0 };
+			FibersSystemCounter background_counter = { 0 };
+			FibersSystemCounter counter = { 0 };
+			fibers_system_run_jobs(benchmark->fibers_system, background, N_BACKGROUND, &background_counter);
+			FibersSystemJobDecl declaration = { .job_entry = latency_job, .job_data = &latency, .priority = priorities[v] };
+			latency.submitted = platform_time_ns();
+			fibers_system_run_jobs(benchmark->fibers_system, &declaration, 1, &counter);
+			fibers_system_wait_for_counter(benchmark->fibers_system, counter, 0);
+			fibers_system_wait_for_counter(benchmark->fibers_system, background_counter, 0);
+			benchmark->samples[s] = latency.started - latency.submitted;
+		}
+		report(benchmark, "priority_start_latency", variants[v], "ns", 1);
+	}
+}
+
+// Start latency of jobs submitted to workers that have gone idle, and the CPU time the process burns meanwhile as a
+// stand-in for power. Bursty: a burst of jobs after 5 ms with nothing to do. Steady: one job every 200 us.
+typedef struct IdleWakeJob
+{
+	uint64_t submitted;
+	uint64_t started;
+} IdleWakeJob;
+
+static void idle_wake_job(void *data)
+{
+	IdleWakeJob *job = data;
+	job->started = platform_time_ns();
+	busy_job(data);
+}
+
+static void benchmark_idle_wake(Benchmark *benchmark)
+{
+	// The main thread sleeps between submissions, so it can't be the worker that picks the jobs up.
+	if (benchmark->n_workers < 2) {
+		fprintf(stderr, "The idle wake benchmark needs at least 2 workers, skipping it.\n");
+		return;
+	}
+
+	enum { BURST_PER_WORKER = 4, MAX_BURST = 4 * 64, STEADY_WINDOW = 25 };
+	static IdleWakeJob jobs[MAX_BURST];
+	static FibersSystemJobDecl declarations[MAX_BURST];
+	const unsigned n_burst = BURST_PER_WORKER * benchmark->n_workers < MAX_BURST ? BURST_PER_WORKER * benchmark->n_workers : MAX_BURST;
+	for (unsigned i = 0; i < MAX_BURST; ++i)
+		declarations[i] = (FibersSystemJobDecl){ .job_entry = idle_wake_job, .job_data = &jobs[i] };
+
+	Benchmark latency = *benchmark;
+	latency.n_samples = benchmark->n_samples < 50 ? benchmark->n_samples : 50;
+	Benchmark cpu = latency;
+	cpu.samples = malloc(sizeof(uint64_t) * cpu.n_samples);
+	FibersSystemCounter counter = fibers_system_counter_create(benchmark->fibers_system);
+
+	for (unsigned s = 0; s < latency.n_samples; ++s) {
+		const uint64_t wall_start = platform_time_ns();
+		const uint64_t cpu_start = process_cpu_ns();
+		platform_sleep_ns(5000000);
+		const uint64_t submitted = platform_time_ns();
+		fibers_system_run_jobs(benchmark->fibers_system, declarations, n_burst, &counter);
+		fibers_system_wait_for_counter(benchmark->fibers_system, counter, 0);
+		uint64_t last_start = submitted;
+		for (unsigned i = 0; i < n_burst; ++i)
+			last_start = jobs[i].started > last_start ? jobs[i].started : last_start;
+		latency.samples[s] = last_start - submitted;
+		cpu.samples[s] = (process_cpu_ns() - cpu_start) * 1000 / (platform_time_ns() - wall_start);
+	}
+	report(&latency, "idle_wake_latency", "bursty_last_start", "ns", 1);
+	report(&cpu, "idle_wake_cpu", "bursty", "percent", 10);
+
+	for (unsigned s = 0; s < latency.n_samples; ++s) {
+		const uint64_t wall_start = platform_time_ns();
+		const uint64_t cpu_start = process_cpu_ns();
+		for (unsigned i = 0; i < STEADY_WINDOW; ++i) {
+			const uint64_t tick = wall_start + (uint64_t)(i + 1) * 200000;
+			const uint64_t now = platform_time_ns();
+			if (now < tick)
+				platform_sleep_ns(tick - now);
+			jobs[i].submitted = platform_time_ns();
+			fibers_system_run_jobs(benchmark->fibers_system, &declarations[i], 1, &counter);
+		}
+		fibers_system_wait_for_counter(benchmark->fibers_system, counter, 0);
+		uint64_t total = 0;
+		for (unsigned i = 0; i < STEADY_WINDOW; ++i)
+			total += jobs[i].started - jobs[i].submitted;
+		latency.samples[s] = total;
+		cpu.samples[s] = (process_cpu_ns() - cpu_start) * 1000 / (platform_time_ns() - wall_start);
+	}
+	report(&latency, "idle_wake_latency", "steady_200us", "ns", STEADY_WINDOW);
+	report(&cpu, "idle_wake_cpu", "steady_200us", "percent", 10);
+
+	fibers_system_counter_destroy(benchmark->fibers_system, counter);
+	free(cpu.samples);
+}
+
+// Cost of recording a trace on batches of empty jobs, of jobs doing a fixed amount of work and of two such jobs in
+// turns. Back to back runs of one job are a single trace event, so the mixed batch is the one paying a timestamp per
+// job. Batches run with the recording on and off in turns so both see the same drift, or only untraced with tracing
+// compiled out.
+#if FIBERS_SYSTEM_TRACE
+#define TRACE_VARIANT(traced, job) (traced ? "traced_" job : "untraced_" job)
+#else
+#define TRACE_VARIANT(traced, job) "compiled_out_" job
+#endif
+
+typedef struct TraceWork
+{
+	unsigned n_rounds;
+	volatile uint32_t sink;
+} TraceWork;
+
+static void trace_work_job(void *data)
+{
+	TraceWork *work = data;
+	// xorshift32 never reaches 0, the store only keeps the loop from being optimized out.
+	uint32_t x = 0x9e3779b9u;
+	for (unsigned i = 0; i < work->n_rounds; ++i) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+	}
+	if (!x)
+		work->sink = x;
+}
+
+// The same work from another entry, so it's a different job in the trace.
+static void trace_other_work_job(void *data)
+{
+	TraceWork *work = data;
+	uint32_t x = 0x2545f491u;
+	for (unsigned i = 0; i < work->n_rounds; ++i) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+	}
+	if (!x)
+		work->sink = x;
+}
+
+static uint64_t run_trace_batch(FibersSystem *fibers_system, FibersSystemJobDecl *declarations, FibersSystemCounter counter, int traced)
+{
+	if (traced)
+		fibers_system_trace_start(fibers_system);
+	const uint64_t start = platform_time_ns();
+	fibers_system_run_jobs(fibers_system, declarations, SPAWN_BATCH, &counter);
+	fibers_system_wait_for_counter(fibers_system, counter, 0);
+	const uint64_t ns = platform_time_ns() - start;
+	if (traced)
+		fibers_system_trace_stop(fibers_system);
+	return ns;
+}
+
+// Writes the last traced batch, of the mixed jobs, to trace_path if it's set.
+static void benchmark_trace(Benchmark *benchmark, const char *trace_path)
+{
+	static TraceWork empty = { .n_rounds = 0 };
+	static TraceWork work = { .n_rounds = 256 };
+	static FibersSystemJobDecl declarations[SPAWN_BATCH];
+	Benchmark traced = *benchmark;
+	traced.samples = malloc(sizeof(uint64_t) * traced.n_samples);
+	FibersSystemCounter counter = fibers_system_counter_create(benchmark->fibers_system);
+
+	for (unsigned w = 0; w < 3; ++w) {
+		for (unsigned i = 0; i < SPAWN_BATCH; ++i) {
+			const FibersSystemJobEntry entry = w == 2 && (i & 1) ? trace_other_work_job : trace_work_job;
+			declarations[i] = (FibersSystemJobDecl){ .job_entry = entry, .job_data = w ? &work : &empty };
+		}
+		for (unsigned s = 0; s < benchmark->n_samples; ++s) {
+#if FIBERS_SYSTEM_TRACE
+			traced.samples[s] = run_trace_batch(benchmark->fibers_system, declarations, counter, 1);
+#endif
+			benchmark->samples[s] = run_trace_batch(benchmark->fibers_system, declarations, counter, 0);
+		}
+		const char *traced_variants[] = { TRACE_VARIANT(1, "empty_job"), TRACE_VARIANT(1, "work_job"), TRACE_VARIANT(1, "mixed_work_jobs") };
+		const char *untraced_variants[] = { TRACE_VARIANT(0, "empty_job"), TRACE_VARIANT(0, "work_job"), TRACE_VARIANT(0, "mixed_work_jobs") };
+#if FIBERS_SYSTEM_TRACE
+		report(&traced, "trace_overhead", traced_variants[w], "ns", SPAWN_BATCH);
+#else
+		(void)traced_variants;
+#endif
+		report(benchmark, "trace_overhead", untraced_variants[w], "ns", SPAWN_BATCH);
+	}
+
+	FILE *file = trace_path ? fopen(trace_path, "w") : NULL;
+	if (file) {
+		fibers_system_trace_dump(benchmark->fibers_system, file);
+		fclose(file);
+	} else if (trace_path) {
+		fprintf(stderr, "Can't write the trace to %s\n", trace_path);
+	}
+	fibers_system_counter_destroy(benchmark->fibers_system, counter);
+	free(traced.samples);
+}
+
+// A frame shaped like the one in win_main: update positions in chunks, then upload, build text quads and render.
+enum { FRAME_CHUNKS = 8 };
+
+typedef struct FrameNode
+{
+	PositionUpdate *update;
+	unsigned begin;
+	unsigned end;
+	unsigned spin_ns;
+} FrameNode;
+
+static void frame_update_job(void *data)
+{
+	FrameNode *node = data;
+	update_positions(node->update, node->begin, node->end);
+}
+
+static void frame_spin_job(void *data)
+{
+	FrameNode *node = data;
+	const uint64_t end = platform_time_ns() + node->spin_ns;
+	while (platform_time_ns() < end)
+		;
+}
+
+static void benchmark_task_graph(Benchmark *benchmark, Allocator *allocator)
+{
+	PositionUpdate update = { .positions = calloc(2 * N_POSITIONS, sizeof(float)), .directions = NULL, .dt = 0.016f };
+	float *directions = calloc(2 * N_POSITIONS, sizeof(float));
+	update.directions = directions;
+
+	FrameNode nodes[FRAME_CHUNKS + 3];
+	FibersSystemTaskGraph *graph = fibers_system_task_graph_create(allocator);
+	for (unsigned i = 0; i < FRAME_CHUNKS; ++i) {
+		nodes[i] = (FrameNode){ .update = &update, .begin = i * (N_POSITIONS / FRAME_CHUNKS), .end = (i + 1) * (N_POSITIONS / FRAME_CHUNKS) };
+		fibers_system_task_graph_add_node(graph, (FibersSystemJobDecl){ .job_entry = frame_update_job, .job_data = &nodes[i] });
+	}
+	const unsigned upload = FRAME_CHUNKS, text = FRAME_CHUNKS + 1, render = FRAME_CHUNKS + 2;
+	nodes[upload] = (FrameNode){ .spin_ns = 200000 };
+	nodes[text] = (FrameNode){ .spin_ns = 100000 };
+	nodes[render] = (FrameNode){ .spin_ns = 300000 };
+	fibers_system_task_graph_add_node(graph, (FibersSystemJobDecl){ .job_entry = frame_spin_job, .job_data = &nodes[upload], .priority = FIBERS_SYSTEM_PRIORITY_MAIN_THREAD });
+	fibers_system_task_graph_add_node(graph, (FibersSystemJobDecl){ .job_entry = frame_spin_job, .job_data = &nodes[text] });
+	fibers_system_task_graph_add_node(graph, (FibersSystemJobDecl){ .job_entry = frame_spin_job, .job_data = &nodes[render], .priority = FIBERS_SYSTEM_PRIORITY_MAIN_THREAD });
+	for (unsigned i = 0; i < FRAME_CHUNKS; ++i)
+		fibers_system_task_graph_add_edge(graph, i, upload);
+	fibers_system_task_graph_add_edge(graph, upload, render);
+	fibers_system_task_graph_add_edge(graph, text, render);
+
+	uint64_t *critical_path = malloc(sizeof(uint64_t) * benchmark->n_samples);
+	uint64_t *idle = malloc(sizeof(uint64_t) * benchmark->n_samples);
+	FibersSystemCounter counter = fibers_system_counter_create(benchmark->fibers_system);
+	for (unsigned s = 0; s < benchmark->n_samples; ++s) {
+		fibers_system_task_graph_run(benchmark->fibers_system, graph, &counter);
+		fibers_system_wait_for_counter(benchmark->fibers_system, counter, 0);
+
+		FibersSystemTaskGraphReport graph_report = { 0 };
+		fibers_system_task_graph_report(benchmark->fibers_system, graph, &graph_report);
+		benchmark->samples[s] = graph_report.span_ns;
+		critical_path[s] = graph_report.critical_path_ns;
+		idle[s] = graph_report.idle_ns;
+	}
+	fibers_system_counter_destroy(benchmark->fibers_system, counter);
+	report(benchmark, "frame_graph", "span", "ns", 1);
+	memcpy(benchmark->samples, critical_path, sizeof(uint64_t) * benchmark->n_samples);
+	report(benchmark, "frame_graph", "critical_path", "ns", 1);
+	memcpy(benchmark->samples, idle, sizeof(uint64_t) * benchmark->n_samples);
+	report(benchmark, "frame_graph", "worker_idle", "ns", 1);
+
+	fibers_system_task_graph_destroy(allocator, graph);
+	free(idle);
+	free(critical_path);
+	free(directions);
+	free(update.positions);
+}
+
+// Loads 10k small files in 100 loader jobs while a simulation job keeps updating positions, with blocking stdio reads
+// and with async reads that park the loader instead of the worker. Reads from the page cache never block, so there the
+// async reads only add the hand-offs to the completion thread and back. Cold reads, of files dropped from the cache
+// before every sample where that can be done, are the ones that block. Next to the time per file the rows give how
+// long the simulation took meanwhile, against simulation_alone without any loads.
+enum { N_FILES = 10000, FILE_SIZE = 4096, FILES_PER_LOADER = 100, SIMULATION_STEPS = 8 };
+
+typedef struct FileLoad
+{
+	FibersSystem *fibers_system;
+	unsigned first_file;
+	char *buffers;
+	unsigned *bytes_read;
+	int async;
+} FileLoad;
+
+#define FILES_DIRECTORY "fibers_system_benchmark_files"
+
+static void file_path(char *path, unsigned file)
+{
+	sprintf(path, FILES_DIRECTORY "/%05u.bin", file);
+}
+
+// The first n_files files and then the directory, so a run leaves nothing behind.
+static void remove_files(unsigned n_files)
+{
+	char path[64];
+	for (unsigned i = 0; i < n_files; ++i) {
+		file_path(path, i);
+		remove(path);
+	}
+	remove_directory(FILES_DIRECTORY);
+}
+
+static void load_files_job(void *data)
+{
+	FileLoad *load = data;
+	char path[64];
+	FibersSystemCounter counter = { 0 };
+	for (unsigned i = load->first_file; i < load->first_file + FILES_PER_LOADER; ++i) {
+		file_path(path, i);
+		if (load->async) {
+			fibers_system_async_read(load->fibers_system, path, 0, FILE_SIZE, load->buffers + (size_t)i * FILE_SIZE, &load->bytes_read[i], &counter);
+		} else {
+			FILE *file = fopen(path, "rb");
+			load->bytes_read[i] = file ? (unsigned)fread(load->buffers + (size_t)i * FILE_SIZE, 1, FILE_SIZE, file) : 0;
+			if (file)
+				fclose(file);
+		}
+	}
+	fibers_system_wait_for_counter(load->fibers_system, counter, 0);
+}
+
+typedef struct Simulation
+{
+	FibersSystem *fibers_system;
+	PositionUpdate *update;
+	uint64_t duration;
+} Simulation;
+
+static void simulation_job(void *data)
+{
+	Simulation *simulation = data;
+	const uint64_t start = platform_time_ns();
+	for (unsigned step = 0; step < SIMULATION_STEPS; ++step) {
+		FibersSystemCounter counter = { 0 };
+		fibers_system_parallel_for(simulation->fibers_system, 0, N_POSITIONS, update_positions, simulation->update, 0, &counter);
+		fibers_system_wait_for_counter(simulation->fibers_system, counter, 0);
+	}
+	simulation->duration = platform_time_ns() - start;
+}
+
+static void benchmark_file_loads(Benchmark *benchmark)
+{
+	make_directory(FILES_DIRECTORY);
+	char *buffers = malloc((size_t)N_FILES * FILE_SIZE);
+	unsigned *bytes_read = malloc(sizeof(unsigned) * N_FILES);
+	memset(buffers, 0x5a, (size_t)N_FILES * FILE_SIZE);
+	char path[64];
+	for (unsigned i = 0; i < N_FILES; ++i) {
+		file_path(path, i);
+		FILE *file = fopen(path, "wb");
+		if (!file) {
+			fprintf(stderr, "Can't write %s, skipping the file load benchmark.\n", path);
+			remove_files(i);
+			free(bytes_read);
+			free(buffers);
+			return;
+		}
+		fwrite(buffers, 1, FILE_SIZE, file);
+		fclose(file);
+	}
+
+	PositionUpdate update = { .positions = calloc(2 * N_POSITIONS, sizeof(float)), .directions = NULL, .dt = 0.016f };
+	float *directions = calloc(2 * N_POSITIONS, sizeof(float));
+	update.directions = directions;
+	Simulation simulation = { .fibers_system = benchmark->fibers_system, .update = &update };
+
+	static FileLoad loads[N_FILES / FILES_PER_LOADER];
+	static FibersSystemJobDecl declarations[N_FILES / FILES_PER_LOADER + 1];
+	const unsigned n_samples = benchmark->n_samples;
+	benchmark->n_samples = n_samples < 10 ? n_samples : 10;
+	Benchmark simulation_time = *benchmark;
+	simulation_time.samples = malloc(sizeof(uint64_t) * simulation_time.n_samples);
+
+	for (unsigned s = 0; s < simulation_time.n_samples; ++s) {
+		run_job_and_wait(benchmark->fibers_system, simulation_job, &simulation);
+		simulation_time.samples[s] = simulation.duration;
+	}
+	report(&simulation_time, "load_10k_files_simulation", "simulation_alone", "ns", 1);
+
+	const char *variants[] = { "blocking_page_cache", "async_page_cache", "blocking_cold", "async_cold" };
+	declarations[0] = (FibersSystemJobDecl){ .job_entry = simulation_job, .job_data = &simulation };
+	for (unsigned v = 0; v < 4; ++v) {
+		const int async = v & 1;
+		const int cold = v >> 1;
+		file_path(path, 0);
+		if (cold && !evict_file(path)) {
+			fprintf(stderr, "Can't drop files from the page cache, skipping the cold file loads.\n");
+			break;
+		}
+
+		for (unsigned i = 0; i < N_FILES / FILES_PER_LOADER; ++i) {
+			loads[i] = (FileLoad){ .fibers_system = benchmark->fibers_system, .first_file = i * FILES_PER_LOADER, .buffers = buffers, .bytes_read = bytes_read, .async = async };
+			declarations[i + 1] = (FibersSystemJobDecl){ .job_entry = load_files_job, .job_data = &loads[i] };
+		}
+		for (unsigned s = 0; s < benchmark->n_samples; ++s) {
+			for (unsigned i = 0; cold && i < N_FILES; ++i) {
+				file_path(path, i);
+				evict_file(path);
+			}
+			memset(bytes_read, 0, sizeof(unsigned) * N_FILES);
+			FibersSystemCounter counter = { 0 };
+			const uint64_t start = platform_time_ns();
+			fibers_system_run_jobs(benchmark->fibers_system, declarations, N_FILES / FILES_PER_LOADER + 1, &counter);
+			fibers_system_wait_for_counter(benchmark->fibers_system, counter, 0);
+			benchmark->samples[s] = platform_time_ns() - start;
+			simulation_time.samples[s] = simulation.duration;
+			for (unsigned i = 0; i < N_FILES; ++i) {
+				if (bytes_read[i] != FILE_SIZE)
+					fprintf(stderr, "Short read of file %u: %u bytes.\n", i, bytes_read[i]);
+			}
+		}
+		report(benchmark, "load_10k_files", variants[v], "ns", N_FILES);
+		report(&simulation_time, "load_10k_files_simulation", variants[v], "ns", 1);
+	}
+	benchmark->n_samples = n_samples;
+	free(simulation_time.samples);
+
+	remove_files(N_FILES);
+	free(directions);
+	free(update.positions);
+	free(bytes_read);
+	free(buffers);
+}
+
+int main(int argc, char **argv)
+{
+	const unsigned n_workers = argc > 1 ? (unsigned)atoi(argv[1]) : 0;
+	const unsigned n_samples = argc > 2 ? (unsigned)atoi(argv[2]) : 200;
+
+	char allocator_buffer[256];
+	Allocator *allocator = create_allocator(allocator_buffer, sizeof(allocator_buffer));
+	FibersSystemStackPool stack_pools[FIBERS_SYSTEM_N_STACK_CLASSES] = { { 64 * 1024, 64, 1024 }, { 512 * 1024, 4, 16 } };
+	FibersSystem *fibers_system = fibers_system_create(allocator, stack_pools, n_workers);
+
+	Benchmark benchmark = { .fibers_system = fibers_system, .n_workers = fibers_system_worker_count(fibers_system), .n_samples = n_samples ? n_samples : 1 };
+	benchmark.samples = malloc(sizeof(uint64_t) * benchmark.n_samples);
+
+	printf("benchmark,variant,workers,samples,unit,p50,p99,min,max\n");
+	benchmark_spawn(&benchmark);
+	benchmark_spawn_payload(&benchmark);
+	benchmark_wait_round_trip(&benchmark);
+	benchmark_switch(&benchmark);
+	benchmark_fan_out(&benchmark);
+	benchmark_parallel_for(&benchmark);
+	benchmark_chain(&benchmark);
+	benchmark_scratch(&benchmark, allocator);
+	benchmark_lock_contention(&benchmark);
+	benchmark_priority(&benchmark);
+	benchmark_idle_wake(&benchmark);
+	benchmark_trace(&benchmark, argc > 3 ? argv[3] : NULL);
+	benchmark_task_graph(&benchmark, allocator);
+	benchmark_file_loads(&benchmark);
+	fibers_system_destroy(allocator, fibers_system);
+
+	// These create fibers systems of their own, and a thread can only be in one at a time.
+	benchmark.fibers_system = NULL;
+	benchmark_queue_scaling(&benchmark, allocator);
+	benchmark_parked_fibers(&benchmark, allocator);
+
+	free(benchmark.samples);
+	destroy_allocator(allocator);
+	return 0;
+}
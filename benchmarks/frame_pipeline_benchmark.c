@@ -0,0 +1,149 @@
+// Headless frame loop on the null device. Simulates 1M positions per frame and submits them through the pipeline at
+// each depth, printing the p50 and p99 of the frame time and the latency from simulation start to present.
+//
+// cc -O2 -DNDEBUG -I../sandbox frame_pipeline_benchmark.c ../sandbox/frame_pipeline.c ../sandbox/null_device.c ../sandbox/fibers_system.c ../sandbox/platform.c ../sandbox/allocator.c ../sandbox/tlsf.c ../sandbox/slab.c -lpthread -o frame_pipeline_benchmark
+// ./frame_pipeline_benchmark [n_workers] [n_frames] [render_us] [refresh_hz]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "allocator.h"
+#include "fibers_system.h"
+#include "frame_pipeline.h"
+#include "null_device.h"
+#include "platform.h"
+
+enum { N_POSITIONS = 1 << 20 };
+enum { MAX_DEPTH = 3 };
+
+typedef struct PositionUpdate
+{
+	float *positions;
+	float *directions;
+	float dt;
+} PositionUpdate;
+
+static void update_positions(void *data, unsigned begin, unsigned end)
+{
+	PositionUpdate *update = data;
+	for (unsigned i = begin; i < end; ++i) {
+		for (unsigned j = 2 * i; j < 2 * i + 2; ++j) {
+			if (update->positions[j] < -1000.0f || update->positions[j] > 1000.0f)
+				update->directions[j] *= -1.0f;
+			update->positions[j] += update->directions[j] * update->dt;
+		}
+	}
+}
+
+typedef struct FrameBenchmark
+{
+	FibersSystem *fibers_system;
+	NullDevice *device;
+	FramePipeline *pipeline;
+	unsigned depth;
+	float *positions[MAX_DEPTH];
+	float *directions[MAX_DEPTH];
+	FibersSystemCounter update_counter;
+} FrameBenchmark;
+
+static void simulate(void *data, unsigned frame, unsigned slot, float dt)
+{
+	(void)frame;
+	FrameBenchmark *benchmark = data;
+	const unsigned previous = (slot + benchmark->depth - 1) % benchmark->depth;
+	if (previous != slot) {
+		memcpy(benchmark->positions[slot], benchmark->positions[previous], 2 * N_POSITIONS * sizeof(float));
+		memcpy(benchmark->directions[slot], benchmark->directions[previous], 2 * N_POSITIONS * sizeof(float));
+	}
+
+	PositionUpdate update = { .positions = benchmark->positions[slot], .directions = benchmark->directions[slot], .dt = dt };
+	fibers_system_parallel_for(benchmark->fibers_system, 0, N_POSITIONS, update_positions, &update, 0, &benchmark->update_counter);
+	fibers_system_wait_for_counter(benchmark->fibers_system, benchmark->update_counter, 0);
+}
+
+static void submit(void *data, unsigned frame, unsigned slot)
+{
+	(void)frame;
+	FrameBenchmark *benchmark = data;
+	null_device_upload(benchmark->device, benchmark->positions[slot], 2 * N_POSITIONS * sizeof(float));
+	null_device_clear(benchmark->device);
+	null_device_render(benchmark->device, N_POSITIONS);
+	null_device_present(benchmark->device);
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+	const uint64_t x = *(const uint64_t *)a;
+	const uint64_t y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void report(const char *name, unsigned depth, unsigned n_workers, uint64_t *samples, unsigned n)
+{
+	qsort(samples, n, sizeof(uint64_t), compare_samples);
+	const unsigned p99 = (n * 99) / 100 < n ? (n * 99) / 100 : n - 1;
+	printf("%s,depth_%u,%u,%u,us,%.1f,%.1f,%.1f,%.1f\n", name, depth, n_workers, n, samples[n / 2] * 1e-3, samples[p99] * 1e-3, samples[0] * 1e-3, samples[n - 1] * 1e-3);
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	const unsigned n_workers = argc > 1 ? (unsigned)atoi(argv[1]) : 0;
+	const unsigned n_frames = argc > 2 && atoi(argv[2]) > 0 ? (unsigned)atoi(argv[2]) : 200;
+	const unsigned render_us = argc > 3 ? (unsigned)atoi(argv[3]) : 2000;
+	const unsigned refresh_hz = argc > 4 ? (unsigned)atoi(argv[4]) : 0;
+
+	char allocator_buffer[256];
+	Allocator *allocator = create_allocator(allocator_buffer, sizeof(allocator_buffer));
+	FibersSystemStackPool stack_pools[FIBERS_SYSTEM_N_STACK_CLASSES] = { { 64 * 1024, 64, 1024 }, { 512 * 1024, 4, 16 } };
+	FibersSystem *fibers_system = fibers_system_create(allocator, stack_pools, n_workers);
+	const unsigned worker_count = fibers_system_worker_count(fibers_system);
+
+	FrameBenchmark benchmark = { .fibers_system = fibers_system };
+	null_device_create(allocator, render_us * 1000, refresh_hz, &benchmark.device);
+	for (unsigned i = 0; i < MAX_DEPTH; ++i) {
+		benchmark.positions[i] = malloc(2 * N_POSITIONS * sizeof(float));
+		benchmark.directions[i] = malloc(2 * N_POSITIONS * sizeof(float));
+	}
+	benchmark.update_counter = fibers_system_counter_create(fibers_system);
+
+	uint64_t *frame_samples = malloc(sizeof(uint64_t) * n_frames);
+	uint64_t *latency_samples = malloc(sizeof(uint64_t) * n_frames);
+	printf("benchmark,variant,workers,samples,unit,p50,p99,min,max\n");
+	for (unsigned depth = 1; depth <= MAX_DEPTH; ++depth) {
+		// Same starting state for every depth, in the slot the first frame is simulated from.
+		for (unsigned i = 0; i < 2 * N_POSITIONS; ++i) {
+			benchmark.positions[depth - 1][i] = (float)(i % 2000) - 1000.0f;
+			benchmark.directions[depth - 1][i] = (float)(i % 17) - 8.0f;
+		}
+		benchmark.depth = depth;
+		FramePipelineDesc desc = { .depth = depth, .simulate = simulate, .submit = submit, .data = &benchmark };
+		benchmark.pipeline = frame_pipeline_create(allocator, fibers_system, &desc);
+
+		// The first frame has no frame time, run one more than asked for.
+		frame_pipeline_frame(benchmark.pipeline);
+		FramePipelineStats stats;
+		for (unsigned i = 0; i < n_frames; ++i) {
+			frame_pipeline_frame(benchmark.pipeline);
+			frame_pipeline_stats(benchmark.pipeline, &stats);
+			frame_samples[i] = stats.last_frame_ns;
+			latency_samples[i] = stats.last_latency_ns;
+		}
+		report("frame_time", depth, worker_count, frame_samples, n_frames);
+		report("latency", depth, worker_count, latency_samples, n_frames);
+		frame_pipeline_destroy(allocator, benchmark.pipeline);
+	}
+
+	free(latency_samples);
+	free(frame_samples);
+	fibers_system_counter_destroy(fibers_system, benchmark.update_counter);
+	for (unsigned i = 0; i < MAX_DEPTH; ++i) {
+		free(benchmark.positions[i]);
+		free(benchmark.directions[i]);
+	}
+	null_device_destroy(allocator, benchmark.device);
+	fibers_system_destroy(allocator, fibers_system);
+	destroy_allocator(allocator);
+	return 0;
+}
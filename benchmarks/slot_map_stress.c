@@ -0,0 +1,144 @@
+// Randomized inserts and erases against a model of which handle each slot should answer to. Erases and gets of stale
+// handles, double erases included, have to be refused and live items have to keep their contents. Prints the first
+// mismatch and exits with 1, or the number of operations run. Checks explicitly, so it means the same with -DNDEBUG.
+//
+// cc -O2 -I../sandbox slot_map_stress.c ../sandbox/slot_map.c ../sandbox/allocator.c ../sandbox/tlsf.c ../sandbox/slab.c ../sandbox/platform.c -lpthread -o slot_map_stress
+// ./slot_map_stress [n_operations] [seed]
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "allocator.h"
+#include "slot_map.h"
+
+// Few enough live items that slots are reused, and their generations wrap, many times over.
+enum { MAX_LIVE = 4096, N_STALE = 256, NO_HANDLE = 0xFFFFFFFFU };
+
+typedef struct Item
+{
+	unsigned handle;
+	unsigned key;
+} Item;
+
+typedef struct Model
+{
+	// The handle the slot holds an item for, NO_HANDLE while it's free.
+	unsigned slot_handles[SLOT_MAP_MAX_ITEMS];
+	unsigned slot_keys[SLOT_MAP_MAX_ITEMS];
+	unsigned live[MAX_LIVE];
+	unsigned n_live;
+	// Erased handles, overwritten round robin.
+	unsigned stale[N_STALE];
+	unsigned n_stale;
+} Model;
+
+static unsigned random_state;
+
+static unsigned random_next(void)
+{
+	// xorshift32
+	unsigned x = random_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	random_state = x;
+	return x;
+}
+
+static unsigned handle_slot(unsigned handle)
+{
+	return handle & (SLOT_MAP_MAX_ITEMS - 1);
+}
+
+static int fail(unsigned long long op, const char *what, unsigned handle)
+{
+	fprintf(stderr, "Operation %llu: %s, handle %#x\n", op, what, handle);
+	return 1;
+}
+
+static int check_item(SlotMap *map, Model *model, unsigned long long op, unsigned handle)
+{
+	const Item *item = slot_map_get(map, handle);
+	if (!slot_map_contains(map, handle) || !item)
+		return fail(op, "live handle doesn't resolve", handle);
+	if (item->handle != handle || item->key != model->slot_keys[handle_slot(handle)])
+		return fail(op, "live item changed", handle);
+	return 0;
+}
+
+// A stale handle only resolves again once its slot has been reused until the generation wrapped back to it.
+static int check_stale(SlotMap *map, Model *model, unsigned long long op, unsigned handle)
+{
+	if (model->slot_handles[handle_slot(handle)] == handle)
+		return check_item(map, model, op, handle);
+	if (slot_map_contains(map, handle) || slot_map_get(map, handle))
+		return fail(op, "stale handle resolves", handle);
+	const unsigned count = slot_map_count(map);
+	if (slot_map_erase(map, handle) || slot_map_count(map) != count)
+		return fail(op, "stale handle erased", handle);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const unsigned long long n_operations = argc > 1 && atoll(argv[1]) > 0 ? (unsigned long long)atoll(argv[1]) : 10000000ull;
+	random_state = argc > 2 && atoi(argv[2]) ? (unsigned)atoi(argv[2]) : 0x9e3779b9u;
+
+	char allocator_buffer[256];
+	Allocator *allocator = create_allocator(allocator_buffer, sizeof(allocator_buffer));
+	static Model model;
+	for (unsigned i = 0; i < SLOT_MAP_MAX_ITEMS; ++i)
+		model.slot_handles[i] = NO_HANDLE;
+	SlotMap map;
+	slot_map_create(&map, allocator, sizeof(Item));
+
+	unsigned next_key = 0;
+	for (unsigned long long op = 0; op < n_operations; ++op) {
+		const unsigned r = random_next();
+		// Drift between mostly inserting and mostly erasing so the map fills up and drains again.
+		const int grow = (op >> 16) & 1 ? r % 8 < 3 : r % 8 < 5;
+		if (grow ? model.n_live < MAX_LIVE : !model.n_live) {
+			const Item item = { 0, next_key++ };
+			const unsigned handle = slot_map_insert(&map, &item);
+			const unsigned slot = handle_slot(handle);
+			if (model.slot_handles[slot] != NO_HANDLE)
+				return fail(op, "insert handed out a slot in use", handle);
+			((Item *)slot_map_get(&map, handle))->handle = handle;
+			model.slot_handles[slot] = handle;
+			model.slot_keys[slot] = item.key;
+			model.live[model.n_live++] = handle;
+		} else {
+			const unsigned i = random_next() % model.n_live;
+			const unsigned handle = model.live[i];
+			if (check_item(&map, &model, op, handle))
+				return 1;
+			if (!slot_map_erase(&map, handle))
+				return fail(op, "live handle not erased", handle);
+			model.slot_handles[handle_slot(handle)] = NO_HANDLE;
+			model.live[i] = model.live[--model.n_live];
+			model.stale[model.n_stale++ % N_STALE] = handle;
+			// Right away, while nothing has reused the slot yet.
+			if (check_stale(&map, &model, op, handle))
+				return 1;
+		}
+
+		if (model.n_stale && check_stale(&map, &model, op, model.stale[random_next() % (model.n_stale < N_STALE ? model.n_stale : N_STALE)]))
+			return 1;
+		// Handles that were never handed out, the slot past the last one or a generation no insert gave it yet.
+		if (check_stale(&map, &model, op, random_next() & 0xFFFFFF))
+			return 1;
+		if (slot_map_count(&map) != model.n_live)
+			return fail(op, "count is off", model.n_live);
+		if ((op & 0xFFFF) == 0) {
+			for (unsigned i = 0; i < model.n_live; ++i) {
+				if (check_item(&map, &model, op, model.live[i]))
+					return 1;
+			}
+		}
+	}
+
+	slot_map_destroy(&map);
+	destroy_allocator(allocator);
+	printf("%llu operations, no mismatches\n", n_operations);
+	return 0;
+}
@@ -0,0 +1,117 @@
+// Pushes into one stretchy buffer growing by doubling through an allocator against one that commits pages of a reserved
+// range. Peak RSS is per process, so each variant runs on its own and prints one CSV row with the p50 and p99 per push,
+// the slowest single push, which is where a doubling buffer copies, and the peak RSS of the run.
+//
+// cc -O2 -DNDEBUG -I../sandbox stretchy_buffer_benchmark.c ../sandbox/allocator.c ../sandbox/tlsf.c ../sandbox/slab.c ../sandbox/platform.c -lpthread -o stretchy_buffer_benchmark
+// for v in system tlsf reserved; do ./stretchy_buffer_benchmark $v [n_pushes] [n_samples]; done
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "allocator.h"
+#include "platform.h"
+#include "stretchy_buffer.h"
+
+#if defined(_WIN32)
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
+enum { TLSF_POOL_SIZE = 1024 * 1024 * 1024 };
+
+typedef struct Item
+{
+	uint64_t key;
+	uint64_t value;
+} Item;
+
+static uint64_t peak_rss_bytes(void)
+{
+#if defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS counters;
+	GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+	return counters.PeakWorkingSetSize;
+#elif defined(__APPLE__)
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return (uint64_t)usage.ru_maxrss;
+#else
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return (uint64_t)usage.ru_maxrss * 1024;
+#endif
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+	const uint64_t x = *(const uint64_t *)a;
+	const uint64_t y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv)
+{
+	const char *variant = argc > 1 ? argv[1] : "reserved";
+	const unsigned n_pushes = argc > 2 && atoi(argv[2]) > 0 ? (unsigned)atoi(argv[2]) : 1 << 24;
+	const unsigned n_samples = argc > 3 && atoi(argv[3]) > 0 ? (unsigned)atoi(argv[3]) : 10;
+
+	char system_buffer[256];
+	Allocator *allocator = NULL;
+	void *tlsf_buffer = NULL;
+	if (!strcmp(variant, "system")) {
+		allocator = create_allocator(system_buffer, sizeof(system_buffer));
+	} else if (!strcmp(variant, "tlsf")) {
+		tlsf_buffer = malloc(TLSF_POOL_SIZE);
+		allocator = create_tlsf_allocator(tlsf_buffer, TLSF_POOL_SIZE);
+	} else if (strcmp(variant, "reserved")) {
+		fprintf(stderr, "unknown variant %s, expected system, tlsf or reserved\n", variant);
+		return 1;
+	}
+
+	uint64_t *samples = malloc(sizeof(uint64_t) * n_samples);
+	uint64_t slowest_push = 0;
+	for (unsigned s = 0; s < n_samples; ++s) {
+		Item *items = NULL;
+		if (allocator)
+			sb_create(allocator, items, 16);
+		else
+			sb_create_reserved(items, n_pushes);
+
+		const uint64_t start = platform_time_ns();
+		for (unsigned i = 0; i < n_pushes; ++i) {
+			if (i < sb_capacity(items)) {
+				Item item = { i, i };
+				sb_push(items, item);
+				continue;
+			}
+			// Only time the pushes that grow, timing every push would cost more than the push.
+			const uint64_t push_start = platform_time_ns();
+			Item item = { i, i };
+			sb_push(items, item);
+			const uint64_t push_time = platform_time_ns() - push_start;
+			slowest_push = push_time > slowest_push ? push_time : slowest_push;
+		}
+		samples[s] = platform_time_ns() - start;
+
+		uint64_t sum = 0;
+		for (unsigned i = 0; i < n_pushes; i += 4096)
+			sum += items[i].value;
+		if (sum == 1)
+			printf("#\n");
+		sb_free(items);
+	}
+
+	qsort(samples, n_samples, sizeof(uint64_t), compare_samples);
+	const unsigned p99 = (n_samples * 99) / 100 < n_samples ? (n_samples * 99) / 100 : n_samples - 1;
+	printf("benchmark,variant,samples,pushes,p50_ns_per_push,p99_ns_per_push,slowest_push_us,peak_rss_mb,data_mb\n");
+	printf("stretchy_buffer_push,%s,%u,%u,%.2f,%.2f,%.1f,%.1f,%.1f\n", variant, n_samples, n_pushes, (double)samples[n_samples / 2] / n_pushes, (double)samples[p99] / n_pushes, slowest_push * 1e-3, peak_rss_bytes() / (1024.0 * 1024.0), (double)sizeof(Item) * n_pushes / (1024.0 * 1024.0));
+
+	free(samples);
+	if (allocator)
+		destroy_allocator(allocator);
+	free(tlsf_buffer);
+	return 0;
+}
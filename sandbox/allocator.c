@@ -1,33 +1,803 @@
 #include "allocator.h"
+#include "platform.h"
+#include "tlsf.h"
+#include "slab.h"
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 #include <assert.h>
 
+enum AllocatorKind
+{
+	ALLOCATOR_SYSTEM,
+	ALLOCATOR_TLSF,
+	ALLOCATOR_FRAME,
+	ALLOCATOR_SLAB,
+};
+
+// Frame allocations keep their size in front of them so growing one that isn't the last can copy it.
+typedef uint32_t AllocatorFrameHeader;
+
+enum { ALLOCATOR_MAX_THREADS = 256 };
+enum { ALLOCATOR_MAGAZINE_SIZE = 32 };
+
+// Blocks of one size class freed on a thread, handed out again by the next allocations of the class on it.
+typedef struct AllocatorMagazine
+{
+	unsigned n_rounds;
+	void *rounds[ALLOCATOR_MAGAZINE_SIZE];
+} AllocatorMagazine;
+
+// System and TLSF allocations have this in front of them, offset bytes into their block. So do slab ones with
+// ALLOCATOR_TRACK_CALLSITES.
+typedef struct AllocatorHeader
+{
+	uint32_t size;
+	uint16_t tag;
+	uint16_t offset;
+	// 1 + index into the callsite table, 0 if not tracked.
+	uint32_t callsite;
+	uint32_t padding;
+} AllocatorHeader;
+
+typedef struct AllocatorTagCounters
+{
+	volatile int64_t live_bytes;
+	volatile int32_t live_allocations;
+	// Every call that allocates or grows, for checking that a frame didn't touch the heap.
+	volatile int32_t n_allocations;
+} AllocatorTagCounters;
+
+// Only written by its own thread. Counts may go negative on a thread that frees what others allocated.
+typedef struct AllocatorThread
+{
+	AllocatorTagCounters tags[ALLOCATOR_MAX_TAGS];
+	// One per slab size class, for allocators with a lock in front of them. Slab pages hold blocks of one tag so slab
+	// allocators have a set per tag, made on its first use, the others only use tag 0's.
+	AllocatorMagazine *magazines[ALLOCATOR_MAX_TAGS];
+} AllocatorThread;
+
+// Live allocations per file and line, shared by all threads.
+enum { ALLOCATOR_MAX_CALLSITES = 4096 };
+typedef struct AllocatorCallsite
+{
+	const char *volatile file;
+	unsigned line;
+	volatile int32_t live_allocations;
+	volatile int64_t live_bytes;
+} AllocatorCallsite;
+
+// What allocator_stats_end_frame keeps between frames.
+typedef struct AllocatorSampledStats
+{
+	PlatformSpinLock lock;
+	uint64_t peak_bytes[ALLOCATOR_MAX_TAGS + 1];
+	int32_t n_allocations[ALLOCATOR_MAX_TAGS];
+	unsigned allocations_per_frame[ALLOCATOR_MAX_TAGS];
+} AllocatorSampledStats;
+
 struct Allocator
 {
-	unsigned allocation_count;
+	unsigned kind;
+	// Indexed by allocator_thread_index - 1, created by each thread on its first call. A thread reusing the index of
+	// one that exited takes over the one it left.
+	AllocatorThread *volatile *threads;
+	// In allocator_live, protected by allocator_threads_lock.
+	Allocator *next_live;
+	AllocatorSampledStats *sampled;
+	// Only with ALLOCATOR_TRACK_CALLSITES.
+	AllocatorCallsite *callsites;
+	PlatformSpinLock callsites_lock;
+	// Jobs allocate on every worker.
+	PlatformSpinLock lock;
+	Tlsf *tlsf;
+	Slab *slab;
+	Allocator *backing;
+
+	char *frame_memory;
+	unsigned frame_size;
+	unsigned n_frames;
+	unsigned frame;
+	volatile int32_t frame_offset;
+	Allocator *watched_heap;
+	int32_t watched_allocations;
+	unsigned warm_up_frames;
+	unsigned n_resets;
 };
 
+static void allocator_thread_exit(void);
+
+// Thread indices are handed back by threads started with platform_thread_create as they exit, which empties their
+// magazines into every live allocator, and taken again by the next thread to allocate.
+static PlatformSpinLock allocator_threads_lock;
+static Allocator *allocator_live;
+static unsigned allocator_n_thread_indices;
+static unsigned allocator_free_thread_indices[ALLOCATOR_MAX_THREADS];
+static unsigned allocator_n_free_thread_indices;
+
 Allocator *create_allocator(void *buffer, unsigned buffer_size)
 {
 	assert(buffer_size >= sizeof(Allocator));
 	Allocator *allocator = buffer;
-	allocator->allocation_count = 0;
+	memset(allocator, 0, sizeof(Allocator));
+	allocator->kind = ALLOCATOR_SYSTEM;
+	allocator->threads = platform_aligned_realloc(NULL, sizeof(AllocatorThread *) * ALLOCATOR_MAX_THREADS, 16);
+	memset((void *)allocator->threads, 0, sizeof(AllocatorThread *) * ALLOCATOR_MAX_THREADS);
+	allocator->sampled = platform_aligned_realloc(NULL, sizeof(AllocatorSampledStats), 16);
+	memset(allocator->sampled, 0, sizeof(AllocatorSampledStats));
+#if ALLOCATOR_TRACK_CALLSITES
+	allocator->callsites = platform_aligned_realloc(NULL, sizeof(AllocatorCallsite) * ALLOCATOR_MAX_CALLSITES, 16);
+	memset(allocator->callsites, 0, sizeof(AllocatorCallsite) * ALLOCATOR_MAX_CALLSITES);
+#endif
+
+	platform_thread_set_exit_callback(allocator_thread_exit);
+	platform_spin_lock_acquire(&allocator_threads_lock);
+	allocator->next_live = allocator_live;
+	allocator_live = allocator;
+	platform_spin_lock_release(&allocator_threads_lock);
+	return allocator;
+}
+
+Allocator *create_tlsf_allocator(void *buffer, unsigned buffer_size)
+{
+	Allocator *allocator = create_allocator(buffer, buffer_size);
+	allocator->kind = ALLOCATOR_TLSF;
+
+	const uintptr_t tlsf_start = ((uintptr_t)buffer + sizeof(Allocator) + 15) & ~(uintptr_t)15;
+	const uintptr_t end = (uintptr_t)buffer + buffer_size;
+	assert(tlsf_start + tlsf_overhead() <= end);
+	allocator->tlsf = tlsf_create((void *)tlsf_start, end - tlsf_start);
 	return allocator;
 }
 
+Allocator *create_frame_allocator(void *buffer, unsigned buffer_size, unsigned n_frames)
+{
+	assert(n_frames);
+	Allocator *allocator = create_allocator(buffer, buffer_size);
+	allocator->kind = ALLOCATOR_FRAME;
+
+	const uintptr_t start = ((uintptr_t)buffer + sizeof(Allocator) + 63) & ~(uintptr_t)63;
+	const uintptr_t end = (uintptr_t)buffer + buffer_size;
+	assert(start < end);
+	allocator->frame_memory = (char *)start;
+	allocator->frame_size = (unsigned)((end - start) / n_frames) & ~63u;
+	allocator->n_frames = n_frames;
+	return allocator;
+}
+
+Allocator *create_slab_allocator(void *buffer, unsigned buffer_size, Allocator *backing)
+{
+	Allocator *allocator = create_allocator(buffer, buffer_size);
+	allocator->kind = ALLOCATOR_SLAB;
+	allocator->backing = backing;
+	assert((unsigned)ALLOCATOR_MAX_TAGS <= (unsigned)SLAB_N_TAGS);
+
+	const uintptr_t slab_start = ((uintptr_t)buffer + sizeof(Allocator) + 15) & ~(uintptr_t)15;
+	allocator->slab = slab_create((void *)slab_start, (unsigned)((uintptr_t)buffer + buffer_size - slab_start));
+	return allocator;
+}
+
+void allocator_add_pool(Allocator *allocator, void *memory, unsigned size)
+{
+	assert(allocator->kind == ALLOCATOR_TLSF);
+	platform_spin_lock_acquire(&allocator->lock);
+	tlsf_add_pool(allocator->tlsf, memory, size);
+	platform_spin_lock_release(&allocator->lock);
+}
+
+static PLATFORM_THREAD_LOCAL unsigned allocator_thread_index;
+
+static unsigned allocator_take_thread_index(void)
+{
+	platform_spin_lock_acquire(&allocator_threads_lock);
+	const unsigned index = allocator_n_free_thread_indices ? allocator_free_thread_indices[--allocator_n_free_thread_indices] : ++allocator_n_thread_indices;
+	platform_spin_lock_release(&allocator_threads_lock);
+	// Every slot is held by a live thread, there is nowhere to count this one.
+	if (index > ALLOCATOR_MAX_THREADS) {
+		fprintf(stderr, "More than %u threads using allocators at once\n", ALLOCATOR_MAX_THREADS);
+		abort();
+	}
+	return index;
+}
+
+static PLATFORM_NOINLINE AllocatorThread *allocator_create_thread(Allocator *allocator)
+{
+	unsigned index = allocator_thread_index;
+	if (!index)
+		index = allocator_thread_index = allocator_take_thread_index();
+
+	AllocatorThread *thread = atomic_load_ptr((void *volatile *)&allocator->threads[index - 1]);
+	if (thread)
+		return thread;
+	thread = platform_aligned_realloc(NULL, sizeof(AllocatorThread), 64);
+	memset(thread, 0, sizeof(AllocatorThread));
+	if (allocator->kind == ALLOCATOR_TLSF || allocator->kind == ALLOCATOR_SLAB) {
+		thread->magazines[0] = platform_aligned_realloc(NULL, sizeof(AllocatorMagazine) * SLAB_N_CLASSES, 64);
+		memset(thread->magazines[0], 0, sizeof(AllocatorMagazine) * SLAB_N_CLASSES);
+	}
+	atomic_store_ptr((void *volatile *)&allocator->threads[index - 1], thread);
+	return thread;
+}
+
+static AllocatorThread *allocator_thread(Allocator *allocator)
+{
+	const unsigned index = allocator_thread_index;
+	AllocatorThread *thread = index ? atomic_load_ptr((void *volatile *)&allocator->threads[index - 1]) : NULL;
+	return thread ? thread : allocator_create_thread(allocator);
+}
+
+static AllocatorMagazine *allocator_magazines(AllocatorThread *thread, unsigned tag)
+{
+	if (!thread->magazines[tag]) {
+		thread->magazines[tag] = platform_aligned_realloc(NULL, sizeof(AllocatorMagazine) * SLAB_N_CLASSES, 64);
+		memset(thread->magazines[tag], 0, sizeof(AllocatorMagazine) * SLAB_N_CLASSES);
+	}
+	return thread->magazines[tag];
+}
+
+static void allocator_shared_free(Allocator *allocator, void *p)
+{
+	if (allocator->kind == ALLOCATOR_TLSF)
+		tlsf_free(allocator->tlsf, p);
+	else
+		slab_free(allocator->slab, p);
+}
+
+// Fills the magazine halfway from the shared allocator under one lock, or as far as it can.
+static void allocator_magazine_refill(Allocator *allocator, AllocatorMagazine *magazine, unsigned size_class, unsigned tag)
+{
+	const unsigned size = slab_class_size(size_class);
+	platform_spin_lock_acquire(&allocator->lock);
+	while (magazine->n_rounds < ALLOCATOR_MAGAZINE_SIZE / 2) {
+		void *p = allocator->kind == ALLOCATOR_TLSF ? tlsf_malloc(allocator->tlsf, size, 0) : slab_alloc(allocator->slab, size, 0, tag);
+		if (!p)
+			break;
+		magazine->rounds[magazine->n_rounds++] = p;
+	}
+	platform_spin_lock_release(&allocator->lock);
+}
+
+// Returns the older half of a full magazine under one lock.
+static void allocator_magazine_flush(Allocator *allocator, AllocatorMagazine *magazine, unsigned n_rounds)
+{
+	platform_spin_lock_acquire(&allocator->lock);
+	for (unsigned i = 0; i < n_rounds; ++i)
+		allocator_shared_free(allocator, magazine->rounds[i]);
+	platform_spin_lock_release(&allocator->lock);
+	magazine->n_rounds -= n_rounds;
+	memmove(magazine->rounds, magazine->rounds + n_rounds, sizeof(void *) * magazine->n_rounds);
+}
+
+static void allocator_flush_magazines(Allocator *allocator, AllocatorThread *thread)
+{
+	for (unsigned tag = 0; tag < ALLOCATOR_MAX_TAGS; ++tag) {
+		AllocatorMagazine *magazines = thread->magazines[tag];
+		for (unsigned c = 0; magazines && c < SLAB_N_CLASSES; ++c) {
+			if (magazines[c].n_rounds)
+				allocator_magazine_flush(allocator, &magazines[c], magazines[c].n_rounds);
+		}
+	}
+}
+
+// The thread's counters stay in place for the next thread with its index, so the sums don't change.
+static void allocator_thread_exit(void)
+{
+	const unsigned index = allocator_thread_index;
+	if (!index)
+		return;
+	allocator_thread_index = 0;
+
+	platform_spin_lock_acquire(&allocator_threads_lock);
+	for (Allocator *allocator = allocator_live; allocator; allocator = allocator->next_live) {
+		AllocatorThread *thread = allocator->threads[index - 1];
+		if (thread)
+			allocator_flush_magazines(allocator, thread);
+	}
+	allocator_free_thread_indices[allocator_n_free_thread_indices++] = index;
+	platform_spin_lock_release(&allocator_threads_lock);
+}
+
+// Magazines serve the size classes with up to 16 byte alignment, SLAB_N_CLASSES for the rest.
+static unsigned allocator_magazine_class(unsigned size, unsigned alignment)
+{
+	return alignment > 16 ? SLAB_N_CLASSES : slab_size_class(size, alignment);
+}
+
+static void *allocator_magazine_alloc(Allocator *allocator, AllocatorThread *thread, unsigned size_class, unsigned tag)
+{
+	AllocatorMagazine *magazine = &allocator_magazines(thread, tag)[size_class];
+	if (!magazine->n_rounds)
+		allocator_magazine_refill(allocator, magazine, size_class, tag);
+	return magazine->n_rounds ? magazine->rounds[--magazine->n_rounds] : NULL;
+}
+
+static void allocator_magazine_push(Allocator *allocator, AllocatorThread *thread, void *p, unsigned size_class, unsigned tag)
+{
+	AllocatorMagazine *magazine = &allocator_magazines(thread, tag)[size_class];
+	if (magazine->n_rounds == ALLOCATOR_MAGAZINE_SIZE)
+		allocator_magazine_flush(allocator, magazine, ALLOCATOR_MAGAZINE_SIZE / 2);
+	magazine->rounds[magazine->n_rounds++] = p;
+}
+
+static int allocator_magazine_free(Allocator *allocator, AllocatorThread *thread, void *p)
+{
+	unsigned size_class, tag = 0;
+	if (allocator->kind == ALLOCATOR_TLSF) {
+		// The largest class the block can serve, it came from a bigger request or a split that left too little.
+		const size_t size = tlsf_block_size(p);
+		if (size > SLAB_MAX_SIZE)
+			return 0;
+		size_class = slab_size_class((unsigned)size, 0);
+		if (slab_class_size(size_class) > size)
+			size_class--;
+	} else {
+		size_class = slab_lookup(allocator->slab, p, &tag);
+		if (size_class == SLAB_N_CLASSES)
+			return 0;
+	}
+
+	allocator_magazine_push(allocator, thread, p, size_class, tag);
+	return 1;
+}
+
+static const char *allocator_tag_names[ALLOCATOR_MAX_TAGS] = { "untagged" };
+static volatile int32_t allocator_n_tags = 1;
+static PlatformSpinLock allocator_tags_lock;
+
+unsigned allocator_tag(const char *name)
+{
+	platform_spin_lock_acquire(&allocator_tags_lock);
+	unsigned tag = 0;
+	while (tag < (unsigned)allocator_n_tags && strcmp(allocator_tag_names[tag], name))
+		++tag;
+	if (tag == (unsigned)allocator_n_tags) {
+		assert(tag < ALLOCATOR_MAX_TAGS);
+		allocator_tag_names[tag] = name;
+		atomic_store_32(&allocator_n_tags, tag + 1);
+	}
+	platform_spin_lock_release(&allocator_tags_lock);
+	return tag;
+}
+
+// Sums the counters of every thread into stats, without the sampled ones.
+static void allocator_sum_tags(Allocator *allocator, AllocatorStats *stats)
+{
+	memset(stats, 0, sizeof(AllocatorStats));
+	stats->n_tags = (unsigned)atomic_load_32(&allocator_n_tags);
+	int64_t live_bytes[ALLOCATOR_MAX_TAGS] = { 0 };
+	int32_t live_allocations[ALLOCATOR_MAX_TAGS] = { 0 };
+	int32_t n_allocations[ALLOCATOR_MAX_TAGS] = { 0 };
+	for (unsigned i = 0; i < ALLOCATOR_MAX_THREADS; ++i) {
+		AllocatorThread *thread = atomic_load_ptr((void *volatile *)&allocator->threads[i]);
+		if (!thread)
+			continue;
+		for (unsigned tag = 0; tag < stats->n_tags; ++tag) {
+			live_bytes[tag] += atomic_load_64(&thread->tags[tag].live_bytes);
+			live_allocations[tag] += atomic_load_32(&thread->tags[tag].live_allocations);
+			n_allocations[tag] += atomic_load_32(&thread->tags[tag].n_allocations);
+		}
+	}
+
+	stats->total.name = "total";
+	for (unsigned tag = 0; tag < stats->n_tags; ++tag) {
+		AllocatorTagStats *tag_stats = &stats->tags[tag];
+		tag_stats->name = allocator_tag_names[tag];
+		tag_stats->live_bytes = (uint64_t)live_bytes[tag];
+		tag_stats->live_allocations = (unsigned)live_allocations[tag];
+		tag_stats->n_allocations = (unsigned)n_allocations[tag];
+		stats->total.live_bytes += tag_stats->live_bytes;
+		stats->total.live_allocations += tag_stats->live_allocations;
+		stats->total.n_allocations += tag_stats->n_allocations;
+	}
+}
+
+unsigned allocator_allocation_count(Allocator *allocator)
+{
+	AllocatorStats stats;
+	allocator_sum_tags(allocator, &stats);
+	return stats.total.live_allocations;
+}
+
+static unsigned allocator_allocation_calls(Allocator *allocator)
+{
+	AllocatorStats stats;
+	allocator_sum_tags(allocator, &stats);
+	return stats.total.n_allocations;
+}
+
+static void allocator_update_peaks(Allocator *allocator, AllocatorStats *stats)
+{
+	uint64_t *peak_bytes = allocator->sampled->peak_bytes;
+	for (unsigned tag = 0; tag < stats->n_tags; ++tag)
+		peak_bytes[tag] = stats->tags[tag].live_bytes > peak_bytes[tag] ? stats->tags[tag].live_bytes : peak_bytes[tag];
+	peak_bytes[ALLOCATOR_MAX_TAGS] = stats->total.live_bytes > peak_bytes[ALLOCATOR_MAX_TAGS] ? stats->total.live_bytes : peak_bytes[ALLOCATOR_MAX_TAGS];
+}
+
+void allocator_stats_end_frame(Allocator *allocator)
+{
+	AllocatorStats stats;
+	allocator_sum_tags(allocator, &stats);
+	AllocatorSampledStats *sampled = allocator->sampled;
+	platform_spin_lock_acquire(&sampled->lock);
+	allocator_update_peaks(allocator, &stats);
+	for (unsigned tag = 0; tag < stats.n_tags; ++tag) {
+		sampled->allocations_per_frame[tag] = stats.tags[tag].n_allocations - (unsigned)sampled->n_allocations[tag];
+		sampled->n_allocations[tag] = (int32_t)stats.tags[tag].n_allocations;
+	}
+	platform_spin_lock_release(&sampled->lock);
+}
+
+void allocator_stats(Allocator *allocator, AllocatorStats *stats)
+{
+	assert(allocator->kind != ALLOCATOR_FRAME);
+	allocator_sum_tags(allocator, stats);
+	AllocatorSampledStats *sampled = allocator->sampled;
+	platform_spin_lock_acquire(&sampled->lock);
+	allocator_update_peaks(allocator, stats);
+	for (unsigned tag = 0; tag < stats->n_tags; ++tag) {
+		stats->tags[tag].peak_bytes = sampled->peak_bytes[tag];
+		stats->tags[tag].allocations_per_frame = sampled->allocations_per_frame[tag];
+		stats->total.allocations_per_frame += sampled->allocations_per_frame[tag];
+	}
+	stats->total.peak_bytes = sampled->peak_bytes[ALLOCATOR_MAX_TAGS];
+	platform_spin_lock_release(&sampled->lock);
+}
+
+void allocator_report_live(Allocator *allocator, FILE *out)
+{
+	AllocatorStats stats;
+	allocator_stats(allocator, &stats);
+	for (unsigned tag = 0; tag < stats.n_tags; ++tag) {
+		if (stats.tags[tag].live_allocations)
+			fprintf(out, "%s: %u allocations, %llu bytes live\n", stats.tags[tag].name, stats.tags[tag].live_allocations, (unsigned long long)stats.tags[tag].live_bytes);
+	}
+	if (!allocator->callsites)
+		return;
+	for (unsigned i = 0; i < ALLOCATOR_MAX_CALLSITES; ++i) {
+		AllocatorCallsite *callsite = &allocator->callsites[i];
+		const int32_t live_allocations = atomic_load_32(&callsite->live_allocations);
+		if (callsite->file && live_allocations)
+			fprintf(out, "%s(%u): %d allocations, %lld bytes live\n", callsite->file, callsite->line, live_allocations, (long long)atomic_load_64(&callsite->live_bytes));
+	}
+}
+
+// Looked up without the lock, entries are only added and their file is written last.
+static unsigned allocator_callsite(Allocator *allocator, const char *file, unsigned line)
+{
+	if (!allocator->callsites || !file)
+		return 0;
+	const unsigned hash = (unsigned)(((uintptr_t)file >> 4) * 0x9e3779b9u) ^ (line * 0x85ebca6bu);
+	for (unsigned probe = 0; probe < ALLOCATOR_MAX_CALLSITES; ++probe) {
+		const unsigned index = (hash + probe) & (ALLOCATOR_MAX_CALLSITES - 1);
+		AllocatorCallsite *callsite = &allocator->callsites[index];
+		const char *callsite_file = atomic_load_ptr((void *volatile *)&callsite->file);
+		if (!callsite_file) {
+			platform_spin_lock_acquire(&allocator->callsites_lock);
+			callsite_file = callsite->file;
+			if (!callsite_file) {
+				callsite->line = line;
+				atomic_store_ptr((void *volatile *)&callsite->file, (void *)file);
+				callsite_file = file;
+			}
+			platform_spin_lock_release(&allocator->callsites_lock);
+		}
+		if (callsite_file == file && callsite->line == line)
+			return index + 1;
+	}
+	return 0;
+}
+
+// Every other thread using the allocator must be done with it.
 void destroy_allocator(Allocator *allocator)
 {
-	assert(allocator->allocation_count == 0);
+	platform_spin_lock_acquire(&allocator_threads_lock);
+	Allocator **link = &allocator_live;
+	while (*link != allocator)
+		link = &(*link)->next_live;
+	*link = allocator->next_live;
+	platform_spin_lock_release(&allocator_threads_lock);
+
+	if (allocator->kind != ALLOCATOR_FRAME && allocator_allocation_count(allocator)) {
+		fprintf(stderr, "Allocator destroyed with live allocations:\n");
+		allocator_report_live(allocator, stderr);
+		assert(0);
+	}
+	for (unsigned i = 0; i < ALLOCATOR_MAX_THREADS; ++i) {
+		AllocatorThread *thread = allocator->threads[i];
+		if (!thread)
+			continue;
+		allocator_flush_magazines(allocator, thread);
+		for (unsigned tag = 0; tag < ALLOCATOR_MAX_TAGS; ++tag)
+			platform_aligned_realloc(thread->magazines[tag], 0, 0);
+		platform_aligned_realloc(thread, 0, 0);
+	}
+	platform_aligned_realloc((void *)allocator->threads, 0, 0);
+	platform_aligned_realloc(allocator->sampled, 0, 0);
+	platform_aligned_realloc(allocator->callsites, 0, 0);
 }
 
-void *allocator_realloc(Allocator *allocator, void *p, unsigned size, unsigned alignment)
+static void *allocator_frame_bump(Allocator *allocator, unsigned size, unsigned alignment)
 {
-	if (p && !size) { // Free
-		--allocator->allocation_count;
-	} else if (!p && size) { // Allocate
-		++allocator->allocation_count;
+	if (alignment < sizeof(AllocatorFrameHeader))
+		alignment = sizeof(AllocatorFrameHeader);
+	char *memory = allocator->frame_memory + allocator->frame * allocator->frame_size;
+	int32_t offset = atomic_load_32(&allocator->frame_offset);
+	for (;;) {
+		const uintptr_t aligned = ((uintptr_t)memory + offset + sizeof(AllocatorFrameHeader) + alignment - 1) & ~(uintptr_t)(alignment - 1);
+		const uintptr_t end = aligned + size;
+		// Going on would hand out the next frame's arena, which may still be in use, or run off the buffer.
+		if (end > (uintptr_t)memory + allocator->frame_size) {
+			fprintf(stderr, "Frame allocator out of space: %u bytes asked for, %u of %u used\n", size, (unsigned)offset, allocator->frame_size);
+			abort();
+		}
+		const int32_t previous = atomic_cas_32(&allocator->frame_offset, offset, (int32_t)(end - (uintptr_t)memory));
+		if (previous == offset) {
+			((AllocatorFrameHeader *)aligned)[-1] = size;
+			return (void *)aligned;
+		}
+		offset = previous;
 	}
-	
-	return _aligned_realloc(p, size, alignment);
+}
+
+static void *allocator_frame_realloc(Allocator *allocator, void *p, unsigned size, unsigned alignment)
+{
+	if (!size)
+		return NULL;
+	if (!p)
+		return allocator_frame_bump(allocator, size, alignment);
+
+	AllocatorFrameHeader *header = (AllocatorFrameHeader *)p - 1;
+	const unsigned old_size = *header;
+	if (size <= old_size)
+		return p;
+
+	// The last allocation grows in place.
+	char *memory = allocator->frame_memory + allocator->frame * allocator->frame_size;
+	const int32_t old_end = (int32_t)((char *)p + old_size - memory);
+	const int32_t new_end = (int32_t)((char *)p + size - memory);
+	if ((char *)p >= memory && new_end <= (int32_t)allocator->frame_size && atomic_cas_32(&allocator->frame_offset, old_end, new_end) == old_end) {
+		*header = size;
+		return p;
+	}
+
+	void *q = allocator_frame_bump(allocator, size, alignment);
+	memcpy(q, p, old_size);
+	return q;
+}
+
+static void *allocator_slab_realloc(Allocator *allocator, void *p, unsigned size, unsigned alignment, unsigned tag)
+{
+	Slab *slab = allocator->slab;
+	if (p && !slab_owns(slab, p)) {
+		assert(allocator->backing);
+		return allocator_realloc_tagged(allocator->backing, p, size, alignment, tag);
+	}
+
+	if (p && size) {
+		if (size <= slab_size(slab, p) && ((uintptr_t)p & ((alignment ? alignment : 16) - 1)) == 0)
+			return p;
+		void *q = allocator_slab_realloc(allocator, NULL, size, alignment, tag);
+		const unsigned old_size = slab_size(slab, p);
+		memcpy(q, p, old_size < size ? old_size : size);
+		allocator_slab_realloc(allocator, p, 0, 0, tag);
+		return q;
+	}
+
+	platform_spin_lock_acquire(&allocator->lock);
+	if (p) {
+		slab_free(slab, p);
+		platform_spin_lock_release(&allocator->lock);
+		return NULL;
+	}
+	void *q = slab_alloc(slab, size, alignment, 0);
+	platform_spin_lock_release(&allocator->lock);
+	if (q)
+		return q;
+
+	// Too big, too aligned or out of pages.
+	assert(allocator->backing);
+	return allocator_realloc_tagged(allocator->backing, NULL, size, alignment, tag);
+}
+
+static void allocator_count(AllocatorThread *thread, unsigned tag, const void *p, unsigned old_size, unsigned size)
+{
+	AllocatorTagCounters *counters = &thread->tags[tag];
+	atomic_store_64(&counters->live_bytes, counters->live_bytes + (int64_t)size - old_size);
+	if (!p)
+		atomic_store_32(&counters->live_allocations, counters->live_allocations + 1);
+	else if (!size)
+		atomic_store_32(&counters->live_allocations, counters->live_allocations - 1);
+	if (size)
+		atomic_store_32(&counters->n_allocations, counters->n_allocations + 1);
+}
+
+// Slab blocks have no header, they take their tag from their page and count the size of their class. Anything the
+// slab can't serve is allocated from backing and counted there.
+static void *allocator_slab_block_alloc(Allocator *allocator, AllocatorThread *thread, unsigned size, unsigned alignment, unsigned tag, const char *file, unsigned line)
+{
+	const unsigned magazine_class = allocator_magazine_class(size, alignment);
+	void *q = magazine_class < SLAB_N_CLASSES ? allocator_magazine_alloc(allocator, thread, magazine_class, tag) : NULL;
+	const unsigned size_class = slab_size_class(size, alignment);
+	if (!q && size_class < SLAB_N_CLASSES) {
+		platform_spin_lock_acquire(&allocator->lock);
+		q = slab_alloc(allocator->slab, size, alignment, tag);
+		platform_spin_lock_release(&allocator->lock);
+	}
+	// Too big, too aligned or out of pages.
+	if (!q) {
+		assert(allocator->backing);
+		return allocator_realloc_at(allocator->backing, NULL, size, alignment, tag, file, line);
+	}
+	allocator_count(thread, tag, NULL, 0, slab_class_size(size_class));
+	return q;
+}
+
+static void allocator_slab_block_free(Allocator *allocator, AllocatorThread *thread, void *p, unsigned size_class, unsigned tag)
+{
+	allocator_count(thread, tag, p, slab_class_size(size_class), 0);
+	allocator_magazine_push(allocator, thread, p, size_class, tag);
+}
+
+// Everything but taking a block from a magazine that has one or freeing one into a magazine with room.
+static PLATFORM_NOINLINE void *allocator_slab_block_realloc_slow(Allocator *allocator, AllocatorThread *thread, void *p, unsigned size, unsigned alignment, unsigned tag, const char *file, unsigned line)
+{
+	if (!p)
+		return allocator_slab_block_alloc(allocator, thread, size, alignment, tag, file, line);
+
+	unsigned page_tag;
+	const unsigned size_class = slab_lookup(allocator->slab, p, &page_tag);
+	if (size_class == SLAB_N_CLASSES)
+		return allocator_realloc_at(allocator->backing, p, size, alignment, tag, file, line);
+	if (!size) {
+		allocator_slab_block_free(allocator, thread, p, size_class, page_tag);
+		return NULL;
+	}
+
+	const unsigned old_size = slab_class_size(size_class);
+	if (size <= old_size && ((uintptr_t)p & ((alignment ? alignment : 16) - 1)) == 0)
+		return p;
+	void *q = allocator_slab_block_alloc(allocator, thread, size, alignment, page_tag, file, line);
+	if (!q)
+		return NULL;
+	memcpy(q, p, old_size < size ? old_size : size);
+	allocator_slab_block_free(allocator, thread, p, size_class, page_tag);
+	return q;
+}
+
+static void *allocator_slab_block_realloc(Allocator *allocator, void *p, unsigned size, unsigned alignment, unsigned tag, const char *file, unsigned line)
+{
+	AllocatorThread *thread = allocator_thread(allocator);
+	AllocatorMagazine *magazine;
+	unsigned size_class;
+	if (!p) {
+		size_class = allocator_magazine_class(size, alignment);
+		magazine = size_class < SLAB_N_CLASSES && thread->magazines[tag] ? &thread->magazines[tag][size_class] : NULL;
+		if (magazine && magazine->n_rounds) {
+			allocator_count(thread, tag, NULL, 0, slab_class_size(size_class));
+			return magazine->rounds[--magazine->n_rounds];
+		}
+	} else if (!size) {
+		size_class = slab_lookup(allocator->slab, p, &tag);
+		magazine = size_class < SLAB_N_CLASSES && thread->magazines[tag] ? &thread->magazines[tag][size_class] : NULL;
+		if (magazine && magazine->n_rounds < ALLOCATOR_MAGAZINE_SIZE) {
+			allocator_count(thread, tag, p, slab_class_size(size_class), 0);
+			magazine->rounds[magazine->n_rounds++] = p;
+			return NULL;
+		}
+	}
+	return allocator_slab_block_realloc_slow(allocator, thread, p, size, alignment, tag, file, line);
+}
+
+// Reallocates the whole block, header included.
+static void *allocator_block_realloc(Allocator *allocator, AllocatorThread *thread, void *p, unsigned size, unsigned alignment, unsigned tag)
+{
+	if (thread->magazines[0]) {
+		const unsigned size_class = allocator_magazine_class(size, alignment);
+		if (!p && size && size_class < SLAB_N_CLASSES) {
+			void *q = allocator_magazine_alloc(allocator, thread, size_class, 0);
+			if (q)
+				return q;
+		} else if (p && !size && allocator_magazine_free(allocator, thread, p)) {
+			return NULL;
+		}
+	}
+
+	if (allocator->kind == ALLOCATOR_SLAB)
+		return allocator_slab_realloc(allocator, p, size, alignment, tag);
+
+	if (allocator->kind == ALLOCATOR_TLSF) {
+		platform_spin_lock_acquire(&allocator->lock);
+		void *result = tlsf_realloc(allocator->tlsf, p, size, alignment);
+		platform_spin_lock_release(&allocator->lock);
+		assert(result || !size);
+		return result;
+	}
+
+	return platform_aligned_realloc(p, size, alignment);
+}
+
+// Puts the header in front of the allocation.
+static void *allocator_header_realloc(Allocator *allocator, void *p, unsigned size, unsigned alignment, unsigned tag, const char *file, unsigned line)
+{
+	// A block keeps its tag, callsite and alignment when it grows.
+	AllocatorHeader *header = p ? (AllocatorHeader *)p - 1 : NULL;
+	unsigned old_size = 0, callsite = 0, offset = alignment > sizeof(AllocatorHeader) ? alignment : sizeof(AllocatorHeader);
+	if (header) {
+		old_size = header->size;
+		tag = header->tag;
+		callsite = header->callsite;
+		offset = header->offset;
+	} else {
+		callsite = allocator_callsite(allocator, file, line);
+	}
+	assert(tag < ALLOCATOR_MAX_TAGS && alignment <= offset && offset < 65536);
+
+	AllocatorThread *thread = allocator_thread(allocator);
+	allocator_count(thread, tag, p, old_size, size);
+	if (callsite) {
+		AllocatorCallsite *entry = &allocator->callsites[callsite - 1];
+		atomic_add_32(&entry->live_allocations, !p - !size);
+		atomic_add_64(&entry->live_bytes, (int64_t)size - old_size);
+	}
+
+	char *block = allocator_block_realloc(allocator, thread, p ? (char *)p - offset : NULL, size ? size + offset : 0, offset, tag);
+	if (!block)
+		return NULL;
+	header = (AllocatorHeader *)(block + offset) - 1;
+	header->size = size;
+	header->tag = (uint16_t)tag;
+	header->offset = (uint16_t)offset;
+	header->callsite = callsite;
+	return header + 1;
+}
+
+void *allocator_realloc_at(Allocator *allocator, void *p, unsigned size, unsigned alignment, unsigned tag, const char *file, unsigned line)
+{
+	if (allocator->kind == ALLOCATOR_FRAME)
+		return allocator_frame_realloc(allocator, p, size, alignment);
+	if (!p && !size)
+		return NULL;
+	// Without callsites to keep, slab blocks don't need a header.
+	assert(tag < ALLOCATOR_MAX_TAGS);
+	if (allocator->kind == ALLOCATOR_SLAB && !allocator->callsites)
+		return allocator_slab_block_realloc(allocator, p, size, alignment, tag, file, line);
+	return allocator_header_realloc(allocator, p, size, alignment, tag, file, line);
+}
+
+void allocator_frame_reset(Allocator *allocator)
+{
+	assert(allocator->kind == ALLOCATOR_FRAME);
+	allocator->frame = (allocator->frame + 1) % allocator->n_frames;
+	atomic_store_32(&allocator->frame_offset, 0);
+
+	if (allocator->watched_heap) {
+		const int32_t n_allocations = (int32_t)allocator_allocation_calls(allocator->watched_heap);
+		assert(allocator->n_resets < allocator->warm_up_frames || n_allocations == allocator->watched_allocations);
+		allocator->watched_allocations = n_allocations;
+	}
+	allocator->n_resets++;
+}
+
+void allocator_frame_assert_no_heap_allocations(Allocator *allocator, Allocator *heap, unsigned warm_up_frames)
+{
+	assert(allocator->kind == ALLOCATOR_FRAME && heap->kind != ALLOCATOR_FRAME);
+	allocator->watched_heap = heap;
+	allocator->watched_allocations = (int32_t)allocator_allocation_calls(heap);
+	allocator->warm_up_frames = allocator->n_resets + warm_up_frames;
+}
+
+void allocator_slab_stats(Allocator *allocator, SlabStats *stats)
+{
+	assert(allocator->kind == ALLOCATOR_SLAB);
+	platform_spin_lock_acquire(&allocator->lock);
+	slab_stats(allocator->slab, stats);
+	platform_spin_lock_release(&allocator->lock);
+}
+
+unsigned allocator_frame_used(Allocator *allocator)
+{
+	assert(allocator->kind == ALLOCATOR_FRAME);
+	return (unsigned)atomic_load_32(&allocator->frame_offset);
 }
@@ -1,8 +1,88 @@
 #pragma once
 
+#include <stdint.h>
+#include <stdio.h>
+
+// Define ALLOCATOR_TRACK_CALLSITES to 1 to count live allocations per file and line, for finding leaks. It updates
+// counters shared by all threads on every call, unlike the per tag ones that are always on.
+#if !defined(ALLOCATOR_TRACK_CALLSITES)
+#define ALLOCATOR_TRACK_CALLSITES 0
+#endif
+
 typedef struct Allocator Allocator;
 
+// Allocates from the system heap, the buffer only holds the allocator itself.
 Allocator *create_allocator(void *buffer, unsigned buffer_size);
+// Allocates from the buffer with a TLSF allocator, O(1) allocation and free with bounded fragmentation. Pools can be
+// added for more memory, an allocation that fits in none of them asserts.
+Allocator *create_tlsf_allocator(void *buffer, unsigned buffer_size);
+void allocator_add_pool(Allocator *allocator, void *memory, unsigned size);
+// Splits the buffer into a ring of n_frames arenas. Allocating bumps a pointer in the current frame's arena and freeing
+// does nothing, allocator_frame_reset moves on to the next arena which drops everything allocated in it n_frames resets
+// ago. Safe to allocate from several threads, running out of space in a frame aborts in every build.
+Allocator *create_frame_allocator(void *buffer, unsigned buffer_size, unsigned n_frames);
+// Serves allocations up to 1KB from size class pages cut out of the buffer, see slab.h. Bigger or more aligned ones,
+// and any once the pages run out, go to backing.
+Allocator *create_slab_allocator(void *buffer, unsigned buffer_size, Allocator *backing);
 void destroy_allocator(Allocator *allocator);
 
-void *allocator_realloc(Allocator *allocator, void *p, unsigned size, unsigned alignment);
+// Safe to call from any thread. TLSF and slab allocators keep a magazine per size class up to 1KB on every thread
+// using them: allocations and frees of those sizes stay on the thread and only take the lock to move half a magazine.
+// Allocations are counted under the tag they were made with, growing or freeing one keeps its tag. System and TLSF
+// allocations have a 16 byte header in front of them for that. Slab allocators give each tag its own pages instead and
+// count what goes to backing in backing. With ALLOCATOR_TRACK_CALLSITES slab blocks have the header too. At most 256
+// threads can use allocators at once, more aborts. Threads started with platform_thread_create give their slot back
+// and empty their magazines as they exit.
+void *allocator_realloc_at(Allocator *allocator, void *p, unsigned size, unsigned alignment, unsigned tag, const char *file, unsigned line);
+#if ALLOCATOR_TRACK_CALLSITES
+#define ALLOCATOR_CALLSITE __FILE__, __LINE__
+#else
+#define ALLOCATOR_CALLSITE NULL, 0
+#endif
+#define allocator_realloc(allocator, p, size, alignment) allocator_realloc_at(allocator, p, size, alignment, 0, ALLOCATOR_CALLSITE)
+#define allocator_realloc_tagged(allocator, p, size, alignment, tag) allocator_realloc_at(allocator, p, size, alignment, tag, ALLOCATOR_CALLSITE)
+// Live allocations, summed over the counters of every thread.
+unsigned allocator_allocation_count(Allocator *allocator);
+
+// Tags are shared by all allocators. Returns the tag for name, registering it the first time, name must outlive it.
+// Tag 0 is "untagged".
+enum { ALLOCATOR_MAX_TAGS = 32 };
+unsigned allocator_tag(const char *name);
+
+typedef struct AllocatorTagStats
+{
+	const char *name;
+	uint64_t live_bytes;
+	// Highest live_bytes seen by allocator_stats_end_frame or allocator_stats, so a peak between two of them is missed.
+	uint64_t peak_bytes;
+	unsigned live_allocations;
+	// Calls that allocated or grew something between the last two allocator_stats_end_frame.
+	unsigned allocations_per_frame;
+	unsigned n_allocations;
+} AllocatorTagStats;
+
+typedef struct AllocatorStats
+{
+	unsigned n_tags;
+	AllocatorTagStats total;
+	AllocatorTagStats tags[ALLOCATOR_MAX_TAGS];
+} AllocatorStats;
+
+// Sums the per thread counters, call once a frame from one thread.
+void allocator_stats_end_frame(Allocator *allocator);
+// Bytes are the sizes asked for, without headers, padding or size class rounding, except for headerless slab blocks
+// which count the size of their class. Not for frame allocators.
+void allocator_stats(Allocator *allocator, AllocatorStats *stats);
+// One line per tag with live allocations, and per file and line with ALLOCATOR_TRACK_CALLSITES. destroy_allocator
+// prints it to stderr before asserting on leaks.
+void allocator_report_live(Allocator *allocator, FILE *out);
+
+// Nothing may be allocated from a frame allocator while it's reset.
+void allocator_frame_reset(Allocator *allocator);
+// Once warm_up_frames resets have passed, every reset asserts that heap hasn't allocated since the reset before it.
+void allocator_frame_assert_no_heap_allocations(Allocator *allocator, Allocator *heap, unsigned warm_up_frames);
+// Bytes allocated in the current frame, including alignment padding.
+unsigned allocator_frame_used(Allocator *allocator);
+
+typedef struct SlabStats SlabStats;
+void allocator_slab_stats(Allocator *allocator, SlabStats *stats);
@@ -1,220 +1,2058 @@
 #include "fibers_system.h"
 
 #include <stdlib.h>
-#include <Windows.h>
+#include <string.h>
 #include <assert.h>
 
 #include "allocator.h"
+#include "platform.h"
 #include "stretchy_buffer.h"
 
+typedef struct FibersSystemWorker FibersSystemWorker;
+typedef struct FiberStruct FiberStruct;
+
+typedef struct FibersSystemJobCounter FibersSystemJobCounter;
+
+enum FibersSystemJobKind
+{
+	FIBERS_SYSTEM_JOB_NONE = 0,
+	// job_entry is called with data.job_data.
+	FIBERS_SYSTEM_JOB_POINTER,
+	// job_entry is called with data.inline_data, copied from the declaration when the job was pushed.
+	FIBERS_SYSTEM_JOB_INLINE,
+	// parallel_for jobs, which run data.range.body over [begin, end).
+	FIBERS_SYSTEM_JOB_RANGE,
+	// Task graph nodes, which run the node's job and then push the successors it was the last input of.
+	FIBERS_SYSTEM_JOB_GRAPH_NODE,
+};
+
+// One cache line, so pushing, stealing and starting a job only ever touches a single line of the deque.
 typedef struct FibersSystemJob
 {
-	FibersSystemCounter *counter;
-	FibersSystemJobDecl declaration;
+	FibersSystemJobEntry job_entry;
+	// Index of the counter slot the job is counted in.
+	unsigned counter;
+	uint8_t kind;
+	uint8_t priority;
+	uint8_t stack_class;
+	union
+	{
+		void *job_data;
+		unsigned char inline_data[FIBERS_SYSTEM_JOB_INLINE_DATA_SIZE];
+		struct
+		{
+			FibersSystemRangeEntry body;
+			void *data;
+			unsigned begin;
+			unsigned end;
+			unsigned grain;
+		} range;
+		struct
+		{
+			FibersSystemTaskGraph *graph;
+			unsigned node;
+		} graph;
+	} data;
 } FibersSystemJob;
 
+typedef struct FibersSystemScratchBlock
+{
+	char *memory;
+	unsigned size;
+} FibersSystemScratchBlock;
+
 typedef struct FiberStruct
 {
 	FibersSystem *fibers_system;
-	LPVOID fiber;
+	PlatformFiber *fiber;
 	unsigned entry;
+	unsigned stack_class;
+
+	// Worker currently running the fiber, set by whoever switches to it.
+	FibersSystemWorker *worker;
+	// Thread fibers can only be resumed by the worker owning the thread, NULL for fibers in the pool.
+	FibersSystemWorker *home_worker;
+
+	FibersSystemJobCounter *wait_counter;
+	unsigned wait_generation;
+	unsigned wait_value;
+	// Set instead of wait_counter when waiting on a mutex, semaphore or event.
+	FiberWaitQueue *wait_queue;
+	volatile int32_t *wait_address;
+	int32_t wait_expected;
+	// Link in the waiter list of wait_counter, or in a ready queue once the wait is over.
+	FiberStruct *next;
 
 	FibersSystemJob current_job;
+
+	// Scratch allocations bump scratch_offset in scratch_blocks[scratch_block], moving on to the next block when it is
+	// full. Reset when the job is done, the blocks are kept for the next one.
+	FibersSystemScratchBlock *scratch_blocks;
+	unsigned scratch_block;
+	unsigned scratch_offset;
 } FiberStruct;
 
-typedef struct FibersSystemCounter
+// Counters only count down while jobs run. A fiber waiting for a value is parked in the counter's waiter list and is
+// moved to a ready queue by the decrement that takes the counter down to that value. Counters live in chunks that are
+// never freed before destroy, so a stale handle always points at a valid slot and is told apart by its generation.
+typedef struct FibersSystemJobCounter
 {
-	LONG counter;
+	volatile int32_t counter;
+	volatile int32_t generation;
 	unsigned entry;
-} FibersSystemCounter;
+	unsigned persistent;
+	PlatformSpinLock lock;
+	FiberStruct *volatile waiters;
 
-typedef struct FibersSystemWaitList
-{
-	LPVOID fiber;
-	FibersSystemCounter *counter;
-	unsigned expected_value;
-} FibersSystemWaitList;
+	// Jobs pushed when the counter reaches 0, kept allocated for the next use of the slot.
+	FibersSystemJob *continuations;
+	volatile int32_t n_continuations;
+	// Set when continuations were attached to a counter that isn't persistent, which is released once they are pushed.
+	unsigned release_after_continuations;
+} FibersSystemJobCounter;
 
-typedef struct FibersSystem
+enum { FIBERS_SYSTEM_COUNTER_CHUNK_SIZE = 256, FIBERS_SYSTEM_MAX_COUNTER_CHUNKS = 1024 };
+
+typedef struct FibersSystemFiberPool
 {
-	FiberStruct *fibers;
+	FiberStruct **fibers;
 	unsigned *free_fibers;
-	FibersSystemWaitList *wait_list;
+	unsigned max_fibers;
+	unsigned stack_size;
+} FibersSystemFiberPool;
+
+typedef struct FibersSystemReadyQueue
+{
+	PlatformSpinLock lock;
+	FiberStruct *volatile head;
+	FiberStruct *tail;
+} FibersSystemReadyQueue;
+
+// What the fiber we switched to has to do with the fiber we switched away from. This can't be done before
+// the switch since another worker could pick up the fiber while it is still running on this one.
+enum FiberSwitchAction { FIBER_SWITCH_NONE, FIBER_SWITCH_FREE, FIBER_SWITCH_WAIT, FIBER_SWITCH_WAIT_QUEUE };
+
+// Every worker has a deque for each of the priorities below FIBERS_SYSTEM_PRIORITY_MAIN_THREAD, searched in this order.
+enum { FIBERS_SYSTEM_N_PRIORITIES = FIBERS_SYSTEM_PRIORITY_MAIN_THREAD };
+static const unsigned priority_order[FIBERS_SYSTEM_N_PRIORITIES] = { FIBERS_SYSTEM_PRIORITY_HIGH, FIBERS_SYSTEM_PRIORITY_NORMAL, FIBERS_SYSTEM_PRIORITY_LOW };
 
+enum { FIBERS_SYSTEM_CACHE_LINE = 64 };
+
+typedef struct FibersSystemJobArray
+{
+	int64_t mask;
 	FibersSystemJob *jobs;
+} FibersSystemJobArray;
+
+// Chase-Lev work-stealing deque. The owning worker pushes and pops at the bottom, other workers steal from the top.
+// The array only grows; replaced arrays are kept until destroy since a thief may still be reading from them.
+typedef struct FibersSystemJobDeque
+{
+	volatile int64_t top;
+	char top_padding[FIBERS_SYSTEM_CACHE_LINE - sizeof(int64_t)];
+	volatile int64_t bottom;
+	FibersSystemJobArray *volatile array;
+	FibersSystemJobArray **retired_arrays;
+	Allocator *allocator;
+} FibersSystemJobDeque;
+
+enum FibersSystemTraceEventType
+{
+	// A job has no end event, its slice ends at the next job begin, wait or switch on the worker. The same job begun
+	// again straight after itself only counts another run in the event, so back to back runs of a job read the TSC,
+	// most of what recording costs, once between them.
+	FIBERS_SYSTEM_TRACE_JOB_BEGIN,
+	FIBERS_SYSTEM_TRACE_WAIT_BEGIN,
+	FIBERS_SYSTEM_TRACE_WAIT_END,
+	FIBERS_SYSTEM_TRACE_SWITCH,
+	FIBERS_SYSTEM_TRACE_STEAL,
+	FIBERS_SYSTEM_TRACE_IDLE_BEGIN,
+	FIBERS_SYSTEM_TRACE_IDLE_END,
+};
+
+// arg is the job entry for job and wait events, the fiber switched to and the worker stolen from.
+typedef struct FibersSystemTraceEvent
+{
+	uint64_t ticks;
+	uint64_t arg;
+	unsigned type;
+	// Runs of the job for job begin events, 1 for the others.
+	unsigned n_jobs;
+} FibersSystemTraceEvent;
+
+enum { FIBERS_SYSTEM_TRACE_EVENTS = 1 << 16 };
+
+typedef struct FibersSystemWorker
+{
+	FibersSystem *fibers_system;
+	unsigned index;
+	PlatformThread *thread;
+
+	FibersSystemJobDeque jobs[FIBERS_SYSTEM_N_PRIORITIES];
+	unsigned random_state;
+	// Fibers that only this worker may resume.
+	FibersSystemReadyQueue pinned_ready_fibers;
+
+	FiberStruct thread_fiber;
+	// Only worker 0 needs a separate scheduler fiber since its thread fiber is the caller's, which may block on counters.
+	FiberStruct scheduler_fiber;
+	FiberStruct *idle_fiber;
+
+	FiberStruct *current_fiber;
+	FiberStruct *previous_fiber;
+	unsigned previous_action;
+	uint64_t n_switches;
 
-	FibersSystemCounter *job_counters;
+	// 1 while the worker is parked or about to park, cleared by whoever wakes it.
+	volatile int32_t sleeping;
+
+	// A job the worker took while every fiber was in use. It is held here rather than pushed back so it keeps its
+	// place, and is started before looking for other jobs.
+	FibersSystemJob pending_job;
+	// Set while pending_job holds a job, the worker is woken when a fiber is freed.
+	volatile int32_t waiting_for_fiber;
+	// fibers_freed when the worker last found no fiber, there is no point taking the lock again until it changes.
+	int32_t fibers_freed_seen;
+
+	// Only written by the worker, trace_head counts all events ever written and wraps around the buffer.
+	FibersSystemTraceEvent *trace_events;
+	volatile int64_t trace_head;
+} FibersSystemWorker;
+
+// A read in flight. Completions come in on an I/O thread, which can't push continuations onto a worker's deque, so
+// they are handed to the workers to decrement the counter.
+typedef struct FibersSystemAsyncRead
+{
+	FibersSystem *fibers_system;
+	FibersSystemJobCounter *counter;
+	unsigned *bytes_read;
+	struct FibersSystemAsyncRead *next;
+} FibersSystemAsyncRead;
+
+typedef struct FibersSystem
+{
+	Allocator *allocator;
+
+	// Fibers are only taken when a job starts running. Each pool grows on demand up to its max_fibers.
+	FibersSystemFiberPool fiber_pools[FIBERS_SYSTEM_N_STACK_CLASSES];
+	FibersSystemReadyQueue ready_fibers;
+
+	FibersSystemJobCounter *volatile counter_chunks[FIBERS_SYSTEM_MAX_COUNTER_CHUNKS];
+	unsigned n_counter_chunks;
 	unsigned *free_job_counters;
 
-	LPVOID main_fiber;
-	LONG add_variable;
+	FibersSystemWorker *workers;
+
+	// Only drained by worker 0. Any worker may push, serialised by the lock, while worker 0 takes from the top.
+	FibersSystemJobDeque main_thread_jobs;
+	PlatformSpinLock main_thread_jobs_lock;
+#if FIBERS_SYSTEM_SHARED_QUEUE
+	// Every worker pushes to and pops from the bottom under the lock, the workers' own deques stay empty.
+	FibersSystemJobDeque shared_jobs[FIBERS_SYSTEM_N_PRIORITIES];
+	PlatformSpinLock shared_jobs_lock;
+#endif
+
+	// Protects the fiber and counter pools.
+	PlatformSpinLock lock;
+	// Bumped with the lock held whenever a fiber is freed.
+	volatile int32_t fibers_freed;
+	// Workers with waiting_for_fiber set, only counted up with the lock held.
+	volatile int32_t n_waiting_for_fiber;
+	volatile int32_t quit;
+	// Number of workers with sleeping set, so publishing work is only a fence and a load while everyone is busy.
+	volatile int32_t n_sleeping;
+
+	volatile int32_t tracing;
+	uint64_t trace_start_ticks;
+	uint64_t trace_start_ns;
+	uint64_t trace_stop_ticks;
+	uint64_t trace_stop_ns;
+
+	// Created by the first read.
+	PlatformAsyncIo *volatile async_io;
+	// Pushed by the I/O thread, taken all at once by whichever worker looks for work next.
+	FibersSystemAsyncRead *volatile completed_reads;
+	// Protected by the lock.
+	FibersSystemAsyncRead *free_reads;
 } FibersSystem;
 
-FiberStruct *allocate_fiber(FibersSystem *fibers_system)
+static PLATFORM_THREAD_LOCAL FibersSystemWorker *tls_worker;
+
+// Never inlined so the thread local isn't cached across a fiber switch that resumes on another thread.
+static PLATFORM_NOINLINE FibersSystemWorker *fibers_system_current_worker(void)
 {
-	assert(sb_count(fibers_system->free_fibers) > 0);
-	const unsigned last_slot = sb_count(fibers_system->free_fibers) - 1;
-	unsigned free_fiber = sb_last(fibers_system->free_fibers);
-	fibers_system->free_fibers[last_slot] = 0xffffffffu;
-	sb_pop(fibers_system->free_fibers);
-	return &fibers_system->fibers[free_fiber];
+	return tls_worker;
 }
 
-void free_fiber(FibersSystem *fibers_system, FiberStruct *fiber)
+#if FIBERS_SYSTEM_TRACE
+static void fibers_system_trace_event(FibersSystemWorker *worker, unsigned type, uint64_t arg)
 {
-	fiber->current_job.counter = NULL;
-	fiber->current_job.declaration.job_entry = NULL;
-	fiber->current_job.declaration.job_data = NULL;
+	const int64_t head = worker->trace_head;
+	if (type == FIBERS_SYSTEM_TRACE_JOB_BEGIN && head) {
+		FibersSystemTraceEvent *last = &worker->trace_events[(head - 1) & (FIBERS_SYSTEM_TRACE_EVENTS - 1)];
+		if (last->type == type && last->arg == arg) {
+			last->n_jobs++;
+			return;
+		}
+	}
 
-	assert(sb_count(fibers_system->free_fibers) < sb_count(fibers_system->fibers));
-	unsigned free_fiber = fiber->entry;
-	sb_push(fibers_system->free_fibers, free_fiber);
+	FibersSystemTraceEvent *event = &worker->trace_events[head & (FIBERS_SYSTEM_TRACE_EVENTS - 1)];
+	event->ticks = platform_ticks();
+	event->arg = arg;
+	event->type = type;
+	event->n_jobs = 1;
+	atomic_store_64(&worker->trace_head, head + 1);
 }
 
-void fibers_system_do_work(FibersSystem *fibers_system)
+// Identifies the job in the trace, 0 for fibers that aren't running one.
+static uint64_t fibers_system_job_name(const FibersSystemJob *job)
+{
+	if (job->kind == FIBERS_SYSTEM_JOB_NONE)
+		return 0;
+	return job->kind == FIBERS_SYSTEM_JOB_RANGE ? (uint64_t)(uintptr_t)job->data.range.body : (uint64_t)(uintptr_t)job->job_entry;
+}
+
+#define FIBERS_SYSTEM_TRACE_EVENT(worker, type, arg) do { if ((worker)->fibers_system->tracing) fibers_system_trace_event(worker, type, arg); } while (0)
+#else
+#define FIBERS_SYSTEM_TRACE_EVENT(worker, type, arg) ((void)0)
+#endif
+
+// Everything the fibers system allocates itself is counted under one tag, its stretchy buffers under the sb one.
+static unsigned fibers_system_tag(void)
 {
-	// Go over all fibers in wait list and see if any is done, if so, switch to that fiber.
-	const unsigned n_wait_list_entries = sb_count(fibers_system->wait_list);
-	for (unsigned int i = 0; i < n_wait_list_entries; ++i) {
-		FibersSystemWaitList *waiting = &fibers_system->wait_list[i];
-		unsigned counter_value = InterlockedAdd(&waiting->counter->counter, 0);
-		if (waiting->expected_value != counter_value)
+	static unsigned tag;
+	if (!tag)
+		tag = allocator_tag("fibers");
+	return tag;
+}
+
+static FibersSystemJobArray *job_array_create(Allocator *allocator, int64_t capacity)
+{
+	FibersSystemJobArray *array = allocator_realloc_tagged(allocator, NULL, sizeof(FibersSystemJobArray) + sizeof(FibersSystemJob) * (unsigned)capacity, FIBERS_SYSTEM_CACHE_LINE, fibers_system_tag());
+	array->mask = capacity - 1;
+	array->jobs = (FibersSystemJob *)(array + 1);
+	return array;
+}
+
+static void job_deque_create(Allocator *allocator, FibersSystemJobDeque *deque, unsigned capacity)
+{
+	assert((capacity & (capacity - 1)) == 0);
+	deque->top = 0;
+	deque->bottom = 0;
+	deque->allocator = allocator;
+	deque->array = job_array_create(allocator, capacity);
+	sb_create(allocator, deque->retired_arrays, 4);
+}
+
+static void job_deque_destroy(FibersSystemJobDeque *deque)
+{
+	const unsigned n_retired = sb_count(deque->retired_arrays);
+	for (unsigned i = 0; i < n_retired; ++i)
+		allocator_realloc(deque->allocator, deque->retired_arrays[i], 0, 0);
+	sb_free(deque->retired_arrays);
+	allocator_realloc(deque->allocator, deque->array, 0, 0);
+}
+
+// Owner only.
+static void job_deque_push(FibersSystemJobDeque *deque, FibersSystemJob job)
+{
+	const int64_t bottom = deque->bottom;
+	const int64_t top = atomic_load_64(&deque->top);
+	FibersSystemJobArray *array = deque->array;
+
+	if (bottom - top > array->mask) {
+		FibersSystemJobArray *grown = job_array_create(deque->allocator, 2 * (array->mask + 1));
+		for (int64_t i = top; i < bottom; ++i)
+			grown->jobs[i & grown->mask] = array->jobs[i & array->mask];
+		sb_push(deque->retired_arrays, array);
+		atomic_store_ptr((void *volatile *)&deque->array, grown);
+		array = grown;
+	}
+
+	array->jobs[bottom & array->mask] = job;
+	atomic_store_64(&deque->bottom, bottom + 1);
+}
+
+// Owner only.
+static int job_deque_empty(FibersSystemJobDeque *deque)
+{
+	return deque->bottom <= atomic_load_64(&deque->top);
+}
+
+// Owner only.
+static int job_deque_pop(FibersSystemJobDeque *deque, FibersSystemJob *job)
+{
+	const int64_t bottom = deque->bottom - 1;
+	FibersSystemJobArray *array = deque->array;
+	atomic_store_64(&deque->bottom, bottom);
+	atomic_fence();
+	int64_t top = deque->top;
+
+	if (top > bottom) {
+		atomic_store_64(&deque->bottom, bottom + 1);
+		return 0;
+	}
+
+	*job = array->jobs[bottom & array->mask];
+	if (top != bottom)
+		return 1;
+
+	// Last job, race the thieves for it.
+	const int won = atomic_cas_64(&deque->top, top, top + 1) == top;
+	atomic_store_64(&deque->bottom, bottom + 1);
+	return won;
+}
+
+static int job_deque_steal(FibersSystemJobDeque *deque, FibersSystemJob *job)
+{
+	const int64_t top = atomic_load_64(&deque->top);
+	atomic_fence();
+	const int64_t bottom = atomic_load_64(&deque->bottom);
+	if (top >= bottom)
+		return 0;
+
+	FibersSystemJobArray *array = atomic_load_ptr((void *volatile *)&deque->array);
+	*job = array->jobs[top & array->mask];
+	return atomic_cas_64(&deque->top, top, top + 1) == top;
+}
+
+#if !FIBERS_SYSTEM_SHARED_QUEUE
+static unsigned fibers_system_random(FibersSystemWorker *worker)
+{
+	// xorshift32
+	unsigned x = worker->random_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	worker->random_state = x;
+	return x;
+}
+#endif
+
+// Idle workers first spin, then yield and then park until they are woken for new work.
+enum { FIBERS_SYSTEM_IDLE_SPINS = 64, FIBERS_SYSTEM_IDLE_YIELDS = 16, FIBERS_SYSTEM_SPIN_PAUSES = 32 };
+
+// Called after publishing work, the fence pairs with the one a parking worker has between setting sleeping and
+// looking for work one last time. Either it finds the work or we see it sleeping.
+static void fibers_system_wake_worker(FibersSystemWorker *worker)
+{
+	atomic_fence();
+	if (atomic_load_32(&worker->sleeping) && atomic_cas_32(&worker->sleeping, 1, 0) == 1)
+		platform_wake_address(&worker->sleeping);
+}
+
+// Wakes up to n parked workers, one for each new piece of work that anyone could pick up.
+static void fibers_system_wake_workers(FibersSystem *fibers_system, unsigned n)
+{
+	atomic_fence();
+	if (!atomic_load_32(&fibers_system->n_sleeping))
+		return;
+
+	const unsigned n_workers = sb_count(fibers_system->workers);
+	for (unsigned i = 0; i < n_workers && n; ++i) {
+		FibersSystemWorker *worker = &fibers_system->workers[i];
+		if (atomic_load_32(&worker->sleeping) && atomic_cas_32(&worker->sleeping, 1, 0) == 1) {
+			platform_wake_address(&worker->sleeping);
+			--n;
+		}
+	}
+}
+
+// Doesn't wake anyone, callers wake workers once they are done pushing.
+static void fibers_system_push_job(FibersSystem *fibers_system, FibersSystemWorker *worker, FibersSystemJob job)
+{
+	assert(job.stack_class < FIBERS_SYSTEM_N_STACK_CLASSES);
+	const unsigned priority = job.priority;
+	if (priority == FIBERS_SYSTEM_PRIORITY_MAIN_THREAD) {
+		platform_spin_lock_acquire(&fibers_system->main_thread_jobs_lock);
+		job_deque_push(&fibers_system->main_thread_jobs, job);
+		platform_spin_lock_release(&fibers_system->main_thread_jobs_lock);
+		return;
+	}
+
+	assert(priority < FIBERS_SYSTEM_N_PRIORITIES);
+#if FIBERS_SYSTEM_SHARED_QUEUE
+	(void)worker;
+	platform_spin_lock_acquire(&fibers_system->shared_jobs_lock);
+	job_deque_push(&fibers_system->shared_jobs[priority], job);
+	platform_spin_lock_release(&fibers_system->shared_jobs_lock);
+#else
+	job_deque_push(&worker->jobs[priority], job);
+#endif
+}
+
+// Whether the worker has no jobs of the priority queued, with FIBERS_SYSTEM_SHARED_QUEUE whether no one has.
+static int fibers_system_jobs_empty(FibersSystem *fibers_system, FibersSystemWorker *worker, unsigned priority)
+{
+#if FIBERS_SYSTEM_SHARED_QUEUE
+	(void)worker;
+	return job_deque_empty(&fibers_system->shared_jobs[priority]);
+#else
+	(void)fibers_system;
+	return job_deque_empty(&worker->jobs[priority]);
+#endif
+}
+
+// Main thread jobs first on worker 0, then for each priority in turn the worker's own deque and stealing from the
+// others starting at a random victim, or with FIBERS_SYSTEM_SHARED_QUEUE the shared queue of the priority.
+static int fibers_system_find_job(FibersSystem *fibers_system, FibersSystemWorker *worker, FibersSystemJob *job)
+{
+	if (worker->index == 0 && job_deque_steal(&fibers_system->main_thread_jobs, job))
+		return 1;
+
+#if FIBERS_SYSTEM_SHARED_QUEUE
+	for (unsigned p = 0; p < FIBERS_SYSTEM_N_PRIORITIES; ++p) {
+		FibersSystemJobDeque *deque = &fibers_system->shared_jobs[priority_order[p]];
+		if (job_deque_empty(deque))
 			continue;
+		platform_spin_lock_acquire(&fibers_system->shared_jobs_lock);
+		const int found = job_deque_pop(deque, job);
+		platform_spin_lock_release(&fibers_system->shared_jobs_lock);
+		if (found)
+			return 1;
+	}
+	return 0;
+#else
+	const unsigned n_workers = sb_count(fibers_system->workers);
+	const unsigned first_victim = fibers_system_random(worker) % n_workers;
+	for (unsigned p = 0; p < FIBERS_SYSTEM_N_PRIORITIES; ++p) {
+		const unsigned priority = priority_order[p];
+		if (job_deque_pop(&worker->jobs[priority], job))
+			return 1;
+
+		for (unsigned i = 0; i < n_workers; ++i) {
+			FibersSystemWorker *victim = &fibers_system->workers[(first_victim + i) % n_workers];
+			if (victim != worker && job_deque_steal(&victim->jobs[priority], job)) {
+				FIBERS_SYSTEM_TRACE_EVENT(worker, FIBERS_SYSTEM_TRACE_STEAL, victim->index);
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+#endif
+}
+
+static void ready_queue_init(FibersSystemReadyQueue *queue)
+{
+	queue->lock = 0;
+	queue->head = NULL;
+	queue->tail = NULL;
+}
+
+static void ready_queue_push(FibersSystemReadyQueue *queue, FiberStruct *fiber)
+{
+	fiber->next = NULL;
+	platform_spin_lock_acquire(&queue->lock);
+	if (queue->tail)
+		queue->tail->next = fiber;
+	else
+		atomic_store_ptr((void *volatile *)&queue->head, fiber);
+	queue->tail = fiber;
+	platform_spin_lock_release(&queue->lock);
+}
 
-		FibersSystemWaitList done = *waiting;
-		fibers_system->wait_list[i] = sb_last(fibers_system->wait_list);
-		sb_pop(fibers_system->wait_list);
+static FiberStruct *ready_queue_pop(FibersSystemReadyQueue *queue)
+{
+	if (!atomic_load_ptr((void *volatile *)&queue->head))
+		return NULL;
+
+	platform_spin_lock_acquire(&queue->lock);
+	FiberStruct *fiber = queue->head;
+	if (fiber) {
+		queue->head = fiber->next;
+		if (!queue->head)
+			queue->tail = NULL;
+		fiber->next = NULL;
+	}
+	platform_spin_lock_release(&queue->lock);
+	return fiber;
+}
+
+static void fibers_system_make_ready(FibersSystem *fibers_system, FiberStruct *fiber)
+{
+	FibersSystemWorker *home_worker = fiber->home_worker;
+	if (home_worker) {
+		ready_queue_push(&home_worker->pinned_ready_fibers, fiber);
+		fibers_system_wake_worker(home_worker);
+	} else {
+		ready_queue_push(&fibers_system->ready_fibers, fiber);
+		fibers_system_wake_workers(fibers_system, 1);
+	}
+}
 
-		SwitchToFiber(done.fiber);
+// Parks a fiber that has switched away on its counter, unless the counter got there in the meantime.
+static void fibers_system_park_fiber(FibersSystem *fibers_system, FiberStruct *fiber)
+{
+	FibersSystemJobCounter *counter = fiber->wait_counter;
+	platform_spin_lock_acquire(&counter->lock);
+	if ((unsigned)counter->generation != fiber->wait_generation) {
+		// Released while we were switching away, so whatever it counted is done.
+		platform_spin_lock_release(&counter->lock);
+		fibers_system_make_ready(fibers_system, fiber);
 		return;
 	}
 
-	// Couldn't find a fiber that is done, proceed with consuming jobs from the job queue.
-	while (sb_count(fibers_system->jobs)) {
-		FibersSystemJob job = sb_last(fibers_system->jobs);
-		sb_pop(fibers_system->jobs);
-		FiberStruct *fiber = allocate_fiber(fibers_system);
-		fiber->current_job = job;
+	fiber->next = counter->waiters;
+	counter->waiters = fiber;
+	// Publish the waiter before reading the counter, pairs with the decrement reading waiters after the write.
+	atomic_fence();
+	const int done = atomic_load_32(&counter->counter) <= (int32_t)fiber->wait_value;
+	if (done)
+		counter->waiters = fiber->next;
+	platform_spin_lock_release(&counter->lock);
 
-		if (fiber->fiber == GetCurrentFiber())
-			return;
-		SwitchToFiber(fiber->fiber);
+	if (done)
+		fibers_system_make_ready(fibers_system, fiber);
+}
+
+// Queues a fiber that has switched away on its wait queue, unless the word it waits on has changed in the meantime.
+static void fibers_system_park_fiber_on_queue(FibersSystem *fibers_system, FiberStruct *fiber)
+{
+	FiberWaitQueue *queue = fiber->wait_queue;
+	platform_spin_lock_acquire(&queue->lock);
+	FiberStruct *tail = queue->tail;
+	fiber->next = NULL;
+	if (tail)
+		tail->next = fiber;
+	else
+		queue->head = fiber;
+	queue->tail = fiber;
+
+	// Publish the waiter before reading the word, pairs with the waker reading head after changing it.
+	atomic_fence();
+	const int changed = atomic_load_32(fiber->wait_address) != fiber->wait_expected;
+	if (changed) {
+		if (tail)
+			tail->next = NULL;
+		else
+			queue->head = NULL;
+		queue->tail = tail;
+	}
+	platform_spin_lock_release(&queue->lock);
+
+	if (changed)
+		fibers_system_make_ready(fibers_system, fiber);
+}
+
+// Makes up to n fibers waiting on the queue ready, oldest first.
+static void fibers_system_wake_queue(FiberWaitQueue *queue, unsigned n)
+{
+	if (!atomic_load_ptr(&queue->head))
+		return;
+
+	platform_spin_lock_acquire(&queue->lock);
+	FiberStruct *woken = queue->head;
+	FiberStruct *last = NULL;
+	for (FiberStruct *fiber = woken; fiber && n; fiber = fiber->next, --n)
+		last = fiber;
+	if (last) {
+		queue->head = last->next;
+		if (!last->next)
+			queue->tail = NULL;
+		last->next = NULL;
+	} else {
+		woken = NULL;
+	}
+	platform_spin_lock_release(&queue->lock);
+
+	while (woken) {
+		FiberStruct *fiber = woken;
+		woken = fiber->next;
+		fibers_system_make_ready(fiber->fibers_system, fiber);
+	}
+}
+
+static void fibers_system_release_counter(FibersSystem *fibers_system, FibersSystemJobCounter *counter, unsigned generation);
+
+// Pushes the continuations of a counter that has reached 0. Called with the counter lock held, returns non-zero if
+// the counter should be released once the lock is dropped.
+static int fibers_system_push_continuations(FibersSystem *fibers_system, FibersSystemWorker *worker, FibersSystemJobCounter *counter)
+{
+	const unsigned n_jobs = sb_count(counter->continuations);
+	if (!n_jobs)
+		return 0;
+
+	unsigned n_main_thread_jobs = 0;
+	for (unsigned i = 0; i < n_jobs; ++i) {
+		fibers_system_push_job(fibers_system, worker, counter->continuations[i]);
+		n_main_thread_jobs += counter->continuations[i].priority == FIBERS_SYSTEM_PRIORITY_MAIN_THREAD;
+	}
+	while (sb_count(counter->continuations))
+		sb_pop(counter->continuations);
+	atomic_store_32(&counter->n_continuations, 0);
+
+	if (n_main_thread_jobs)
+		fibers_system_wake_worker(&fibers_system->workers[0]);
+	fibers_system_wake_workers(fibers_system, n_jobs - n_main_thread_jobs);
+
+	const int release = counter->release_after_continuations;
+	counter->release_after_continuations = 0;
+	return release;
+}
+
+static void fibers_system_decrement_counter(FibersSystem *fibers_system, FibersSystemWorker *worker, FibersSystemJobCounter *counter)
+{
+	// Until our decrement the counter can't be released, so this is the generation our job was counted in.
+	const unsigned generation = (unsigned)counter->generation;
+	const int32_t remaining = atomic_add_32(&counter->counter, -1);
+	const int continue_jobs = remaining == 0 && atomic_load_32(&counter->n_continuations);
+	if (!atomic_load_ptr((void *volatile *)&counter->waiters) && !continue_jobs)
+		return;
+
+	int release = 0;
+	if (continue_jobs) {
+		platform_spin_lock_acquire(&counter->lock);
+		if ((unsigned)counter->generation == generation)
+			release = fibers_system_push_continuations(fibers_system, worker, counter);
+		platform_spin_lock_release(&counter->lock);
+	}
+
+	FiberStruct *woken = NULL;
+	platform_spin_lock_acquire(&counter->lock);
+	// Compare against the current value rather than the one from our decrement. Once the counter is done a waiter
+	// may release it and the slot be reused before we get here.
+	const int32_t value = atomic_load_32(&counter->counter);
+	FiberStruct **link = (FiberStruct **)&counter->waiters;
+	while (*link) {
+		FiberStruct *fiber = *link;
+		if ((int32_t)fiber->wait_value >= value) {
+			*link = fiber->next;
+			fiber->next = woken;
+			woken = fiber;
+		} else {
+			link = &fiber->next;
+		}
+	}
+	platform_spin_lock_release(&counter->lock);
+
+	while (woken) {
+		FiberStruct *fiber = woken;
+		woken = fiber->next;
+		fibers_system_make_ready(fibers_system, fiber);
 	}
+
+	if (release)
+		fibers_system_release_counter(fibers_system, counter, generation);
 }
 
-void fiber_entry_point(LPVOID fiber_param)
+static FiberStruct *fibers_system_add_fiber(FibersSystem *fibers_system, unsigned stack_class);
+
+// Takes a fiber of the stack class, or of a larger one when that pool is used up. Returns NULL when all fitting fibers
+// are in use and their pools are at their limit. Called with the lock held.
+FiberStruct *allocate_fiber(FibersSystem *fibers_system, unsigned stack_class)
+{
+	for (unsigned c = stack_class; c < FIBERS_SYSTEM_N_STACK_CLASSES; ++c) {
+		FibersSystemFiberPool *pool = &fibers_system->fiber_pools[c];
+		if (!sb_count(pool->free_fibers)) {
+			if (sb_count(pool->fibers) >= pool->max_fibers)
+				continue;
+			return fibers_system_add_fiber(fibers_system, c);
+		}
+
+		const unsigned last_slot = sb_count(pool->free_fibers) - 1;
+		unsigned free_fiber = sb_last(pool->free_fibers);
+		pool->free_fibers[last_slot] = 0xffffffffu;
+		sb_pop(pool->free_fibers);
+		return pool->fibers[free_fiber];
+	}
+
+	return NULL;
+}
+
+void free_fiber(FibersSystem *fibers_system, FiberStruct *fiber)
+{
+	fiber->current_job = (FibersSystemJob){ .kind = FIBERS_SYSTEM_JOB_NONE };
+
+	FibersSystemFiberPool *pool = &fibers_system->fiber_pools[fiber->stack_class];
+	assert(sb_count(pool->free_fibers) < sb_count(pool->fibers));
+	unsigned free_fiber = fiber->entry;
+	sb_push(pool->free_fibers, free_fiber);
+	atomic_add_32(&fibers_system->fibers_freed, 1);
+}
+
+// Called after freeing a fiber once the lock is dropped. A worker that found no fiber counted itself in with the lock
+// held, so if it did so before the free it is seen here, and if after it saw the free.
+static void fibers_system_wake_fiber_waiters(FibersSystem *fibers_system)
+{
+	if (!atomic_load_32(&fibers_system->n_waiting_for_fiber))
+		return;
+
+	const unsigned n_workers = sb_count(fibers_system->workers);
+	for (unsigned i = 0; i < n_workers; ++i) {
+		FibersSystemWorker *worker = &fibers_system->workers[i];
+		if (atomic_load_32(&worker->waiting_for_fiber))
+			fibers_system_wake_worker(worker);
+	}
+}
+
+static void fibers_system_complete_reads(FibersSystem *fibers_system, FibersSystemWorker *worker)
+{
+	FibersSystemAsyncRead *reads;
+	do {
+		reads = atomic_load_ptr((void *volatile *)&fibers_system->completed_reads);
+	} while (reads && atomic_cas_ptr((void *volatile *)&fibers_system->completed_reads, reads, NULL) != reads);
+
+	while (reads) {
+		FibersSystemAsyncRead *read = reads;
+		reads = read->next;
+		FibersSystemJobCounter *counter = read->counter;
+		platform_spin_lock_acquire(&fibers_system->lock);
+		read->next = fibers_system->free_reads;
+		fibers_system->free_reads = read;
+		platform_spin_lock_release(&fibers_system->lock);
+		fibers_system_decrement_counter(fibers_system, worker, counter);
+	}
+}
+
+// Finds the next fiber for the worker to run: first a fiber whose wait is over, then a fiber picking
+// up a new job from the job deques. If reuse is set the new job is given to that fiber instead of a free one.
+static FiberStruct *fibers_system_next_fiber(FibersSystem *fibers_system, FibersSystemWorker *worker, FiberStruct *reuse)
+{
+	// Finished reads may make fibers ready, so take them in first.
+	if (atomic_load_ptr((void *volatile *)&fibers_system->completed_reads))
+		fibers_system_complete_reads(fibers_system, worker);
+
+	FiberStruct *ready = ready_queue_pop(&worker->pinned_ready_fibers);
+	if (!ready)
+		ready = ready_queue_pop(&fibers_system->ready_fibers);
+	if (ready)
+		return ready;
+
+	FibersSystemJob job;
+	const int pending = worker->waiting_for_fiber;
+	if (pending)
+		job = worker->pending_job;
+	else if (!fibers_system_find_job(fibers_system, worker, &job))
+		return NULL;
+
+	// A finishing fiber keeps going with the job unless its stack is too small for it.
+	FiberStruct *fiber = reuse && reuse->stack_class >= job.stack_class ? reuse : NULL;
+	if (!fiber) {
+		if (pending && atomic_load_32(&fibers_system->fibers_freed) == worker->fibers_freed_seen)
+			return NULL;
+
+		platform_spin_lock_acquire(&fibers_system->lock);
+		fiber = allocate_fiber(fibers_system, job.stack_class);
+		// Out of fibers, hold on to the job until one is freed.
+		if (!fiber) {
+			worker->fibers_freed_seen = fibers_system->fibers_freed;
+			if (!pending) {
+				worker->pending_job = job;
+				atomic_store_32(&worker->waiting_for_fiber, 1);
+				atomic_add_32(&fibers_system->n_waiting_for_fiber, 1);
+			}
+		}
+		platform_spin_lock_release(&fibers_system->lock);
+		if (!fiber)
+			return NULL;
+	}
+
+	if (pending) {
+		atomic_store_32(&worker->waiting_for_fiber, 0);
+		atomic_add_32(&fibers_system->n_waiting_for_fiber, -1);
+	}
+	fiber->current_job = job;
+	return fiber;
+}
+
+static void fibers_system_finish_switch(FibersSystemWorker *worker)
+{
+	FibersSystem *fibers_system = worker->fibers_system;
+	FiberStruct *previous = worker->previous_fiber;
+	const unsigned action = worker->previous_action;
+	worker->previous_fiber = NULL;
+	worker->previous_action = FIBER_SWITCH_NONE;
+
+	switch (action) {
+	case FIBER_SWITCH_FREE:
+		platform_spin_lock_acquire(&fibers_system->lock);
+		free_fiber(fibers_system, previous);
+		platform_spin_lock_release(&fibers_system->lock);
+		fibers_system_wake_fiber_waiters(fibers_system);
+		break;
+	case FIBER_SWITCH_WAIT:
+		fibers_system_park_fiber(fibers_system, previous);
+		break;
+	case FIBER_SWITCH_WAIT_QUEUE:
+		fibers_system_park_fiber_on_queue(fibers_system, previous);
+		break;
+	default:
+		break;
+	}
+}
+
+// Switches from the fiber running on the worker to another one. Returns once the calling fiber is resumed,
+// possibly on a different worker.
+static void fibers_system_switch(FibersSystemWorker *worker, FiberStruct *from, FiberStruct *to, unsigned action)
+{
+	worker->previous_fiber = from;
+	worker->previous_action = action;
+	worker->current_fiber = to;
+	worker->n_switches++;
+	to->worker = worker;
+
+	const int wait = action == FIBER_SWITCH_WAIT || action == FIBER_SWITCH_WAIT_QUEUE;
+	if (wait && from->current_job.kind != FIBERS_SYSTEM_JOB_NONE)
+		FIBERS_SYSTEM_TRACE_EVENT(worker, FIBERS_SYSTEM_TRACE_WAIT_BEGIN, fibers_system_job_name(&from->current_job));
+	FIBERS_SYSTEM_TRACE_EVENT(worker, FIBERS_SYSTEM_TRACE_SWITCH, to->entry);
+
+	platform_fiber_switch(from->fiber, to->fiber);
+
+	fibers_system_finish_switch(from->worker);
+	if (wait && from->current_job.kind != FIBERS_SYSTEM_JOB_NONE)
+		FIBERS_SYSTEM_TRACE_EVENT(from->worker, FIBERS_SYSTEM_TRACE_WAIT_END, fibers_system_job_name(&from->current_job));
+}
+
+static FibersSystemJobCounter *fibers_system_counter_slot(FibersSystem *fibers_system, unsigned index);
+static FibersSystemJob *fibers_system_task_graph_node_job(FibersSystemJob *job);
+static void fibers_system_task_graph_node_done(FibersSystem *fibers_system, FibersSystemWorker *worker, FibersSystemJob *job, uint64_t start_ns);
+
+enum { FIBERS_SYSTEM_TARGET_BATCH_NS = 20000 };
+
+// Runs batches of doubling size until they add up to a fraction of the target batch time, then returns the grain
+// that makes one batch take about the target time.
+static unsigned fibers_system_measure_grain(FibersSystemJob *job, unsigned *begin, unsigned end)
+{
+	uint64_t elapsed = 0;
+	unsigned n_items = 0;
+	unsigned batch = 1;
+	while (*begin < end && elapsed < FIBERS_SYSTEM_TARGET_BATCH_NS / 4) {
+		const unsigned batch_end = end - *begin > batch ? *begin + batch : end;
+		const uint64_t start = platform_time_ns();
+		job->data.range.body(job->data.range.data, *begin, batch_end);
+		elapsed += platform_time_ns() - start;
+		n_items += batch_end - *begin;
+		*begin = batch_end;
+		batch *= 2;
+	}
+
+	if (!elapsed)
+		return n_items ? n_items : 1;
+
+	const uint64_t grain = (uint64_t)n_items * FIBERS_SYSTEM_TARGET_BATCH_NS / elapsed;
+	return grain ? (grain < 0xffffffffu ? (unsigned)grain : 0xffffffffu) : 1;
+}
+
+static void fibers_system_run_range(FibersSystem *fibers_system, FiberStruct *fiber, FibersSystemJob *job)
+{
+	unsigned begin = job->data.range.begin;
+	unsigned end = job->data.range.end;
+	if (!job->data.range.grain)
+		job->data.range.grain = fibers_system_measure_grain(job, &begin, end);
+	const unsigned grain = job->data.range.grain;
+	const int can_split = sb_count(fibers_system->workers) > 1;
+
+	while (begin < end) {
+		// Lazy binary splitting, only give away half of what is left when the worker has run out of other work.
+		// The body may wait on counters and resume on another worker, so look the worker up every time.
+		FibersSystemWorker *worker = fiber->worker;
+		if (can_split && end - begin > grain && fibers_system_jobs_empty(fibers_system, worker, job->priority)) {
+			const unsigned middle = begin + (end - begin) / 2;
+			FibersSystemJob split = *job;
+			split.data.range.begin = middle;
+			split.data.range.end = end;
+			atomic_add_32(&fibers_system_counter_slot(fibers_system, job->counter)->counter, 1);
+			fibers_system_push_job(fibers_system, worker, split);
+			fibers_system_wake_workers(fibers_system, 1);
+			end = middle;
+			continue;
+		}
+
+		const unsigned batch_end = end - begin > grain ? begin + grain : end;
+		job->data.range.body(job->data.range.data, begin, batch_end);
+		begin = batch_end;
+	}
+}
+
+void fiber_entry_point(void *fiber_param)
 {
 	FiberStruct *fiber_struct = fiber_param;
+	FibersSystem *fibers_system = fiber_struct->fibers_system;
+	fibers_system_finish_switch(fiber_struct->worker);
 
 	while (1) {
 		FibersSystemJob current_job = fiber_struct->current_job;
 
-		if (current_job.counter && current_job.declaration.job_entry && current_job.declaration.job_data) {
-			(*current_job.declaration.job_entry)(current_job.declaration.job_data);
-			InterlockedDecrement(&current_job.counter->counter);
+		// Main thread jobs have to resume on worker 0 if they wait.
+		const int main_thread_job = current_job.priority == FIBERS_SYSTEM_PRIORITY_MAIN_THREAD;
+		if (main_thread_job)
+			fiber_struct->home_worker = &fibers_system->workers[0];
+
+		FIBERS_SYSTEM_TRACE_EVENT(fiber_struct->worker, FIBERS_SYSTEM_TRACE_JOB_BEGIN, fibers_system_job_name(&current_job));
+
+		FibersSystemJobCounter *counter = current_job.kind != FIBERS_SYSTEM_JOB_NONE ? fibers_system_counter_slot(fibers_system, current_job.counter) : NULL;
+		switch (current_job.kind) {
+		case FIBERS_SYSTEM_JOB_RANGE:
+			fibers_system_run_range(fibers_system, fiber_struct, &current_job);
+			fibers_system_decrement_counter(fibers_system, fiber_struct->worker, counter);
+			break;
+		case FIBERS_SYSTEM_JOB_GRAPH_NODE: {
+			const uint64_t start_ns = platform_time_ns();
+			FibersSystemJob *node_job = fibers_system_task_graph_node_job(&current_job);
+			(*node_job->job_entry)(node_job->kind == FIBERS_SYSTEM_JOB_INLINE ? (void *)node_job->data.inline_data : node_job->data.job_data);
+			fibers_system_task_graph_node_done(fibers_system, fiber_struct->worker, &current_job, start_ns);
+			fibers_system_decrement_counter(fibers_system, fiber_struct->worker, counter);
+			break;
 		}
+		case FIBERS_SYSTEM_JOB_INLINE:
+			(*current_job.job_entry)(current_job.data.inline_data);
+			fibers_system_decrement_counter(fibers_system, fiber_struct->worker, counter);
+			break;
+		case FIBERS_SYSTEM_JOB_POINTER:
+			(*current_job.job_entry)(current_job.data.job_data);
+			fibers_system_decrement_counter(fibers_system, fiber_struct->worker, counter);
+			break;
+		default:
+			break;
+		}
+
+		if (main_thread_job)
+			fiber_struct->home_worker = NULL;
+		fiber_struct->scratch_block = 0;
+		fiber_struct->scratch_offset = 0;
+
+		// Keep running jobs on this fiber for as long as there are no waiting fibers ready to continue.
+		FibersSystemWorker *worker = fiber_struct->worker;
+		FiberStruct *next = fibers_system_next_fiber(fibers_system, worker, fiber_struct);
+		if (next == fiber_struct)
+			continue;
 
-		free_fiber(fiber_struct->fibers_system, fiber_struct);
-		fibers_system_do_work(fiber_struct->fibers_system);
+		fibers_system_switch(worker, fiber_struct, next ? next : worker->idle_fiber, FIBER_SWITCH_FREE);
 	}
 }
 
-FibersSystem *fibers_system_create(Allocator *allocator, unsigned n_fibers)
+// Announces the worker as sleeping, looks for work one last time and blocks if there is none. Returns the fiber
+// found by the last look, if any.
+static FiberStruct *fibers_system_park_worker(FibersSystem *fibers_system, FibersSystemWorker *worker)
 {
-	FibersSystem* fibers_system = allocator_realloc(allocator, NULL, sizeof(FibersSystem), 16);
-	sb_create(allocator, fibers_system->fibers, n_fibers);
-	sb_add(fibers_system->fibers, n_fibers);
-	sb_create(allocator, fibers_system->wait_list, n_fibers);
+	atomic_store_32(&worker->sleeping, 1);
+	atomic_add_32(&fibers_system->n_sleeping, 1);
+	atomic_fence();
 
-	sb_create(allocator, fibers_system->free_fibers, n_fibers);
-	for (unsigned i = 0; i < n_fibers; ++i)
-		sb_push(fibers_system->free_fibers, i);
+	FiberStruct *next = fibers_system_next_fiber(fibers_system, worker, NULL);
+	if (!next && !atomic_load_32(&fibers_system->quit))
+		platform_wait_on_address(&worker->sleeping, 1);
 
-	sb_create(allocator, fibers_system->jobs, 10);
+	// If someone woke us while we found work on our own, pass the wake on so it isn't lost.
+	const int woken = atomic_exchange_32(&worker->sleeping, 0) == 0;
+	atomic_add_32(&fibers_system->n_sleeping, -1);
+	if (next && woken)
+		fibers_system_wake_workers(fibers_system, 1);
+	return next;
+}
+
+static void fibers_system_worker_loop(FibersSystemWorker *worker)
+{
+	FibersSystem *fibers_system = worker->fibers_system;
+	FiberStruct *idle_fiber = worker->idle_fiber;
+	unsigned idle_rounds = 0;
 
-	sb_create(allocator, fibers_system->job_counters, 256);
-	sb_add(fibers_system->job_counters, sb_capacity(fibers_system->job_counters));
-	for (unsigned i = 0; i < sb_count(fibers_system->job_counters); ++i)
-		fibers_system->job_counters[i].entry = i;
+	while (!atomic_load_32(&fibers_system->quit)) {
+		FiberStruct *next = fibers_system_next_fiber(fibers_system, worker, NULL);
+		if (!next) {
+			if (!idle_rounds)
+				FIBERS_SYSTEM_TRACE_EVENT(worker, FIBERS_SYSTEM_TRACE_IDLE_BEGIN, 0);
 
-	sb_create(allocator, fibers_system->free_job_counters, 256);
-	for (unsigned i = 0; i < 256; ++i)
-		sb_push(fibers_system->free_job_counters, i);
+			if (idle_rounds < FIBERS_SYSTEM_IDLE_SPINS) {
+				for (unsigned i = 0; i < FIBERS_SYSTEM_SPIN_PAUSES; ++i)
+					cpu_pause();
+			} else if (idle_rounds < FIBERS_SYSTEM_IDLE_SPINS + FIBERS_SYSTEM_IDLE_YIELDS) {
+				platform_thread_yield();
+			} else {
+				next = fibers_system_park_worker(fibers_system, worker);
+			}
 
-	fibers_system->main_fiber = ConvertThreadToFiber(NULL);
-	for (unsigned i = 0; i < n_fibers; ++i) {
-		fibers_system->fibers[i].fiber = CreateFiber(0, fiber_entry_point, &fibers_system->fibers[i]);
-		fibers_system->fibers[i].fibers_system = fibers_system;
-		fibers_system->fibers[i].entry = i;
+			if (!next) {
+				++idle_rounds;
+				continue;
+			}
+		}
+
+		if (idle_rounds)
+			FIBERS_SYSTEM_TRACE_EVENT(worker, FIBERS_SYSTEM_TRACE_IDLE_END, 0);
+		idle_rounds = 0;
+		fibers_system_switch(worker, idle_fiber, next, FIBER_SWITCH_NONE);
 	}
+}
 
-	fibers_system->add_variable = 0;
+static void fibers_system_scheduler_entry_point(void *fiber_param)
+{
+	FiberStruct *fiber_struct = fiber_param;
+	fibers_system_finish_switch(fiber_struct->worker);
 
-	InterlockedIncrement(&fibers_system->add_variable);
+	// The scheduler fiber of worker 0 is only ever switched to while the thread fiber waits, so it never gets to
+	// see the quit flag before it is deleted.
+	while (1)
+		fibers_system_worker_loop(fiber_struct->worker);
+}
+
+static void fibers_system_worker_thread(void *param)
+{
+	FibersSystemWorker *worker = param;
+	tls_worker = worker;
+
+	worker->thread_fiber.fiber = platform_fiber_convert_thread();
+	worker->current_fiber = &worker->thread_fiber;
+	fibers_system_worker_loop(worker);
+	platform_fiber_convert_to_thread(worker->thread_fiber.fiber);
+}
+
+static void fibers_system_init_fiber_struct(FibersSystem *fibers_system, FiberStruct *fiber, unsigned entry, unsigned stack_class)
+{
+	fiber->fibers_system = fibers_system;
+	fiber->fiber = NULL;
+	fiber->entry = entry;
+	fiber->stack_class = stack_class;
+	fiber->worker = NULL;
+	fiber->home_worker = NULL;
+	fiber->wait_counter = NULL;
+	fiber->wait_generation = 0;
+	fiber->wait_value = 0;
+	fiber->wait_queue = NULL;
+	fiber->wait_address = NULL;
+	fiber->wait_expected = 0;
+	fiber->next = NULL;
+	fiber->current_job = (FibersSystemJob){ .kind = FIBERS_SYSTEM_JOB_NONE };
+	fiber->scratch_blocks = NULL;
+	fiber->scratch_block = 0;
+	fiber->scratch_offset = 0;
+}
+
+static FiberStruct *fibers_system_add_fiber(FibersSystem *fibers_system, unsigned stack_class)
+{
+	FibersSystemFiberPool *pool = &fibers_system->fiber_pools[stack_class];
+	FiberStruct *fiber = allocator_realloc_tagged(fibers_system->allocator, NULL, sizeof(FiberStruct), 16, fibers_system_tag());
+	fibers_system_init_fiber_struct(fibers_system, fiber, sb_count(pool->fibers), stack_class);
+	fiber->fiber = platform_fiber_create(pool->stack_size, fiber_entry_point, fiber);
+	sb_push(pool->fibers, fiber);
+	return fiber;
+}
+
+FibersSystem *fibers_system_create(Allocator *allocator, const FibersSystemStackPool stack_pools[FIBERS_SYSTEM_N_STACK_CLASSES], unsigned n_workers)
+{
+	if (!n_workers)
+		n_workers = platform_processor_count();
+
+	assert(sizeof(FibersSystemJob) == FIBERS_SYSTEM_CACHE_LINE);
+	FibersSystem* fibers_system = allocator_realloc_tagged(allocator, NULL, sizeof(FibersSystem), 16, fibers_system_tag());
+	fibers_system->allocator = allocator;
+	ready_queue_init(&fibers_system->ready_fibers);
+
+	for (unsigned c = 0; c < FIBERS_SYSTEM_N_STACK_CLASSES; ++c) {
+		FibersSystemFiberPool *pool = &fibers_system->fiber_pools[c];
+		const unsigned n_fibers = stack_pools[c].n_fibers;
+		pool->stack_size = stack_pools[c].stack_size;
+		pool->max_fibers = stack_pools[c].max_fibers < n_fibers ? n_fibers : stack_pools[c].max_fibers;
+		sb_create(allocator, pool->fibers, n_fibers ? n_fibers : 1);
+		sb_create(allocator, pool->free_fibers, n_fibers ? n_fibers : 1);
+		for (unsigned i = 0; i < n_fibers; ++i) {
+			fibers_system_add_fiber(fibers_system, c);
+			sb_push(pool->free_fibers, i);
+		}
+	}
+	// Jobs fall back to larger stacks, so the largest pool has to be able to run any job.
+	assert(fibers_system->fiber_pools[FIBERS_SYSTEM_N_STACK_CLASSES - 1].max_fibers);
+
+	for (unsigned i = 0; i < FIBERS_SYSTEM_MAX_COUNTER_CHUNKS; ++i)
+		fibers_system->counter_chunks[i] = NULL;
+	fibers_system->n_counter_chunks = 0;
+	sb_create(allocator, fibers_system->free_job_counters, FIBERS_SYSTEM_COUNTER_CHUNK_SIZE);
+
+	fibers_system->lock = 0;
+	fibers_system->fibers_freed = 0;
+	fibers_system->n_waiting_for_fiber = 0;
+	fibers_system->quit = 0;
+	fibers_system->n_sleeping = 0;
+	fibers_system->tracing = 0;
+	fibers_system->async_io = NULL;
+	fibers_system->completed_reads = NULL;
+	fibers_system->free_reads = NULL;
+	fibers_system->trace_start_ticks = 0;
+	fibers_system->trace_start_ns = 0;
+	fibers_system->trace_stop_ticks = 0;
+	fibers_system->trace_stop_ns = 0;
+
+	job_deque_create(allocator, &fibers_system->main_thread_jobs, 64);
+	fibers_system->main_thread_jobs_lock = 0;
+#if FIBERS_SYSTEM_SHARED_QUEUE
+	for (unsigned p = 0; p < FIBERS_SYSTEM_N_PRIORITIES; ++p)
+		job_deque_create(allocator, &fibers_system->shared_jobs[p], 256);
+	fibers_system->shared_jobs_lock = 0;
+#endif
+
+	sb_create(allocator, fibers_system->workers, n_workers);
+	(void)sb_add(fibers_system->workers, n_workers);
+	for (unsigned i = 0; i < n_workers; ++i) {
+		FibersSystemWorker *worker = &fibers_system->workers[i];
+		worker->fibers_system = fibers_system;
+		worker->index = i;
+		worker->thread = NULL;
+		for (unsigned p = 0; p < FIBERS_SYSTEM_N_PRIORITIES; ++p)
+			job_deque_create(allocator, &worker->jobs[p], 256);
+		worker->random_state = 0x9e3779b9u * (i + 1);
+		ready_queue_init(&worker->pinned_ready_fibers);
+		fibers_system_init_fiber_struct(fibers_system, &worker->thread_fiber, 0xffffffffu, FIBERS_SYSTEM_STACK_LARGE);
+		fibers_system_init_fiber_struct(fibers_system, &worker->scheduler_fiber, 0xffffffffu, FIBERS_SYSTEM_STACK_LARGE);
+		worker->thread_fiber.worker = worker;
+		worker->thread_fiber.home_worker = worker;
+		worker->idle_fiber = &worker->thread_fiber;
+		worker->current_fiber = NULL;
+		worker->previous_fiber = NULL;
+		worker->previous_action = FIBER_SWITCH_NONE;
+		worker->n_switches = 0;
+		worker->sleeping = 0;
+		worker->pending_job = (FibersSystemJob){ .kind = FIBERS_SYSTEM_JOB_NONE };
+		worker->waiting_for_fiber = 0;
+		worker->fibers_freed_seen = 0;
+		worker->trace_events = NULL;
+		worker->trace_head = 0;
+	}
+
+	FibersSystemWorker *main_worker = &fibers_system->workers[0];
+	tls_worker = main_worker;
+	main_worker->thread_fiber.fiber = platform_fiber_convert_thread();
+	main_worker->scheduler_fiber.fiber = platform_fiber_create(0, fibers_system_scheduler_entry_point, &main_worker->scheduler_fiber);
+	main_worker->scheduler_fiber.home_worker = main_worker;
+	main_worker->idle_fiber = &main_worker->scheduler_fiber;
+	main_worker->current_fiber = &main_worker->thread_fiber;
+
+	for (unsigned i = 1; i < n_workers; ++i)
+		fibers_system->workers[i].thread = platform_thread_create(fibers_system_worker_thread, &fibers_system->workers[i]);
 
 	return fibers_system;
 }
 
 void fibers_system_destroy(Allocator *allocator, FibersSystem *fibers_system)
 {
-	const unsigned n_fibers = sb_count(fibers_system->fibers);
-	for (unsigned i = 0; i < n_fibers; ++i) {
-		DeleteFiber(fibers_system->fibers[i].fiber);
+	if (fibers_system->async_io)
+		platform_async_io_destroy(fibers_system->async_io);
+	assert(!fibers_system->completed_reads);
+	while (fibers_system->free_reads) {
+		FibersSystemAsyncRead *read = fibers_system->free_reads;
+		fibers_system->free_reads = read->next;
+		allocator_realloc(allocator, read, 0, 0);
 	}
 
-	BOOL result = ConvertFiberToThread();
-	assert(result == TRUE);
-	(void)result;
+	atomic_store_32(&fibers_system->quit, 1);
+	fibers_system_wake_workers(fibers_system, 0xffffffffu);
+
+	const unsigned n_workers = sb_count(fibers_system->workers);
+	for (unsigned i = 1; i < n_workers; ++i)
+		platform_thread_join(fibers_system->workers[i].thread);
 
-	sb_free(fibers_system->fibers);
-	sb_free(fibers_system->wait_list);
-	sb_free(fibers_system->free_fibers);
-	sb_free(fibers_system->jobs);
-	sb_free(fibers_system->job_counters);
+	for (unsigned c = 0; c < FIBERS_SYSTEM_N_STACK_CLASSES; ++c) {
+		FibersSystemFiberPool *pool = &fibers_system->fiber_pools[c];
+		const unsigned n_fibers = sb_count(pool->fibers);
+		for (unsigned i = 0; i < n_fibers; ++i) {
+			FiberStruct *fiber = pool->fibers[i];
+			for (unsigned b = 0; b < sb_count(fiber->scratch_blocks); ++b)
+				allocator_realloc(allocator, fiber->scratch_blocks[b].memory, 0, 0);
+			sb_free(fiber->scratch_blocks);
+			platform_fiber_destroy(fiber->fiber);
+			allocator_realloc(allocator, fiber, 0, 0);
+		}
+		sb_free(pool->fibers);
+		sb_free(pool->free_fibers);
+	}
+
+	FibersSystemWorker *main_worker = &fibers_system->workers[0];
+	platform_fiber_destroy(main_worker->scheduler_fiber.fiber);
+	platform_fiber_convert_to_thread(main_worker->thread_fiber.fiber);
+	tls_worker = NULL;
+
+	for (unsigned i = 0; i < fibers_system->n_counter_chunks; ++i) {
+		for (unsigned j = 0; j < FIBERS_SYSTEM_COUNTER_CHUNK_SIZE; ++j)
+			sb_free(fibers_system->counter_chunks[i][j].continuations);
+		allocator_realloc(allocator, fibers_system->counter_chunks[i], 0, 0);
+	}
 	sb_free(fibers_system->free_job_counters);
+	for (unsigned i = 0; i < n_workers; ++i) {
+		for (unsigned p = 0; p < FIBERS_SYSTEM_N_PRIORITIES; ++p)
+			job_deque_destroy(&fibers_system->workers[i].jobs[p]);
+		if (fibers_system->workers[i].trace_events)
+			allocator_realloc(allocator, fibers_system->workers[i].trace_events, 0, 0);
+	}
+	job_deque_destroy(&fibers_system->main_thread_jobs);
+#if FIBERS_SYSTEM_SHARED_QUEUE
+	for (unsigned p = 0; p < FIBERS_SYSTEM_N_PRIORITIES; ++p)
+		job_deque_destroy(&fibers_system->shared_jobs[p]);
+#endif
+	sb_free(fibers_system->workers);
 	allocator_realloc(allocator, fibers_system, 0, 0);
 }
 
-FibersSystemCounter *allocate_job_counter(FibersSystem *fibers_system)
+unsigned fibers_system_worker_count(FibersSystem *fibers_system)
+{
+	return sb_count(fibers_system->workers);
+}
+
+uint64_t fibers_system_switch_count(FibersSystem *fibers_system)
 {
-	assert(sb_count(fibers_system->free_job_counters) > 0);
-	
+	uint64_t n_switches = 0;
+	for (unsigned i = 0; i < sb_count(fibers_system->workers); ++i)
+		n_switches += fibers_system->workers[i].n_switches;
+	return n_switches;
+}
+
+void fibers_system_trace_start(FibersSystem *fibers_system)
+{
+#if FIBERS_SYSTEM_TRACE
+	for (unsigned i = 0; i < sb_count(fibers_system->workers); ++i) {
+		FibersSystemWorker *worker = &fibers_system->workers[i];
+		if (!worker->trace_events)
+			worker->trace_events = allocator_realloc_tagged(fibers_system->allocator, NULL, sizeof(FibersSystemTraceEvent) * FIBERS_SYSTEM_TRACE_EVENTS, FIBERS_SYSTEM_CACHE_LINE, fibers_system_tag());
+		atomic_store_64(&worker->trace_head, 0);
+	}
+	fibers_system->trace_start_ticks = platform_ticks();
+	fibers_system->trace_start_ns = platform_time_ns();
+	atomic_store_32(&fibers_system->tracing, 1);
+#else
+	(void)fibers_system;
+#endif
+}
+
+void fibers_system_trace_stop(FibersSystem *fibers_system)
+{
+	atomic_store_32(&fibers_system->tracing, 0);
+	fibers_system->trace_stop_ticks = platform_ticks();
+	fibers_system->trace_stop_ns = platform_time_ns();
+}
+
+void fibers_system_trace_dump(FibersSystem *fibers_system, FILE *file)
+{
+	// Scale ticks by how many went by during the recording.
+	const uint64_t ticks = fibers_system->trace_stop_ticks - fibers_system->trace_start_ticks;
+	const uint64_t ns = fibers_system->trace_stop_ns - fibers_system->trace_start_ns;
+	const double us_per_tick = ticks ? (double)ns / (double)ticks / 1000.0 : 0.0;
+	const double stop_ts = (double)ticks * us_per_tick;
+
+	fprintf(file, "{\"traceEvents\":[\n");
+	int first = 1;
+	for (unsigned i = 0; i < sb_count(fibers_system->workers); ++i) {
+		FibersSystemWorker *worker = &fibers_system->workers[i];
+		fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"worker %u\"}}", first ? "" : ",\n", i, i);
+		first = 0;
+		if (!worker->trace_events)
+			continue;
+
+		// Only the last FIBERS_SYSTEM_TRACE_EVENTS are still in the ring. A job's slice is open from its begin, or the
+		// end of a wait, until the worker begins the next job, waits or switches away, so it includes the decrement
+		// of its counter and picking the next job.
+		const int64_t head = atomic_load_64(&worker->trace_head);
+		const int64_t tail = head > FIBERS_SYSTEM_TRACE_EVENTS ? head - FIBERS_SYSTEM_TRACE_EVENTS : 0;
+		int job_open = 0;
+		unsigned long long open_job = 0;
+		for (int64_t e = tail; e < head; ++e) {
+			const FibersSystemTraceEvent *event = &worker->trace_events[e & (FIBERS_SYSTEM_TRACE_EVENTS - 1)];
+			const double ts = (double)(int64_t)(event->ticks - fibers_system->trace_start_ticks) * us_per_tick;
+			const unsigned long long arg = (unsigned long long)event->arg;
+			const int closes_job = event->type == FIBERS_SYSTEM_TRACE_JOB_BEGIN || event->type == FIBERS_SYSTEM_TRACE_WAIT_BEGIN || event->type == FIBERS_SYSTEM_TRACE_SWITCH;
+			if (job_open && closes_job) {
+				fprintf(file, ",\n{\"name\":\"job %llx\",\"ph\":\"E\",\"ts\":%.3f,\"pid\":1,\"tid\":%u}", open_job, ts, i);
+				job_open = 0;
+			}
+			switch (event->type) {
+			case FIBERS_SYSTEM_TRACE_JOB_BEGIN:
+			case FIBERS_SYSTEM_TRACE_WAIT_END:
+				fprintf(file, ",\n{\"name\":\"job %llx\",\"ph\":\"B\",\"ts\":%.3f,\"pid\":1,\"tid\":%u,\"args\":{\"jobs\":%u}}", arg, ts, i, event->n_jobs);
+				job_open = 1;
+				open_job = arg;
+				break;
+			case FIBERS_SYSTEM_TRACE_WAIT_BEGIN:
+				// The job's slice is closed while it waits and reopened on whichever worker resumes it.
+				fprintf(file, ",\n{\"name\":\"wait\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":1,\"tid\":%u}", ts, i);
+				break;
+			case FIBERS_SYSTEM_TRACE_SWITCH:
+				fprintf(file, ",\n{\"name\":\"switch\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":1,\"tid\":%u,\"args\":{\"fiber\":%lld}}", ts, i, (long long)(int32_t)event->arg);
+				break;
+			case FIBERS_SYSTEM_TRACE_STEAL:
+				fprintf(file, ",\n{\"name\":\"steal\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":1,\"tid\":%u,\"args\":{\"victim\":%llu}}", ts, i, arg);
+				break;
+			case FIBERS_SYSTEM_TRACE_IDLE_BEGIN:
+				fprintf(file, ",\n{\"name\":\"idle\",\"ph\":\"B\",\"ts\":%.3f,\"pid\":1,\"tid\":%u}", ts, i);
+				break;
+			case FIBERS_SYSTEM_TRACE_IDLE_END:
+				fprintf(file, ",\n{\"name\":\"idle\",\"ph\":\"E\",\"ts\":%.3f,\"pid\":1,\"tid\":%u}", ts, i);
+				break;
+			default:
+				break;
+			}
+		}
+		if (job_open)
+			fprintf(file, ",\n{\"name\":\"job %llx\",\"ph\":\"E\",\"ts\":%.3f,\"pid\":1,\"tid\":%u}", open_job, stop_ts, i);
+	}
+	fprintf(file, "\n]}\n");
+}
+
+unsigned fibers_system_stack_high_water(FibersSystem *fibers_system, unsigned stack_class)
+{
+	assert(stack_class < FIBERS_SYSTEM_N_STACK_CLASSES);
+	FibersSystemFiberPool *pool = &fibers_system->fiber_pools[stack_class];
+
+	unsigned high_water = 0;
+	platform_spin_lock_acquire(&fibers_system->lock);
+	for (unsigned i = 0; i < sb_count(pool->fibers); ++i) {
+		const unsigned used = platform_fiber_stack_high_water(pool->fibers[i]->fiber);
+		high_water = used > high_water ? used : high_water;
+	}
+	platform_spin_lock_release(&fibers_system->lock);
+	return high_water;
+}
+
+static FibersSystemJobCounter *fibers_system_counter_slot(FibersSystem *fibers_system, unsigned index)
+{
+	FibersSystemJobCounter *chunk = atomic_load_ptr((void *volatile *)&fibers_system->counter_chunks[index / FIBERS_SYSTEM_COUNTER_CHUNK_SIZE]);
+	assert(chunk);
+	return &chunk[index % FIBERS_SYSTEM_COUNTER_CHUNK_SIZE];
+}
+
+// Called with the lock held. Grows the pool by a chunk when all counters are in use.
+FibersSystemJobCounter *allocate_job_counter(FibersSystem *fibers_system)
+{
+	if (!sb_count(fibers_system->free_job_counters)) {
+		const unsigned chunk_index = fibers_system->n_counter_chunks;
+		assert(chunk_index < FIBERS_SYSTEM_MAX_COUNTER_CHUNKS);
+		FibersSystemJobCounter *chunk = allocator_realloc_tagged(fibers_system->allocator, NULL, sizeof(FibersSystemJobCounter) * FIBERS_SYSTEM_COUNTER_CHUNK_SIZE, FIBERS_SYSTEM_CACHE_LINE, fibers_system_tag());
+		for (unsigned i = 0; i < FIBERS_SYSTEM_COUNTER_CHUNK_SIZE; ++i) {
+			FibersSystemJobCounter *counter = &chunk[i];
+			counter->counter = 0;
+			counter->generation = 1;
+			counter->entry = chunk_index * FIBERS_SYSTEM_COUNTER_CHUNK_SIZE + i;
+			counter->persistent = 0;
+			counter->lock = 0;
+			counter->waiters = NULL;
+			counter->continuations = NULL;
+			counter->n_continuations = 0;
+			counter->release_after_continuations = 0;
+		}
+		atomic_store_ptr((void *volatile *)&fibers_system->counter_chunks[chunk_index], chunk);
+		fibers_system->n_counter_chunks = chunk_index + 1;
+
+		for (unsigned i = FIBERS_SYSTEM_COUNTER_CHUNK_SIZE; i > 0; --i)
+			sb_push(fibers_system->free_job_counters, chunk_index * FIBERS_SYSTEM_COUNTER_CHUNK_SIZE + i - 1);
+	}
+
 	unsigned free_counter = sb_last(fibers_system->free_job_counters);
 	sb_pop(fibers_system->free_job_counters);
-	return &fibers_system->job_counters[free_counter];
+	return fibers_system_counter_slot(fibers_system, free_counter);
 }
 
-void free_job_counter(FibersSystem *fibers_system, FibersSystemCounter *counter)
+// Called with the lock held.
+void free_job_counter(FibersSystem *fibers_system, FibersSystemJobCounter *counter)
 {
-	assert(sb_count(fibers_system->free_job_counters) < sb_count(fibers_system->job_counters));
+	assert(sb_count(fibers_system->free_job_counters) < fibers_system->n_counter_chunks * FIBERS_SYSTEM_COUNTER_CHUNK_SIZE);
 	unsigned free_counter = counter->entry;
 	sb_push(fibers_system->free_job_counters, free_counter);
 }
 
-void fibers_system_run_jobs(FibersSystem *fibers_system, FibersSystemJobDecl *job_declarations, unsigned n_job_declarations, FibersSystemCounter **job_counter)
+static FibersSystemCounter fibers_system_counter_handle(FibersSystemJobCounter *counter)
 {
-	assert(sb_count(fibers_system->free_fibers) >= n_job_declarations);
+	FibersSystemCounter handle = { .index = counter->entry, .generation = (unsigned)counter->generation };
+	return handle;
+}
 
-	*job_counter = allocate_job_counter(fibers_system);
-	(*job_counter)->counter = n_job_declarations;
+// Bumps the generation so all handles to the counter go stale and puts it back in the pool. Only the first release
+// of a generation does anything, so fibers woken by the same counter can all try.
+static void fibers_system_release_counter(FibersSystem *fibers_system, FibersSystemJobCounter *counter, unsigned generation)
+{
+	platform_spin_lock_acquire(&counter->lock);
+	const int released = (unsigned)counter->generation == generation;
+	if (released) {
+		assert(!counter->waiters);
+		// A waiter may get here before the final decrement gets to the continuations, which then leaves them to us.
+		fibers_system_push_continuations(fibers_system, fibers_system_current_worker(), counter);
+		// 0 is left for handles that don't refer to any counter.
+		const unsigned next_generation = generation + 1 ? generation + 1 : 1;
+		atomic_store_32(&counter->generation, (int32_t)next_generation);
+	}
+	platform_spin_lock_release(&counter->lock);
+
+	if (released) {
+		platform_spin_lock_acquire(&fibers_system->lock);
+		free_job_counter(fibers_system, counter);
+		platform_spin_lock_release(&fibers_system->lock);
+	}
+}
+
+// Adds n_jobs to the persistent counter job_counter refers to, or allocates a new counter for them.
+static FibersSystemJobCounter *fibers_system_acquire_counter(FibersSystem *fibers_system, FibersSystemCounter *job_counter, unsigned n_jobs)
+{
+	if (job_counter->generation && job_counter->index < fibers_system->n_counter_chunks * FIBERS_SYSTEM_COUNTER_CHUNK_SIZE) {
+		FibersSystemJobCounter *counter = fibers_system_counter_slot(fibers_system, job_counter->index);
+		if (counter->persistent && (unsigned)atomic_load_32(&counter->generation) == job_counter->generation) {
+			atomic_add_32(&counter->counter, (int32_t)n_jobs);
+			return counter;
+		}
+	}
+
+	platform_spin_lock_acquire(&fibers_system->lock);
+	FibersSystemJobCounter *counter = allocate_job_counter(fibers_system);
+	platform_spin_lock_release(&fibers_system->lock);
+
+	counter->persistent = 0;
+	counter->counter = n_jobs;
+	*job_counter = fibers_system_counter_handle(counter);
+	return counter;
+}
+
+FibersSystemCounter fibers_system_counter_create(FibersSystem *fibers_system)
+{
+	platform_spin_lock_acquire(&fibers_system->lock);
+	FibersSystemJobCounter *counter = allocate_job_counter(fibers_system);
+	platform_spin_lock_release(&fibers_system->lock);
+
+	counter->persistent = 1;
+	counter->counter = 0;
+	return fibers_system_counter_handle(counter);
+}
 
+void fibers_system_counter_destroy(FibersSystem *fibers_system, FibersSystemCounter counter)
+{
+	FibersSystemJobCounter *job_counter = fibers_system_counter_slot(fibers_system, counter.index);
+	assert(job_counter->persistent && (unsigned)job_counter->generation == counter.generation);
+	assert(atomic_load_32(&job_counter->counter) == 0);
+	job_counter->persistent = 0;
+	fibers_system_release_counter(fibers_system, job_counter, counter.generation);
+}
+
+// Every job queued from a declaration is made here. A job without an entry would never decrement its counter.
+static FibersSystemJob fibers_system_make_job(FibersSystemJobCounter *counter, const FibersSystemJobDecl *declaration)
+{
+	assert(declaration->job_entry);
+	FibersSystemJob job = { .job_entry = declaration->job_entry, .counter = counter ? counter->entry : 0, .priority = (uint8_t)declaration->priority, .stack_class = (uint8_t)declaration->stack_class };
+	if (declaration->job_data_size) {
+		assert(declaration->job_data_size <= FIBERS_SYSTEM_JOB_INLINE_DATA_SIZE && declaration->job_data);
+		job.kind = FIBERS_SYSTEM_JOB_INLINE;
+		memcpy(job.data.inline_data, declaration->job_data, declaration->job_data_size);
+	} else {
+		job.kind = FIBERS_SYSTEM_JOB_POINTER;
+		job.data.job_data = declaration->job_data;
+	}
+	return job;
+}
+
+// Pushes jobs that have already been added to the counter and wakes workers for them.
+static void fibers_system_run_counted_jobs(FibersSystem *fibers_system, FibersSystemWorker *worker, FibersSystemJobCounter *counter, FibersSystemJobDecl *job_declarations, unsigned n_job_declarations)
+{
+	unsigned n_main_thread_jobs = 0;
 	for (unsigned i = 0; i < n_job_declarations; ++i) {
-		FibersSystemJob job = { *job_counter, job_declarations[i] };
-		sb_push(fibers_system->jobs, job);
+		FibersSystemJob job = fibers_system_make_job(counter, &job_declarations[i]);
+		fibers_system_push_job(fibers_system, worker, job);
+		n_main_thread_jobs += job.priority == FIBERS_SYSTEM_PRIORITY_MAIN_THREAD;
 	}
+
+	if (n_main_thread_jobs)
+		fibers_system_wake_worker(&fibers_system->workers[0]);
+	fibers_system_wake_workers(fibers_system, n_job_declarations - n_main_thread_jobs);
 }
 
-void fibers_system_wait_for_counter(FibersSystem *fibers_system, FibersSystemCounter *job_counter, unsigned value)
+void fibers_system_run_jobs(FibersSystem *fibers_system, FibersSystemJobDecl *job_declarations, unsigned n_job_declarations, FibersSystemCounter *job_counter)
 {
-	unsigned counter_value = InterlockedAdd(&job_counter->counter, 0);
-	if (value == counter_value) {
-		free_job_counter(fibers_system, job_counter);
+	FibersSystemWorker *worker = fibers_system_current_worker();
+	assert(worker && worker->fibers_system == fibers_system);
+
+	FibersSystemJobCounter *counter = fibers_system_acquire_counter(fibers_system, job_counter, n_job_declarations);
+	fibers_system_run_counted_jobs(fibers_system, worker, counter, job_declarations, n_job_declarations);
+}
+
+void fibers_system_parallel_for(FibersSystem *fibers_system, unsigned begin, unsigned end, FibersSystemRangeEntry body, void *data, unsigned grain, FibersSystemCounter *job_counter)
+{
+	FibersSystemWorker *worker = fibers_system_current_worker();
+	assert(worker && worker->fibers_system == fibers_system);
+
+	// One job for the whole range, it is split up as other workers come looking for work.
+	FibersSystemJobCounter *counter = fibers_system_acquire_counter(fibers_system, job_counter, begin < end ? 1 : 0);
+	if (begin >= end)
 		return;
+
+	FibersSystemJob job = { .counter = counter->entry, .kind = FIBERS_SYSTEM_JOB_RANGE, .priority = FIBERS_SYSTEM_PRIORITY_NORMAL };
+	job.data.range.body = body;
+	job.data.range.data = data;
+	job.data.range.begin = begin;
+	job.data.range.end = end;
+	job.data.range.grain = grain;
+	fibers_system_push_job(fibers_system, worker, job);
+	fibers_system_wake_workers(fibers_system, 1);
+}
+
+enum { FIBERS_SYSTEM_SCRATCH_BLOCK_SIZE = 64 * 1024 };
+
+static FiberStruct *fibers_system_scratch_fiber(FibersSystem *fibers_system)
+{
+	FibersSystemWorker *worker = fibers_system_current_worker();
+	assert(worker && worker->fibers_system == fibers_system);
+	(void)fibers_system;
+	FiberStruct *fiber = worker->current_fiber;
+	// Only job fibers reset their scratch, anything else would never get it back.
+	assert(fiber->current_job.kind != FIBERS_SYSTEM_JOB_NONE);
+	return fiber;
+}
+
+void *fibers_system_scratch_alloc(FibersSystem *fibers_system, unsigned size, unsigned alignment)
+{
+	FiberStruct *fiber = fibers_system_scratch_fiber(fibers_system);
+	alignment = alignment ? alignment : 16;
+	assert((alignment & (alignment - 1)) == 0 && alignment <= FIBERS_SYSTEM_CACHE_LINE);
+
+	while (fiber->scratch_block < sb_count(fiber->scratch_blocks)) {
+		FibersSystemScratchBlock *block = &fiber->scratch_blocks[fiber->scratch_block];
+		const unsigned offset = (fiber->scratch_offset + alignment - 1) & ~(alignment - 1);
+		if (offset <= block->size && size <= block->size - offset) {
+			fiber->scratch_offset = offset + size;
+			return block->memory + offset;
+		}
+		fiber->scratch_block++;
+		fiber->scratch_offset = 0;
 	}
 
-	FibersSystemWaitList wait_list_entry = { .fiber = GetCurrentFiber(), .counter = job_counter, .expected_value = value };
-	sb_push(fibers_system->wait_list, wait_list_entry);
+	// Out of blocks, add one big enough for the allocation.
+	if (!fiber->scratch_blocks)
+		sb_create(fibers_system->allocator, fiber->scratch_blocks, 4);
+	FibersSystemScratchBlock *block = sb_add(fiber->scratch_blocks, 1);
+	block->size = size > FIBERS_SYSTEM_SCRATCH_BLOCK_SIZE ? size : FIBERS_SYSTEM_SCRATCH_BLOCK_SIZE;
+	block->memory = allocator_realloc_tagged(fibers_system->allocator, NULL, block->size, FIBERS_SYSTEM_CACHE_LINE, fibers_system_tag());
+	fiber->scratch_block = sb_count(fiber->scratch_blocks) - 1;
+	fiber->scratch_offset = size;
+	return block->memory;
+}
+
+FibersSystemScratchMarker fibers_system_scratch_push(FibersSystem *fibers_system)
+{
+	FiberStruct *fiber = fibers_system_scratch_fiber(fibers_system);
+	FibersSystemScratchMarker marker = { .block = fiber->scratch_block, .offset = fiber->scratch_offset };
+	return marker;
+}
+
+void fibers_system_scratch_pop(FibersSystem *fibers_system, FibersSystemScratchMarker marker)
+{
+	FiberStruct *fiber = fibers_system_scratch_fiber(fibers_system);
+	assert(marker.block < fiber->scratch_block || (marker.block == fiber->scratch_block && marker.offset <= fiber->scratch_offset));
+	fiber->scratch_block = marker.block;
+	fiber->scratch_offset = marker.offset;
+}
+
+// Called on the I/O thread, or on the reading worker if the file couldn't be opened.
+static void fibers_system_async_read_done(void *param, unsigned bytes_read)
+{
+	FibersSystemAsyncRead *read = param;
+	FibersSystem *fibers_system = read->fibers_system;
+	if (read->bytes_read)
+		*read->bytes_read = bytes_read;
+
+	FibersSystemAsyncRead *head;
+	do {
+		head = atomic_load_ptr((void *volatile *)&fibers_system->completed_reads);
+		read->next = head;
+	} while (atomic_cas_ptr((void *volatile *)&fibers_system->completed_reads, head, read) != head);
+	fibers_system_wake_workers(fibers_system, 1);
+}
+
+void fibers_system_async_read(FibersSystem *fibers_system, const char *path, uint64_t offset, unsigned size, void *dst, unsigned *bytes_read, FibersSystemCounter *job_counter)
+{
+	FibersSystemWorker *worker = fibers_system_current_worker();
+	assert(worker && worker->fibers_system == fibers_system);
+	(void)worker;
+
+	platform_spin_lock_acquire(&fibers_system->lock);
+	if (!fibers_system->async_io)
+		atomic_store_ptr((void *volatile *)&fibers_system->async_io, platform_async_io_create(fibers_system_async_read_done));
+	FibersSystemAsyncRead *read = fibers_system->free_reads;
+	if (read)
+		fibers_system->free_reads = read->next;
+	else
+		read = allocator_realloc_tagged(fibers_system->allocator, NULL, sizeof(FibersSystemAsyncRead), 16, fibers_system_tag());
+	platform_spin_lock_release(&fibers_system->lock);
+
+	read->fibers_system = fibers_system;
+	read->counter = fibers_system_acquire_counter(fibers_system, job_counter, 1);
+	read->bytes_read = bytes_read;
+	read->next = NULL;
+	platform_async_read(fibers_system->async_io, path, offset, size, dst, read);
+}
+
+void fibers_system_wait_for_counter(FibersSystem *fibers_system, FibersSystemCounter job_counter, unsigned value)
+{
+	if (!job_counter.generation)
+		return;
+
+	// Counters are only released once a wait on them is over, so a stale handle has nothing left to wait for.
+	FibersSystemJobCounter *counter = fibers_system_counter_slot(fibers_system, job_counter.index);
+	if ((unsigned)atomic_load_32(&counter->generation) != job_counter.generation)
+		return;
 
-	fibers_system_do_work(fibers_system);
-	free_job_counter(fibers_system, job_counter);
-}
\ No newline at end of file
+	if (atomic_load_32(&counter->counter) > (int32_t)value) {
+		FibersSystemWorker *worker = fibers_system_current_worker();
+		assert(worker && worker->fibers_system == fibers_system);
+		FiberStruct *fiber = worker->current_fiber;
+		fiber->wait_counter = counter;
+		fiber->wait_generation = job_counter.generation;
+		fiber->wait_value = value;
+
+		FiberStruct *next = fibers_system_next_fiber(fibers_system, worker, NULL);
+		fibers_system_switch(worker, fiber, next ? next : worker->idle_fiber, FIBER_SWITCH_WAIT);
+	}
+
+	// Only release once all jobs are done, a wait for a value above 0 leaves jobs that still decrement the counter.
+	if (!counter->persistent && atomic_load_32(&counter->counter) == 0)
+		fibers_system_release_counter(fibers_system, counter, job_counter.generation);
+}
+
+void fibers_system_run_jobs_after(FibersSystem *fibers_system, FibersSystemCounter after, FibersSystemJobDecl *job_declarations, unsigned n_job_declarations, FibersSystemCounter *job_counter)
+{
+	FibersSystemWorker *worker = fibers_system_current_worker();
+	assert(worker && worker->fibers_system == fibers_system);
+
+	FibersSystemJobCounter *counter = fibers_system_acquire_counter(fibers_system, job_counter, n_job_declarations);
+
+	FibersSystemJobCounter *after_counter = after.generation ? fibers_system_counter_slot(fibers_system, after.index) : NULL;
+	int push_now = 1;
+	int release = 0;
+	if (after_counter) {
+		platform_spin_lock_acquire(&after_counter->lock);
+		if ((unsigned)after_counter->generation == after.generation) {
+			if (!after_counter->continuations)
+				sb_create(fibers_system->allocator, after_counter->continuations, n_job_declarations > 4 ? n_job_declarations : 4);
+			for (unsigned i = 0; i < n_job_declarations; ++i) {
+				FibersSystemJob job = fibers_system_make_job(counter, &job_declarations[i]);
+				sb_push(after_counter->continuations, job);
+			}
+			after_counter->release_after_continuations |= !after_counter->persistent;
+			atomic_add_32(&after_counter->n_continuations, (int32_t)n_job_declarations);
+			push_now = 0;
+
+			// Publish the continuations before reading the counter, pairs with the final decrement reading
+			// n_continuations after writing the counter. If it got to 0 first it's up to us to push them.
+			atomic_fence();
+			if (atomic_load_32(&after_counter->counter) == 0)
+				release = fibers_system_push_continuations(fibers_system, worker, after_counter);
+		}
+		platform_spin_lock_release(&after_counter->lock);
+	}
+
+	if (release)
+		fibers_system_release_counter(fibers_system, after_counter, after.generation);
+	if (push_now)
+		fibers_system_run_counted_jobs(fibers_system, worker, counter, job_declarations, n_job_declarations);
+}
+
+typedef struct FibersSystemTaskGraphNode
+{
+	// Not pushed itself, graph node jobs refer to it. Keeps a copy of inline job data for every run of the graph.
+	FibersSystemJob job;
+	unsigned *successors;
+	unsigned n_dependencies;
+	// Inputs that have not finished yet in the current run.
+	volatile int32_t pending;
+	uint64_t start_ns;
+	uint64_t end_ns;
+	// Position in the order nodes finished in. Inputs always finish before the nodes depending on them.
+	unsigned finish_index;
+} FibersSystemTaskGraphNode;
+
+struct FibersSystemTaskGraph
+{
+	Allocator *allocator;
+	FibersSystemTaskGraphNode *nodes;
+	// Nodes without inputs, pushed by fibers_system_task_graph_run.
+	unsigned *roots;
+	int roots_dirty;
+	volatile int32_t n_finished;
+};
+
+FibersSystemTaskGraph *fibers_system_task_graph_create(Allocator *allocator)
+{
+	FibersSystemTaskGraph *graph = allocator_realloc_tagged(allocator, NULL, sizeof(FibersSystemTaskGraph), 16, fibers_system_tag());
+	graph->allocator = allocator;
+	sb_create(allocator, graph->nodes, 16);
+	sb_create(allocator, graph->roots, 16);
+	graph->roots_dirty = 0;
+	graph->n_finished = 0;
+	return graph;
+}
+
+void fibers_system_task_graph_destroy(Allocator *allocator, FibersSystemTaskGraph *graph)
+{
+	for (unsigned i = 0; i < sb_count(graph->nodes); ++i)
+		sb_free(graph->nodes[i].successors);
+	sb_free(graph->nodes);
+	sb_free(graph->roots);
+	allocator_realloc(allocator, graph, 0, 0);
+}
+
+unsigned fibers_system_task_graph_add_node(FibersSystemTaskGraph *graph, FibersSystemJobDecl declaration)
+{
+	assert(declaration.job_entry);
+	FibersSystemTaskGraphNode *node = sb_add(graph->nodes, 1);
+	node->job = fibers_system_make_job(NULL, &declaration);
+	sb_create(graph->allocator, node->successors, 4);
+	node->n_dependencies = 0;
+	node->pending = 0;
+	node->start_ns = 0;
+	node->end_ns = 0;
+	node->finish_index = 0;
+	graph->roots_dirty = 1;
+	return sb_count(graph->nodes) - 1;
+}
+
+void fibers_system_task_graph_add_edge(FibersSystemTaskGraph *graph, unsigned before, unsigned after)
+{
+	assert(before < sb_count(graph->nodes) && after < sb_count(graph->nodes) && before != after);
+	sb_push(graph->nodes[before].successors, after);
+	graph->nodes[after].n_dependencies++;
+	graph->roots_dirty = 1;
+}
+
+static FibersSystemJob fibers_system_task_graph_job(FibersSystemTaskGraph *graph, FibersSystemJobCounter *counter, unsigned node)
+{
+	const FibersSystemJob *node_job = &graph->nodes[node].job;
+	FibersSystemJob job = { .job_entry = node_job->job_entry, .counter = counter->entry, .kind = FIBERS_SYSTEM_JOB_GRAPH_NODE, .priority = node_job->priority, .stack_class = node_job->stack_class };
+	job.data.graph.graph = graph;
+	job.data.graph.node = node;
+	return job;
+}
+
+static FibersSystemJob *fibers_system_task_graph_node_job(FibersSystemJob *job)
+{
+	return &job->data.graph.graph->nodes[job->data.graph.node].job;
+}
+
+void fibers_system_task_graph_run(FibersSystem *fibers_system, FibersSystemTaskGraph *graph, FibersSystemCounter *job_counter)
+{
+	FibersSystemWorker *worker = fibers_system_current_worker();
+	assert(worker && worker->fibers_system == fibers_system);
+
+	const unsigned n_nodes = sb_count(graph->nodes);
+	if (graph->roots_dirty) {
+		while (sb_count(graph->roots))
+			sb_pop(graph->roots);
+		for (unsigned i = 0; i < n_nodes; ++i) {
+			if (!graph->nodes[i].n_dependencies)
+				sb_push(graph->roots, i);
+		}
+		graph->roots_dirty = 0;
+	}
+
+	for (unsigned i = 0; i < n_nodes; ++i) {
+		FibersSystemTaskGraphNode *node = &graph->nodes[i];
+		assert(atomic_load_32(&node->pending) <= 0);
+		atomic_store_32(&node->pending, (int32_t)node->n_dependencies);
+	}
+	atomic_store_32(&graph->n_finished, 0);
+
+	FibersSystemJobCounter *counter = fibers_system_acquire_counter(fibers_system, job_counter, n_nodes);
+
+	unsigned n_main_thread_jobs = 0;
+	for (unsigned i = 0; i < sb_count(graph->roots); ++i) {
+		FibersSystemJob job = fibers_system_task_graph_job(graph, counter, graph->roots[i]);
+		fibers_system_push_job(fibers_system, worker, job);
+		n_main_thread_jobs += job.priority == FIBERS_SYSTEM_PRIORITY_MAIN_THREAD;
+	}
+
+	if (n_main_thread_jobs)
+		fibers_system_wake_worker(&fibers_system->workers[0]);
+	fibers_system_wake_workers(fibers_system, sb_count(graph->roots) - n_main_thread_jobs);
+}
+
+// Pushes the successors this node was the last input of. Runs before the node's decrement, so the counter can't
+// reach 0 while successors are still to be pushed.
+static void fibers_system_task_graph_node_done(FibersSystem *fibers_system, FibersSystemWorker *worker, FibersSystemJob *job, uint64_t start_ns)
+{
+	FibersSystemTaskGraph *graph = job->data.graph.graph;
+	FibersSystemTaskGraphNode *node = &graph->nodes[job->data.graph.node];
+	node->start_ns = start_ns;
+	node->end_ns = platform_time_ns();
+	node->finish_index = (unsigned)atomic_add_32(&graph->n_finished, 1) - 1;
+
+	unsigned n_main_thread_jobs = 0;
+	unsigned n_jobs = 0;
+	for (unsigned i = 0; i < sb_count(node->successors); ++i) {
+		const unsigned successor = node->successors[i];
+		if (atomic_add_32(&graph->nodes[successor].pending, -1) != 0)
+			continue;
+
+		FibersSystemJob successor_job = fibers_system_task_graph_job(graph, fibers_system_counter_slot(fibers_system, job->counter), successor);
+		fibers_system_push_job(fibers_system, worker, successor_job);
+		n_main_thread_jobs += successor_job.priority == FIBERS_SYSTEM_PRIORITY_MAIN_THREAD;
+		++n_jobs;
+	}
+
+	if (n_main_thread_jobs)
+		fibers_system_wake_worker(&fibers_system->workers[0]);
+	if (n_jobs > n_main_thread_jobs)
+		fibers_system_wake_workers(fibers_system, n_jobs - n_main_thread_jobs);
+}
+
+void fibers_system_task_graph_report(FibersSystem *fibers_system, FibersSystemTaskGraph *graph, FibersSystemTaskGraphReport *report)
+{
+	const unsigned n_nodes = sb_count(graph->nodes);
+	report->span_ns = 0;
+	report->work_ns = 0;
+	report->critical_path_ns = 0;
+	report->idle_ns = 0;
+	report->n_critical_path = 0;
+	if (!n_nodes)
+		return;
+
+	// Going through the nodes in the order they finished visits all inputs of a node before the node itself.
+	typedef struct PathEntry { uint64_t path_ns; unsigned node; unsigned predecessor; } PathEntry;
+	PathEntry *entries = allocator_realloc_tagged(graph->allocator, NULL, sizeof(PathEntry) * n_nodes, 16, fibers_system_tag());
+
+	uint64_t first_start_ns = graph->nodes[0].start_ns;
+	uint64_t last_end_ns = graph->nodes[0].end_ns;
+	for (unsigned i = 0; i < n_nodes; ++i) {
+		FibersSystemTaskGraphNode *node = &graph->nodes[i];
+		first_start_ns = node->start_ns < first_start_ns ? node->start_ns : first_start_ns;
+		last_end_ns = node->end_ns > last_end_ns ? node->end_ns : last_end_ns;
+		report->work_ns += node->end_ns - node->start_ns;
+
+		assert(node->finish_index < n_nodes);
+		entries[node->finish_index] = (PathEntry){ .path_ns = 0, .node = i, .predecessor = 0xffffffffu };
+	}
+
+	// path_ns is the longest path ending in the inputs of a node until the node's own run time is added.
+	unsigned last = 0;
+	for (unsigned i = 0; i < n_nodes; ++i) {
+		PathEntry *entry = &entries[i];
+		FibersSystemTaskGraphNode *node = &graph->nodes[entry->node];
+		entry->path_ns += node->end_ns - node->start_ns;
+		if (entry->path_ns > entries[last].path_ns)
+			last = i;
+
+		for (unsigned s = 0; s < sb_count(node->successors); ++s) {
+			PathEntry *successor = &entries[graph->nodes[node->successors[s]].finish_index];
+			if (successor->predecessor == 0xffffffffu || entry->path_ns > successor->path_ns) {
+				successor->path_ns = entry->path_ns;
+				successor->predecessor = i;
+			}
+		}
+	}
+
+	report->span_ns = last_end_ns - first_start_ns;
+	report->critical_path_ns = entries[last].path_ns;
+	const uint64_t worker_ns = report->span_ns * sb_count(fibers_system->workers);
+	report->idle_ns = worker_ns > report->work_ns ? worker_ns - report->work_ns : 0;
+
+	// Walk back from the end of the critical path, then flip it around.
+	for (unsigned i = last; i != 0xffffffffu; i = entries[i].predecessor) {
+		if (report->n_critical_path < report->max_critical_path)
+			report->critical_path[report->n_critical_path] = entries[i].node;
+		report->n_critical_path++;
+	}
+	const unsigned n_written = report->n_critical_path < report->max_critical_path ? report->n_critical_path : report->max_critical_path;
+	for (unsigned i = 0; i < n_written / 2; ++i) {
+		const unsigned node = report->critical_path[i];
+		report->critical_path[i] = report->critical_path[n_written - 1 - i];
+		report->critical_path[n_written - 1 - i] = node;
+	}
+
+	allocator_realloc(graph->allocator, entries, 0, 0);
+}
+
+// Parks the calling fiber on the queue for as long as *address is expected. Like a futex the wait may end without
+// the word changing, so callers check their condition again.
+static void fibers_system_wait_on_address(FiberWaitQueue *queue, volatile int32_t *address, int32_t expected)
+{
+	FibersSystemWorker *worker = fibers_system_current_worker();
+	assert(worker);
+	FiberStruct *fiber = worker->current_fiber;
+	fiber->wait_queue = queue;
+	fiber->wait_address = address;
+	fiber->wait_expected = expected;
+
+	FiberStruct *next = fibers_system_next_fiber(worker->fibers_system, worker, NULL);
+	fibers_system_switch(worker, fiber, next ? next : worker->idle_fiber, FIBER_SWITCH_WAIT_QUEUE);
+}
+
+static void fiber_wait_queue_init(FiberWaitQueue *queue)
+{
+	queue->lock = 0;
+	queue->head = NULL;
+	queue->tail = NULL;
+}
+
+void fiber_mutex_init(FiberMutex *mutex)
+{
+	mutex->state = 0;
+	fiber_wait_queue_init(&mutex->waiters);
+}
+
+void fiber_mutex_lock(FiberMutex *mutex)
+{
+	if (atomic_cas_32(&mutex->state, 0, 1) == 0)
+		return;
+
+	// Whoever gets the lock from here on leaves it marked as contended, since others may still be parked.
+	while (atomic_exchange_32(&mutex->state, 2) != 0)
+		fibers_system_wait_on_address(&mutex->waiters, &mutex->state, 2);
+}
+
+int fiber_mutex_try_lock(FiberMutex *mutex)
+{
+	return atomic_cas_32(&mutex->state, 0, 1) == 0;
+}
+
+void fiber_mutex_unlock(FiberMutex *mutex)
+{
+	if (atomic_exchange_32(&mutex->state, 0) == 2)
+		fibers_system_wake_queue(&mutex->waiters, 1);
+}
+
+void fiber_semaphore_init(FiberSemaphore *semaphore, unsigned count)
+{
+	semaphore->count = (int32_t)count;
+	semaphore->wakeups = 0;
+	fiber_wait_queue_init(&semaphore->waiters);
+}
+
+void fiber_semaphore_wait(FiberSemaphore *semaphore)
+{
+	if (atomic_add_32(&semaphore->count, -1) >= 0)
+		return;
+
+	// A signal is owed to us now, wait until one is handed out.
+	while (1) {
+		const int32_t wakeups = atomic_load_32(&semaphore->wakeups);
+		if (wakeups > 0) {
+			if (atomic_cas_32(&semaphore->wakeups, wakeups, wakeups - 1) == wakeups)
+				return;
+			continue;
+		}
+		fibers_system_wait_on_address(&semaphore->waiters, &semaphore->wakeups, wakeups);
+	}
+}
+
+void fiber_semaphore_signal(FiberSemaphore *semaphore, unsigned count)
+{
+	const int32_t previous = atomic_add_32(&semaphore->count, (int32_t)count) - (int32_t)count;
+	if (previous >= 0)
+		return;
+
+	const unsigned n_waiting = (unsigned)-previous;
+	const unsigned n_wakeups = n_waiting < count ? n_waiting : count;
+	atomic_add_32(&semaphore->wakeups, (int32_t)n_wakeups);
+	fibers_system_wake_queue(&semaphore->waiters, n_wakeups);
+}
+
+void fiber_event_init(FiberEvent *event)
+{
+	event->set = 0;
+	fiber_wait_queue_init(&event->waiters);
+}
+
+void fiber_event_wait(FiberEvent *event)
+{
+	while (!atomic_load_32(&event->set))
+		fibers_system_wait_on_address(&event->waiters, &event->set, 0);
+}
+
+void fiber_event_set(FiberEvent *event)
+{
+	if (atomic_exchange_32(&event->set, 1) == 0)
+		fibers_system_wake_queue(&event->waiters, 0xffffffffu);
+}
+
+void fiber_event_reset(FiberEvent *event)
+{
+	atomic_store_32(&event->set, 0);
+}
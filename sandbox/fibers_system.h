@@ -1,19 +1,191 @@
 #pragma once
 
+#include <stdint.h>
+#include <stdio.h>
+
+// Define FIBERS_SYSTEM_TRACE to 0 to compile the tracing out.
+#if !defined(FIBERS_SYSTEM_TRACE)
+#define FIBERS_SYSTEM_TRACE 1
+#endif
+// Define FIBERS_SYSTEM_SHARED_QUEUE to 1 to queue jobs on one locked LIFO queue per priority that every worker pushes
+// to and takes from, instead of the per-worker work-stealing deques. For measuring what the deques buy.
+#if !defined(FIBERS_SYSTEM_SHARED_QUEUE)
+#define FIBERS_SYSTEM_SHARED_QUEUE 0
+#endif
+
 typedef struct FibersSystem FibersSystem;
 typedef struct Allocator Allocator;
 
-FibersSystem *fibers_system_create(Allocator *allocator, unsigned n_fibers);
+// Jobs run on fibers from the pool of their stack class. Small stacks keep hundreds of fibers cheap, jobs that recurse
+// deep or keep big arrays on the stack ask for a large one.
+enum FibersSystemStackClass { FIBERS_SYSTEM_STACK_SMALL = 0, FIBERS_SYSTEM_STACK_LARGE, FIBERS_SYSTEM_N_STACK_CLASSES };
+
+// n_fibers are created up front and the pool grows up to max_fibers when jobs are waiting for a fiber to run on.
+typedef struct FibersSystemStackPool
+{
+	unsigned stack_size;
+	unsigned n_fibers;
+	unsigned max_fibers;
+} FibersSystemStackPool;
+
+// One pool per stack class. n_workers is the number of threads running jobs, including the calling thread. 0 gives one
+// worker per hardware core.
+FibersSystem *fibers_system_create(Allocator *allocator, const FibersSystemStackPool stack_pools[FIBERS_SYSTEM_N_STACK_CLASSES], unsigned n_workers);
 void fibers_system_destroy(Allocator *allocator, FibersSystem *fibers_system);
+unsigned fibers_system_worker_count(FibersSystem *fibers_system);
+// Deepest stack use seen on any fiber of the pool, for sizing the pools from real runs.
+unsigned fibers_system_stack_high_water(FibersSystem *fibers_system, unsigned stack_class);
+
+// Workers take high priority jobs before normal ones and normal before low. Main thread jobs are only run by the
+// thread that created the fibers system, ahead of any other queued job, for work that has to stay on that thread.
+enum FibersSystemPriority { FIBERS_SYSTEM_PRIORITY_NORMAL = 0, FIBERS_SYSTEM_PRIORITY_HIGH, FIBERS_SYSTEM_PRIORITY_LOW, FIBERS_SYSTEM_PRIORITY_MAIN_THREAD };
+
+enum { FIBERS_SYSTEM_JOB_INLINE_DATA_SIZE = 48 };
 
 typedef void (*FibersSystemJobEntry)(void *data);
 typedef struct FibersSystemJobDecl
 {
+	// Must be set. job_data may be NULL, the entry is called with it all the same.
 	FibersSystemJobEntry job_entry;
 	void *job_data;
+	unsigned priority;
+	// A job is run on a fiber of at least this stack class, it only takes a larger one when its own pool is used up.
+	unsigned stack_class;
+	// If set, job_data is copied into the job when it is pushed and job_entry gets the copy, so the data doesn't have
+	// to outlive the call. At most FIBERS_SYSTEM_JOB_INLINE_DATA_SIZE bytes.
+	unsigned job_data_size;
 } FibersSystemJobDecl;
 
-typedef struct FibersSystemCounter FibersSystemCounter;
+// Handle to a job counter, zero initialised means no counter. The generation changes when the counter is released,
+// so waiting on a handle to a released counter returns straight away instead of reading whatever reuses the slot.
+typedef struct FibersSystemCounter
+{
+	unsigned index;
+	unsigned generation;
+} FibersSystemCounter;
+
+// Persistent counters are only released by fibers_system_counter_destroy and can be reused frame after frame.
+FibersSystemCounter fibers_system_counter_create(FibersSystem *fibers_system);
+void fibers_system_counter_destroy(FibersSystem *fibers_system, FibersSystemCounter counter);
+
+// If job_counter is a persistent counter the jobs are added to it. Otherwise a new counter is written to it, which
+// is released by the first wait that finds it done.
+void fibers_system_run_jobs(FibersSystem *fibers_system, FibersSystemJobDecl *job_declarations, unsigned n_job_declarations, FibersSystemCounter *job_counter);
+// Runs body over [begin, end) in batches of at least grain items, grain 0 picks a batch size from the measured cost
+// of the first items. A batch is only split in two when the worker running it has nothing else queued, so idle
+// workers can steal the other half. The counter reaches 0 once the whole range is done.
+typedef void (*FibersSystemRangeEntry)(void *data, unsigned begin, unsigned end);
+void fibers_system_parallel_for(FibersSystem *fibers_system, unsigned begin, unsigned end, FibersSystemRangeEntry body, void *data, unsigned grain, FibersSystemCounter *job_counter);
+
+void fibers_system_wait_for_counter(FibersSystem *fibers_system, FibersSystemCounter job_counter, unsigned value);
+// Runs the jobs once the counter after reaches 0, pushed by whichever job takes it there instead of by a waiting fiber.
+// If after is already done they are pushed straight away. Attaching to a counter that isn't persistent counts as the
+// wait on it, it is released once the jobs are pushed. job_counter works as for run_jobs.
+void fibers_system_run_jobs_after(FibersSystem *fibers_system, FibersSystemCounter after, FibersSystemJobDecl *job_declarations, unsigned n_job_declarations, FibersSystemCounter *job_counter);
+
+// Reads size bytes at offset from the file at path into dst without blocking the worker. The read is counted in
+// job_counter like a job, so waiting on the counter parks the fiber until the data is there while the worker runs other
+// jobs. bytes_read, if set, is written before the counter goes down: short at the end of the file, 0 if it couldn't
+// be opened.
+void fibers_system_async_read(FibersSystem *fibers_system, const char *path, uint64_t offset, unsigned size, void *dst, unsigned *bytes_read, FibersSystemCounter *job_counter);
+
+// Temporary memory for the running job from a bump allocator owned by its fiber. Everything the job allocates is freed
+// when it returns, markers free everything allocated since the push earlier than that. Only valid inside a job.
+typedef struct FibersSystemScratchMarker
+{
+	unsigned block;
+	unsigned offset;
+} FibersSystemScratchMarker;
+
+void *fibers_system_scratch_alloc(FibersSystem *fibers_system, unsigned size, unsigned alignment);
+FibersSystemScratchMarker fibers_system_scratch_push(FibersSystem *fibers_system);
+void fibers_system_scratch_pop(FibersSystem *fibers_system, FibersSystemScratchMarker marker);
+
+// Number of fiber switches so far, summed over all workers.
+uint64_t fibers_system_switch_count(FibersSystem *fibers_system);
+
+// Records job begin and end, fiber switches, waits, steals and idle periods per worker between start and stop. Each
+// worker keeps the most recent events in a ring buffer. Dump once stopped, as Chrome trace JSON for chrome://tracing
+// or Perfetto. A job's slice ends when its worker moves on, so it includes finishing the job and picking the next, and
+// back to back runs of the same job on a worker are one slice counting them.
+void fibers_system_trace_start(FibersSystem *fibers_system);
+void fibers_system_trace_stop(FibersSystem *fibers_system);
+void fibers_system_trace_dump(FibersSystem *fibers_system, FILE *file);
+
+// A graph of jobs where an edge makes a node wait for another one to finish. A node is pushed by whichever job
+// finishes its last input, so no fiber waits on the way. Built once and then run again every frame without
+// allocating, a graph must have finished before it is run again.
+typedef struct FibersSystemTaskGraph FibersSystemTaskGraph;
+FibersSystemTaskGraph *fibers_system_task_graph_create(Allocator *allocator);
+void fibers_system_task_graph_destroy(Allocator *allocator, FibersSystemTaskGraph *graph);
+// Returns the index of the node.
+unsigned fibers_system_task_graph_add_node(FibersSystemTaskGraph *graph, FibersSystemJobDecl declaration);
+// Node after runs once node before has finished. Edges must not form cycles.
+void fibers_system_task_graph_add_edge(FibersSystemTaskGraph *graph, unsigned before, unsigned after);
+// Like run_jobs, the counter reaches 0 once all nodes have finished.
+void fibers_system_task_graph_run(FibersSystem *fibers_system, FibersSystemTaskGraph *graph, FibersSystemCounter *job_counter);
+
+// Timings of the last run. Set critical_path and max_critical_path to get the nodes on the critical path, first to last.
+typedef struct FibersSystemTaskGraphReport
+{
+	// From the start of the first node to the end of the last one.
+	uint64_t span_ns;
+	// Sum of the run times of all nodes.
+	uint64_t work_ns;
+	// Run time of the longest chain of dependent nodes, the span can't get shorter than this.
+	uint64_t critical_path_ns;
+	// Worker time within the span not spent on the graph.
+	uint64_t idle_ns;
+	unsigned *critical_path;
+	unsigned max_critical_path;
+	unsigned n_critical_path;
+} FibersSystemTaskGraphReport;
+
+void fibers_system_task_graph_report(FibersSystem *fibers_system, FibersSystemTaskGraph *graph, FibersSystemTaskGraphReport *report);
+
+// Synchronisation between jobs. A contended wait parks the calling fiber on the primitive and the worker goes on with
+// other jobs, the uncontended paths are a single atomic. They can be used from any fiber of a fibers system and from
+// the thread that created it.
+typedef struct FiberWaitQueue
+{
+	volatile int32_t lock;
+	void *volatile head;
+	void *tail;
+} FiberWaitQueue;
+
+typedef struct FiberMutex
+{
+	// 0 unlocked, 1 locked, 2 locked and fibers may be waiting.
+	volatile int32_t state;
+	FiberWaitQueue waiters;
+} FiberMutex;
+
+void fiber_mutex_init(FiberMutex *mutex);
+void fiber_mutex_lock(FiberMutex *mutex);
+int fiber_mutex_try_lock(FiberMutex *mutex);
+void fiber_mutex_unlock(FiberMutex *mutex);
+
+typedef struct FiberSemaphore
+{
+	// Negative while fibers are waiting.
+	volatile int32_t count;
+	// Signals handed to waiting fibers that they have not picked up yet.
+	volatile int32_t wakeups;
+	FiberWaitQueue waiters;
+} FiberSemaphore;
+
+void fiber_semaphore_init(FiberSemaphore *semaphore, unsigned count);
+void fiber_semaphore_wait(FiberSemaphore *semaphore);
+void fiber_semaphore_signal(FiberSemaphore *semaphore, unsigned count);
+
+// Manual reset, stays set until fiber_event_reset.
+typedef struct FiberEvent
+{
+	volatile int32_t set;
+	FiberWaitQueue waiters;
+} FiberEvent;
 
-void fibers_system_run_jobs(FibersSystem *fibers_system, FibersSystemJobDecl *job_declarations, unsigned n_job_declarations, FibersSystemCounter **job_counter);
-void fibers_system_wait_for_counter(FibersSystem *fibers_system, FibersSystemCounter *job_counter, unsigned value);
\ No newline at end of file
+void fiber_event_init(FiberEvent *event);
+void fiber_event_wait(FiberEvent *event);
+void fiber_event_set(FiberEvent *event);
+void fiber_event_reset(FiberEvent *event);
\ No newline at end of file
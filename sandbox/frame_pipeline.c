@@ -0,0 +1,139 @@
+#include "frame_pipeline.h"
+
+#include <assert.h>
+
+#include "allocator.h"
+#include "fibers_system.h"
+#include "platform.h"
+
+typedef struct FramePipelineSlot
+{
+	FramePipeline *pipeline;
+	// Persistent, counts the simulation job of the frame in the slot.
+	FibersSystemCounter counter;
+	unsigned frame;
+	float dt;
+	uint64_t queued_ns;
+} FramePipelineSlot;
+
+struct FramePipeline
+{
+	FibersSystem *fibers_system;
+	FramePipelineDesc desc;
+	FramePipelineSlot *slots;
+
+	unsigned n_queued;
+	unsigned n_submitted;
+	uint64_t last_queued_ns;
+	uint64_t first_submitted_ns;
+	uint64_t last_submitted_ns;
+
+	uint64_t last_frame_ns;
+	uint64_t last_latency_ns;
+	uint64_t total_latency_ns;
+	uint64_t max_latency_ns;
+	uint64_t wait_ns;
+};
+
+FramePipeline *frame_pipeline_create(Allocator *allocator, FibersSystem *fibers_system, const FramePipelineDesc *desc)
+{
+	assert(desc->depth && desc->simulate && desc->submit);
+	FramePipeline *pipeline = allocator_realloc(allocator, NULL, sizeof(FramePipeline), 16);
+	pipeline->fibers_system = fibers_system;
+	pipeline->desc = *desc;
+	pipeline->slots = allocator_realloc(allocator, NULL, sizeof(FramePipelineSlot) * desc->depth, 16);
+	for (unsigned i = 0; i < desc->depth; ++i) {
+		FramePipelineSlot *slot = &pipeline->slots[i];
+		slot->pipeline = pipeline;
+		slot->counter = fibers_system_counter_create(fibers_system);
+		slot->frame = 0;
+		slot->dt = 0.0f;
+		slot->queued_ns = 0;
+	}
+	pipeline->n_queued = 0;
+	pipeline->n_submitted = 0;
+	pipeline->last_queued_ns = 0;
+	pipeline->first_submitted_ns = 0;
+	pipeline->last_submitted_ns = 0;
+	pipeline->last_frame_ns = 0;
+	pipeline->last_latency_ns = 0;
+	pipeline->total_latency_ns = 0;
+	pipeline->max_latency_ns = 0;
+	pipeline->wait_ns = 0;
+	return pipeline;
+}
+
+void frame_pipeline_destroy(Allocator *allocator, FramePipeline *pipeline)
+{
+	for (unsigned i = 0; i < pipeline->desc.depth; ++i) {
+		fibers_system_wait_for_counter(pipeline->fibers_system, pipeline->slots[i].counter, 0);
+		fibers_system_counter_destroy(pipeline->fibers_system, pipeline->slots[i].counter);
+	}
+	allocator_realloc(allocator, pipeline->slots, 0, 0);
+	allocator_realloc(allocator, pipeline, 0, 0);
+}
+
+static void frame_pipeline_simulate_job(void *data)
+{
+	FramePipelineSlot *slot = data;
+	FramePipeline *pipeline = slot->pipeline;
+	pipeline->desc.simulate(pipeline->desc.data, slot->frame, (unsigned)(slot - pipeline->slots), slot->dt);
+}
+
+// The slot is free, its last frame was submitted before the one queued depth frames later.
+static void frame_pipeline_queue(FramePipeline *pipeline)
+{
+	const unsigned depth = pipeline->desc.depth;
+	const unsigned frame = pipeline->n_queued++;
+	FramePipelineSlot *slot = &pipeline->slots[frame % depth];
+	const uint64_t now = platform_time_ns();
+	slot->frame = frame;
+	slot->dt = frame ? (float)(now - pipeline->last_queued_ns) * 1e-9f : 0.0f;
+	slot->queued_ns = now;
+	pipeline->last_queued_ns = now;
+
+	// Chained on the previous frame's counter, so the simulation steps run in order without anyone waiting for them.
+	// At depth 1 the previous frame was submitted, and so simulated, before this one is queued.
+	const FibersSystemCounter after = frame && depth > 1 ? pipeline->slots[(frame - 1) % depth].counter : (FibersSystemCounter){ 0 };
+	FibersSystemJobDecl declaration = { .job_entry = frame_pipeline_simulate_job, .job_data = slot };
+	fibers_system_run_jobs_after(pipeline->fibers_system, after, &declaration, 1, &slot->counter);
+}
+
+void frame_pipeline_frame(FramePipeline *pipeline)
+{
+	const unsigned depth = pipeline->desc.depth;
+	while (pipeline->n_queued < pipeline->n_submitted + depth)
+		frame_pipeline_queue(pipeline);
+
+	const unsigned frame = pipeline->n_submitted;
+	FramePipelineSlot *slot = &pipeline->slots[frame % depth];
+	const uint64_t wait_start_ns = platform_time_ns();
+	fibers_system_wait_for_counter(pipeline->fibers_system, slot->counter, 0);
+	pipeline->wait_ns += platform_time_ns() - wait_start_ns;
+
+	pipeline->desc.submit(pipeline->desc.data, frame, frame % depth);
+
+	const uint64_t now = platform_time_ns();
+	pipeline->last_latency_ns = now - slot->queued_ns;
+	pipeline->total_latency_ns += pipeline->last_latency_ns;
+	pipeline->max_latency_ns = pipeline->last_latency_ns > pipeline->max_latency_ns ? pipeline->last_latency_ns : pipeline->max_latency_ns;
+	if (frame)
+		pipeline->last_frame_ns = now - pipeline->last_submitted_ns;
+	else
+		pipeline->first_submitted_ns = now;
+	pipeline->last_submitted_ns = now;
+	pipeline->n_submitted++;
+}
+
+void frame_pipeline_stats(FramePipeline *pipeline, FramePipelineStats *stats)
+{
+	const unsigned n = pipeline->n_submitted;
+	stats->depth = pipeline->desc.depth;
+	stats->n_frames = n;
+	stats->last_frame_ns = pipeline->last_frame_ns;
+	stats->last_latency_ns = pipeline->last_latency_ns;
+	stats->average_frame_ns = n > 1 ? (pipeline->last_submitted_ns - pipeline->first_submitted_ns) / (n - 1) : 0;
+	stats->average_latency_ns = n ? pipeline->total_latency_ns / n : 0;
+	stats->max_latency_ns = pipeline->max_latency_ns;
+	stats->wait_ns = pipeline->wait_ns;
+}
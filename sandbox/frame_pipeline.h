@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+
+typedef struct Allocator Allocator;
+typedef struct FibersSystem FibersSystem;
+
+// Simulates later frames while the calling thread submits the current one. Simulation state lives in depth slots:
+// frame n is simulated into slot n % depth by a job that starts once frame n - 1 is simulated, and submitted from that
+// slot on the thread calling frame_pipeline_frame. Depth 1 is the serial loop, depth 2 simulates frame n + 1 while
+// frame n is submitted.
+typedef void (*FramePipelineSimulate)(void *data, unsigned frame, unsigned slot, float dt);
+typedef void (*FramePipelineSubmit)(void *data, unsigned frame, unsigned slot);
+
+typedef struct FramePipelineDesc
+{
+	unsigned depth;
+	// Runs as a job and may run jobs of its own. dt is the time between this frame and the previous one being queued.
+	FramePipelineSimulate simulate;
+	FramePipelineSubmit submit;
+	void *data;
+} FramePipelineDesc;
+
+typedef struct FramePipeline FramePipeline;
+
+FramePipeline *frame_pipeline_create(Allocator *allocator, FibersSystem *fibers_system, const FramePipelineDesc *desc);
+// Waits for the frames still being simulated.
+void frame_pipeline_destroy(Allocator *allocator, FramePipeline *pipeline);
+// Queues simulations until depth frames are in flight, waits for the oldest one and submits it.
+void frame_pipeline_frame(FramePipeline *pipeline);
+
+// Latency is from a frame's simulation being queued to its submission returning.
+typedef struct FramePipelineStats
+{
+	unsigned depth;
+	unsigned n_frames;
+	uint64_t last_frame_ns;
+	uint64_t last_latency_ns;
+	uint64_t average_frame_ns;
+	uint64_t average_latency_ns;
+	uint64_t max_latency_ns;
+	// Time the submitting thread spent waiting for simulations.
+	uint64_t wait_ns;
+} FramePipelineStats;
+
+void frame_pipeline_stats(FramePipeline *pipeline, FramePipelineStats *stats);
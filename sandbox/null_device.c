@@ -0,0 +1,69 @@
+#include "null_device.h"
+
+#include <string.h>
+
+#include "allocator.h"
+#include "platform.h"
+
+struct NullDevice
+{
+	Allocator *allocator;
+	void *buffer;
+	unsigned buffer_size;
+	unsigned render_ns;
+	uint64_t refresh_ns;
+	uint64_t first_refresh_ns;
+};
+
+void null_device_create(Allocator *allocator, unsigned render_ns, unsigned refresh_hz, NullDevice **null_device)
+{
+	NullDevice *device = allocator_realloc(allocator, NULL, sizeof(NullDevice), 16);
+	device->allocator = allocator;
+	device->buffer = NULL;
+	device->buffer_size = 0;
+	device->render_ns = render_ns;
+	device->refresh_ns = refresh_hz ? 1000000000ull / refresh_hz : 0;
+	device->first_refresh_ns = platform_time_ns();
+	*null_device = device;
+}
+
+void null_device_destroy(Allocator *allocator, NullDevice *null_device)
+{
+	if (null_device->buffer)
+		allocator_realloc(allocator, null_device->buffer, 0, 0);
+	allocator_realloc(allocator, null_device, 0, 0);
+}
+
+void null_device_upload(NullDevice *device, const void *data, unsigned size)
+{
+	if (size > device->buffer_size) {
+		device->buffer = allocator_realloc(device->allocator, device->buffer, size, 16);
+		device->buffer_size = size;
+	}
+	memcpy(device->buffer, data, size);
+}
+
+void null_device_clear(NullDevice *device)
+{
+	(void)device;
+}
+
+void null_device_render(NullDevice *device, unsigned n_instances)
+{
+	(void)n_instances;
+	const uint64_t start = platform_time_ns();
+	while (platform_time_ns() - start < device->render_ns)
+		cpu_pause();
+}
+
+void null_device_present(NullDevice *device)
+{
+	if (!device->refresh_ns)
+		return;
+
+	// Sleep to the next refresh boundary, a missed refresh waits for the one after.
+	const uint64_t now = platform_time_ns();
+	const uint64_t since_first = now - device->first_refresh_ns;
+	const uint64_t next = device->first_refresh_ns + (since_first / device->refresh_ns + 1) * device->refresh_ns;
+	platform_sleep_ns(next - now);
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+// Stands in for the D3D11 device where there is no window or GPU, so the frame loop can run headless. Rendering costs
+// a fixed amount of CPU time on the calling thread and presenting blocks until the next refresh, like vsync.
+typedef struct NullDevice NullDevice;
+typedef struct Allocator Allocator;
+
+// A refresh rate of 0 presents immediately.
+void null_device_create(Allocator *allocator, unsigned render_ns, unsigned refresh_hz, NullDevice **null_device);
+void null_device_destroy(Allocator *allocator, NullDevice *null_device);
+
+// Copies the data into a device owned buffer, like a raw buffer update.
+void null_device_upload(NullDevice *device, const void *data, unsigned size);
+void null_device_clear(NullDevice *device);
+void null_device_render(NullDevice *device, unsigned n_instances);
+void null_device_present(NullDevice *device);
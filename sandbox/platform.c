@@ -0,0 +1,993 @@
+#include "platform.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+static void (*volatile platform_thread_exit_callback)(void);
+
+void platform_thread_set_exit_callback(void (*callback)(void))
+{
+	platform_thread_exit_callback = callback;
+}
+
+static void platform_thread_exit(void)
+{
+	void (*callback)(void) = platform_thread_exit_callback;
+	if (callback)
+		callback();
+}
+
+#if defined(_WIN32)
+
+struct PlatformFiber
+{
+	LPVOID fiber;
+	PlatformFiberEntry entry;
+	void *param;
+	// Top of the stack, set once the fiber first runs.
+	char *volatile stack_base;
+};
+
+static void WINAPI platform_fiber_trampoline(LPVOID param)
+{
+	PlatformFiber *fiber = param;
+	fiber->stack_base = ((NT_TIB *)NtCurrentTeb())->StackBase;
+	fiber->entry(fiber->param);
+}
+
+PlatformFiber *platform_fiber_create(unsigned stack_size, PlatformFiberEntry entry, void *param)
+{
+	PlatformFiber *fiber = malloc(sizeof(PlatformFiber));
+	fiber->entry = entry;
+	fiber->param = param;
+	fiber->stack_base = NULL;
+	// Only reserve stack_size, pages are committed as the stack grows into the guard page the system keeps below it.
+	fiber->fiber = CreateFiberEx(0, stack_size, 0, platform_fiber_trampoline, fiber);
+	assert(fiber->fiber);
+	return fiber;
+}
+
+unsigned platform_fiber_stack_high_water(PlatformFiber *fiber)
+{
+	char *stack_base = fiber->stack_base;
+	if (!stack_base)
+		return 0;
+
+	// Committed pages are never given back, so the committed region at the top of the stack is as deep as it has been.
+	MEMORY_BASIC_INFORMATION info;
+	VirtualQuery(stack_base - 1, &info, sizeof(info));
+	return (unsigned)(stack_base - (char *)info.BaseAddress);
+}
+
+void platform_fiber_destroy(PlatformFiber *fiber)
+{
+	DeleteFiber(fiber->fiber);
+	free(fiber);
+}
+
+PlatformFiber *platform_fiber_convert_thread(void)
+{
+	PlatformFiber *fiber = malloc(sizeof(PlatformFiber));
+	fiber->entry = NULL;
+	fiber->param = NULL;
+	fiber->stack_base = NULL;
+	fiber->fiber = ConvertThreadToFiber(NULL);
+	assert(fiber->fiber);
+	return fiber;
+}
+
+void platform_fiber_convert_to_thread(PlatformFiber *thread_fiber)
+{
+	BOOL result = ConvertFiberToThread();
+	assert(result == TRUE);
+	(void)result;
+	free(thread_fiber);
+}
+
+void platform_fiber_switch(PlatformFiber *from, PlatformFiber *to)
+{
+	(void)from;
+	SwitchToFiber(to->fiber);
+}
+
+struct PlatformThread
+{
+	HANDLE thread;
+	PlatformThreadEntry entry;
+	void *param;
+};
+
+static DWORD WINAPI platform_thread_trampoline(LPVOID param)
+{
+	PlatformThread *thread = param;
+	thread->entry(thread->param);
+	platform_thread_exit();
+	return 0;
+}
+
+PlatformThread *platform_thread_create(PlatformThreadEntry entry, void *param)
+{
+	PlatformThread *thread = malloc(sizeof(PlatformThread));
+	thread->entry = entry;
+	thread->param = param;
+	thread->thread = CreateThread(NULL, 0, platform_thread_trampoline, thread, 0, NULL);
+	assert(thread->thread);
+	return thread;
+}
+
+void platform_thread_join(PlatformThread *thread)
+{
+	WaitForSingleObject(thread->thread, INFINITE);
+	CloseHandle(thread->thread);
+	free(thread);
+}
+
+void platform_thread_yield(void)
+{
+	SwitchToThread();
+}
+
+void platform_sleep_ns(uint64_t ns)
+{
+	Sleep((DWORD)(ns / 1000000));
+}
+
+#pragma comment(lib, "Synchronization.lib")
+
+void platform_wait_on_address(volatile int32_t *address, int32_t expected)
+{
+	WaitOnAddress(address, &expected, sizeof(expected), INFINITE);
+}
+
+void platform_wake_address(volatile int32_t *address)
+{
+	WakeByAddressAll((PVOID)address);
+}
+
+typedef struct PlatformAsyncRead
+{
+	// First, the completion port hands back the OVERLAPPED.
+	OVERLAPPED overlapped;
+	HANDLE file;
+	void *param;
+} PlatformAsyncRead;
+
+struct PlatformAsyncIo
+{
+	HANDLE port;
+	PlatformThread *thread;
+	PlatformReadDone done;
+};
+
+static void platform_async_io_thread(void *param)
+{
+	PlatformAsyncIo *async_io = param;
+	while (1) {
+		DWORD bytes_read = 0;
+		ULONG_PTR key;
+		OVERLAPPED *overlapped = NULL;
+		const BOOL result = GetQueuedCompletionStatus(async_io->port, &bytes_read, &key, &overlapped, INFINITE);
+		// Destroy posts a packet without an OVERLAPPED.
+		if (!overlapped)
+			break;
+
+		PlatformAsyncRead *read = (PlatformAsyncRead *)overlapped;
+		void *read_param = read->param;
+		CloseHandle(read->file);
+		free(read);
+		async_io->done(read_param, result ? bytes_read : 0);
+	}
+}
+
+PlatformAsyncIo *platform_async_io_create(PlatformReadDone done)
+{
+	PlatformAsyncIo *async_io = malloc(sizeof(PlatformAsyncIo));
+	async_io->done = done;
+	async_io->port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+	assert(async_io->port);
+	async_io->thread = platform_thread_create(platform_async_io_thread, async_io);
+	return async_io;
+}
+
+void platform_async_io_destroy(PlatformAsyncIo *async_io)
+{
+	PostQueuedCompletionStatus(async_io->port, 0, 0, NULL);
+	platform_thread_join(async_io->thread);
+	CloseHandle(async_io->port);
+	free(async_io);
+}
+
+void platform_async_read(PlatformAsyncIo *async_io, const char *path, uint64_t offset, unsigned size, void *dst, void *param)
+{
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		async_io->done(param, 0);
+		return;
+	}
+	CreateIoCompletionPort(file, async_io->port, 0, 0);
+
+	PlatformAsyncRead *read = malloc(sizeof(PlatformAsyncRead));
+	memset(&read->overlapped, 0, sizeof(read->overlapped));
+	read->overlapped.Offset = (DWORD)offset;
+	read->overlapped.OffsetHigh = (DWORD)(offset >> 32);
+	read->file = file;
+	read->param = param;
+	// Reads that fail straight away, like ones past the end of the file, don't queue a completion.
+	if (!ReadFile(file, dst, size, NULL, &read->overlapped) && GetLastError() != ERROR_IO_PENDING) {
+		CloseHandle(file);
+		free(read);
+		async_io->done(param, 0);
+	}
+}
+
+unsigned platform_processor_count(void)
+{
+	SYSTEM_INFO system_info;
+	GetSystemInfo(&system_info);
+	return system_info.dwNumberOfProcessors;
+}
+
+uint64_t platform_time_ns(void)
+{
+	LARGE_INTEGER counter, frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	// Split to keep counter * 10^9 from overflowing.
+	const uint64_t seconds = counter.QuadPart / frequency.QuadPart;
+	const uint64_t remainder = counter.QuadPart % frequency.QuadPart;
+	return seconds * 1000000000ull + remainder * 1000000000ull / frequency.QuadPart;
+}
+
+void *platform_aligned_realloc(void *p, unsigned size, unsigned alignment)
+{
+	return _aligned_realloc(p, size, alignment);
+}
+
+unsigned platform_vm_page_size(void)
+{
+	SYSTEM_INFO system_info;
+	GetSystemInfo(&system_info);
+	return system_info.dwPageSize;
+}
+
+void *platform_vm_reserve(size_t size)
+{
+	void *p = VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+	assert(p);
+	return p;
+}
+
+void platform_vm_commit(void *p, size_t size)
+{
+	void *result = VirtualAlloc(p, size, MEM_COMMIT, PAGE_READWRITE);
+	assert(result);
+	(void)result;
+}
+
+void platform_vm_release(void *p, size_t size)
+{
+	(void)size;
+	VirtualFree(p, 0, MEM_RELEASE);
+}
+
+#else
+
+#include <pthread.h>
+#include <ucontext.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+#if defined(__linux__)
+#include <limits.h>
+#include <linux/futex.h>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+enum { PLATFORM_DEFAULT_STACK_SIZE = 1024 * 1024 };
+
+// swapcontext saves and restores the signal mask, a system call on every switch. On x86-64 switching only pushes the
+// callee-saved registers and the SSE and x87 control words and swaps stack pointers, other targets use ucontext.
+#if defined(__x86_64__) && defined(__ELF__)
+#define PLATFORM_FIBER_ASM 1
+#else
+#define PLATFORM_FIBER_ASM 0
+#endif
+
+struct PlatformFiber
+{
+#if PLATFORM_FIBER_ASM
+	// Where the fiber's registers were pushed when it was switched away from.
+	void *sp;
+#else
+	ucontext_t context;
+#endif
+	// The mapping starts with the guard page, the stack is the rest.
+	char *stack;
+	size_t stack_size;
+	size_t guard_size;
+	PlatformFiberEntry entry;
+	void *param;
+};
+
+#if PLATFORM_FIBER_ASM
+// Pushes the callee-saved registers, stores the stack pointer in *from_sp, switches to to_sp and pops them from there.
+void platform_fiber_jump(void **from_sp, void *to_sp);
+// A new fiber's first switch returns here, with the fiber in r12.
+void platform_fiber_start(void);
+
+__asm__(
+	".text\n"
+	".globl platform_fiber_jump\n"
+	".hidden platform_fiber_jump\n"
+	".type platform_fiber_jump, @function\n"
+	".p2align 4\n"
+	"platform_fiber_jump:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size platform_fiber_jump, .-platform_fiber_jump\n"
+	".globl platform_fiber_start\n"
+	".hidden platform_fiber_start\n"
+	".type platform_fiber_start, @function\n"
+	".p2align 4\n"
+	"platform_fiber_start:\n"
+	"	movq %r12, %rdi\n"
+	"	call platform_fiber_trampoline\n"
+	"	ud2\n"
+	".size platform_fiber_start, .-platform_fiber_start\n");
+
+// Only called from platform_fiber_start.
+static __attribute__((used)) void platform_fiber_trampoline(PlatformFiber *fiber)
+{
+	fiber->entry(fiber->param);
+	assert(0); // Fiber entry points must never return.
+}
+#else
+// makecontext only passes int arguments, so the fiber pointer is split in two halves.
+static void platform_fiber_trampoline(unsigned low, unsigned high)
+{
+	PlatformFiber *fiber = (PlatformFiber *)(((uintptr_t)high << 16 << 16) | (uintptr_t)low);
+	fiber->entry(fiber->param);
+	assert(0); // Fiber entry points must never return.
+}
+#endif
+
+PlatformFiber *platform_fiber_create(unsigned stack_size, PlatformFiberEntry entry, void *param)
+{
+	PlatformFiber *fiber = malloc(sizeof(PlatformFiber));
+	fiber->entry = entry;
+	fiber->param = param;
+	const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+	stack_size = stack_size ? stack_size : PLATFORM_DEFAULT_STACK_SIZE;
+	fiber->stack_size = (stack_size + page_size - 1) & ~(page_size - 1);
+	fiber->guard_size = page_size;
+	fiber->stack = mmap(NULL, fiber->guard_size + fiber->stack_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	assert(fiber->stack != MAP_FAILED);
+	int result = mprotect(fiber->stack, fiber->guard_size, PROT_NONE);
+	assert(result == 0);
+	(void)result;
+
+#if PLATFORM_FIBER_ASM
+	// What platform_fiber_jump pops: the default SSE and x87 control words, r15 to rbp with the fiber in r12, and
+	// platform_fiber_start to return to, which then calls with the 16 byte aligned stack the ABI asks for.
+	uint64_t *top = (uint64_t *)(fiber->stack + fiber->guard_size + fiber->stack_size);
+	uint64_t *sp = top - 10;
+	sp[0] = 0x1F80 | (uint64_t)0x037F << 32;
+	sp[1] = sp[2] = sp[3] = 0;
+	sp[4] = (uintptr_t)fiber;
+	sp[5] = sp[6] = 0;
+	sp[7] = (uintptr_t)platform_fiber_start;
+	fiber->sp = sp;
+#else
+	getcontext(&fiber->context);
+	fiber->context.uc_stack.ss_sp = fiber->stack + fiber->guard_size;
+	fiber->context.uc_stack.ss_size = fiber->stack_size;
+	fiber->context.uc_link = NULL;
+	const uintptr_t p = (uintptr_t)fiber;
+	makecontext(&fiber->context, (void (*)(void))platform_fiber_trampoline, 2, (unsigned)p, (unsigned)(p >> 16 >> 16));
+#endif
+	return fiber;
+}
+
+void platform_fiber_destroy(PlatformFiber *fiber)
+{
+	munmap(fiber->stack, fiber->guard_size + fiber->stack_size);
+	free(fiber);
+}
+
+unsigned platform_fiber_stack_high_water(PlatformFiber *fiber)
+{
+	if (!fiber->stack)
+		return 0;
+
+	// Fresh anonymous pages read as zero, so the lowest non-zero word is as deep as the stack has been. Reading the
+	// untouched pages maps the shared zero page rather than committing memory.
+	const uint64_t *low = (const uint64_t *)(fiber->stack + fiber->guard_size);
+	const uint64_t *high = (const uint64_t *)(fiber->stack + fiber->guard_size + fiber->stack_size);
+	const uint64_t *p = low;
+	while (p < high && !*(const volatile uint64_t *)p)
+		++p;
+	return (unsigned)((const char *)high - (const char *)p);
+}
+
+PlatformFiber *platform_fiber_convert_thread(void)
+{
+	PlatformFiber *fiber = malloc(sizeof(PlatformFiber));
+	memset(fiber, 0, sizeof(PlatformFiber));
+	return fiber;
+}
+
+void platform_fiber_convert_to_thread(PlatformFiber *thread_fiber)
+{
+	free(thread_fiber);
+}
+
+void platform_fiber_switch(PlatformFiber *from, PlatformFiber *to)
+{
+#if PLATFORM_FIBER_ASM
+	platform_fiber_jump(&from->sp, to->sp);
+#else
+	swapcontext(&from->context, &to->context);
+#endif
+}
+
+struct PlatformThread
+{
+	pthread_t thread;
+	PlatformThreadEntry entry;
+	void *param;
+};
+
+static void *platform_thread_trampoline(void *param)
+{
+	PlatformThread *thread = param;
+	thread->entry(thread->param);
+	platform_thread_exit();
+	return NULL;
+}
+
+PlatformThread *platform_thread_create(PlatformThreadEntry entry, void *param)
+{
+	PlatformThread *thread = malloc(sizeof(PlatformThread));
+	thread->entry = entry;
+	thread->param = param;
+	int result = pthread_create(&thread->thread, NULL, platform_thread_trampoline, thread);
+	assert(result == 0);
+	(void)result;
+	return thread;
+}
+
+void platform_thread_join(PlatformThread *thread)
+{
+	pthread_join(thread->thread, NULL);
+	free(thread);
+}
+
+void platform_thread_yield(void)
+{
+	sched_yield();
+}
+
+void platform_sleep_ns(uint64_t ns)
+{
+	struct timespec time = { (time_t)(ns / 1000000000ull), (long)(ns % 1000000000ull) };
+	while (nanosleep(&time, &time) == -1 && errno == EINTR)
+		;
+}
+
+#if defined(__linux__)
+void platform_wait_on_address(volatile int32_t *address, int32_t expected)
+{
+	syscall(SYS_futex, address, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+void platform_wake_address(volatile int32_t *address)
+{
+	syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+#else
+// No portable futex, waiters poll instead.
+void platform_wait_on_address(volatile int32_t *address, int32_t expected)
+{
+	if (atomic_load_32(address) == expected)
+		sched_yield();
+}
+
+void platform_wake_address(volatile int32_t *address)
+{
+	(void)address;
+}
+#endif
+
+typedef struct PlatformAsyncRead
+{
+	int fd;
+	uint64_t offset;
+	unsigned size;
+	void *dst;
+	void *param;
+	// Bytes read so far, io_uring may come back short in the middle of a file and the rest is read again.
+	unsigned n_read;
+	struct PlatformAsyncRead *next;
+} PlatformAsyncRead;
+
+enum { PLATFORM_ASYNC_IO_THREADS = 4, PLATFORM_IO_URING_ENTRIES = 256 };
+
+struct PlatformAsyncIo
+{
+	PlatformReadDone done;
+	PlatformThread *threads[PLATFORM_ASYNC_IO_THREADS];
+	unsigned n_threads;
+
+	// Reads waiting for a reader thread.
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	PlatformAsyncRead *pending;
+	PlatformAsyncRead *pending_tail;
+	int quit;
+
+#if defined(__linux__)
+	// -1 if io_uring couldn't be set up, reads then go to the reader threads.
+	int ring_fd;
+	// Guards the submission queue, the in flight count and the reads queued behind it.
+	PlatformSpinLock submit_lock;
+	// No more reads are in flight than the completion queue holds, without IORING_FEAT_NODROP the kernel drops
+	// completions that don't fit. The others wait for the completion thread to submit them.
+	unsigned in_flight;
+	unsigned cq_entries;
+	unsigned sq_entries;
+	PlatformAsyncRead *queued;
+	PlatformAsyncRead *queued_tail;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+#endif
+};
+
+static unsigned platform_read_blocking(PlatformAsyncRead *read)
+{
+	unsigned n = read->n_read;
+	while (n < read->size) {
+		const ssize_t result = pread(read->fd, (char *)read->dst + n, read->size - n, (off_t)(read->offset + n));
+		if (result < 0 && errno == EINTR)
+			continue;
+		if (result <= 0)
+			break;
+		n += (unsigned)result;
+	}
+	return n;
+}
+
+static void platform_async_read_done(PlatformAsyncIo *async_io, PlatformAsyncRead *read, unsigned bytes_read)
+{
+	void *param = read->param;
+	close(read->fd);
+	free(read);
+	async_io->done(param, bytes_read);
+}
+
+static void platform_async_io_reader_thread(void *param)
+{
+	PlatformAsyncIo *async_io = param;
+	pthread_mutex_lock(&async_io->lock);
+	while (1) {
+		while (!async_io->pending && !async_io->quit)
+			pthread_cond_wait(&async_io->cond, &async_io->lock);
+		PlatformAsyncRead *read = async_io->pending;
+		if (!read)
+			break;
+
+		async_io->pending = read->next;
+		if (!async_io->pending)
+			async_io->pending_tail = NULL;
+		pthread_mutex_unlock(&async_io->lock);
+		platform_async_read_done(async_io, read, platform_read_blocking(read));
+		pthread_mutex_lock(&async_io->lock);
+	}
+	pthread_mutex_unlock(&async_io->lock);
+}
+
+#if defined(__linux__)
+static int platform_io_uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int platform_io_uring_create(PlatformAsyncIo *async_io)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	const int ring_fd = (int)syscall(__NR_io_uring_setup, PLATFORM_IO_URING_ENTRIES, &params);
+	if (ring_fd < 0)
+		return 0;
+
+	async_io->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	async_io->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	async_io->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	async_io->sq_ring = mmap(NULL, async_io->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	async_io->cq_ring = mmap(NULL, async_io->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+	async_io->sqes = mmap(NULL, async_io->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if (async_io->sq_ring == MAP_FAILED || async_io->cq_ring == MAP_FAILED || async_io->sqes == MAP_FAILED) {
+		if (async_io->sq_ring != MAP_FAILED)
+			munmap(async_io->sq_ring, async_io->sq_ring_size);
+		if (async_io->cq_ring != MAP_FAILED)
+			munmap(async_io->cq_ring, async_io->cq_ring_size);
+		if (async_io->sqes != MAP_FAILED)
+			munmap(async_io->sqes, async_io->sqes_size);
+		close(ring_fd);
+		return 0;
+	}
+
+	char *sq_ring = async_io->sq_ring;
+	char *cq_ring = async_io->cq_ring;
+	async_io->sq_tail = (unsigned *)(sq_ring + params.sq_off.tail);
+	async_io->sq_mask = *(unsigned *)(sq_ring + params.sq_off.ring_mask);
+	async_io->sq_array = (unsigned *)(sq_ring + params.sq_off.array);
+	async_io->cq_head = (unsigned *)(cq_ring + params.cq_off.head);
+	async_io->cq_tail = (unsigned *)(cq_ring + params.cq_off.tail);
+	async_io->cq_mask = *(unsigned *)(cq_ring + params.cq_off.ring_mask);
+	async_io->cqes = (struct io_uring_cqe *)(cq_ring + params.cq_off.cqes);
+	async_io->submit_lock = 0;
+	async_io->in_flight = 0;
+	async_io->cq_entries = params.cq_entries;
+	async_io->sq_entries = params.sq_entries;
+	async_io->queued = NULL;
+	async_io->queued_tail = NULL;
+	async_io->ring_fd = ring_fd;
+	return 1;
+}
+
+static void platform_io_uring_prepare(PlatformAsyncIo *async_io, unsigned tail, PlatformAsyncRead *read)
+{
+	const unsigned index = tail & async_io->sq_mask;
+	struct io_uring_sqe *sqe = &async_io->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = read ? IORING_OP_READ : IORING_OP_NOP;
+	sqe->user_data = (uint64_t)(uintptr_t)read;
+	if (read) {
+		sqe->fd = read->fd;
+		sqe->off = read->offset + read->n_read;
+		sqe->addr = (uint64_t)(uintptr_t)((char *)read->dst + read->n_read);
+		sqe->len = read->size - read->n_read;
+	}
+	async_io->sq_array[index] = index;
+}
+
+// Entries are submitted as soon as they are written, so the submission queue is empty between calls. Submits the n
+// entries prepared from tail on with submit_lock held. Returns how many the kernel took, with errno set if it didn't
+// take all of them, the others are taken back out of the queue and won't complete.
+static unsigned platform_io_uring_submit_locked(PlatformAsyncIo *async_io, unsigned tail, unsigned n)
+{
+	__atomic_store_n(async_io->sq_tail, tail + n, __ATOMIC_RELEASE);
+	int submitted;
+	do {
+		submitted = platform_io_uring_enter(async_io->ring_fd, n, 0, 0);
+	} while (submitted < 0 && errno == EINTR);
+	if (submitted < 0)
+		submitted = 0;
+	// Short of requests for the rest, like EAGAIN for a single entry.
+	else if ((unsigned)submitted < n)
+		errno = EAGAIN;
+	if ((unsigned)submitted < n)
+		__atomic_store_n(async_io->sq_tail, tail + (unsigned)submitted, __ATOMIC_RELEASE);
+	async_io->in_flight += (unsigned)submitted;
+	return (unsigned)submitted;
+}
+
+static void platform_io_uring_queue(PlatformAsyncIo *async_io, PlatformAsyncRead *read)
+{
+	read->next = NULL;
+	if (async_io->queued_tail)
+		async_io->queued_tail->next = read;
+	else
+		async_io->queued = read;
+	async_io->queued_tail = read;
+}
+
+// Submits queued reads for as long as the completion queue has room for them, as many at a time as the submission
+// queue holds, with submit_lock held. The kernel being short of memory only holds them back while reads in flight will
+// bring the completion thread here again. Reads that can't be submitted are returned in a list.
+static PlatformAsyncRead *platform_io_uring_submit_queued(PlatformAsyncIo *async_io)
+{
+	PlatformAsyncRead *failed = NULL;
+	while (async_io->queued && async_io->in_flight < async_io->cq_entries) {
+		const unsigned tail = *async_io->sq_tail;
+		unsigned n = 0;
+		for (PlatformAsyncRead *read = async_io->queued; read && n < async_io->sq_entries && async_io->in_flight + n < async_io->cq_entries; read = read->next)
+			platform_io_uring_prepare(async_io, tail + n++, read);
+
+		const unsigned submitted = platform_io_uring_submit_locked(async_io, tail, n);
+		for (unsigned i = 0; i < submitted; ++i)
+			async_io->queued = async_io->queued->next;
+		if (submitted < n) {
+			if (async_io->in_flight && (errno == EAGAIN || errno == EBUSY))
+				break;
+			PlatformAsyncRead *read = async_io->queued;
+			async_io->queued = read->next;
+			read->next = failed;
+			failed = read;
+		}
+	}
+	if (!async_io->queued)
+		async_io->queued_tail = NULL;
+	return failed;
+}
+
+// Returns 0 if the read could be neither submitted nor queued, it then won't complete. The no-op is never queued.
+static int platform_io_uring_submit(PlatformAsyncIo *async_io, PlatformAsyncRead *read)
+{
+	platform_spin_lock_acquire(&async_io->submit_lock);
+	int submitted = 1;
+	if (read && (async_io->queued || async_io->in_flight >= async_io->cq_entries))
+		platform_io_uring_queue(async_io, read);
+	else {
+		const unsigned tail = *async_io->sq_tail;
+		platform_io_uring_prepare(async_io, tail, read);
+		if (!platform_io_uring_submit_locked(async_io, tail, 1)) {
+			submitted = read && async_io->in_flight && (errno == EAGAIN || errno == EBUSY);
+			if (submitted)
+				platform_io_uring_queue(async_io, read);
+		}
+	}
+	platform_spin_lock_release(&async_io->submit_lock);
+	return submitted;
+}
+
+static void platform_io_uring_thread(void *param)
+{
+	PlatformAsyncIo *async_io = param;
+	int quit = 0;
+	while (!quit) {
+		platform_io_uring_enter(async_io->ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+
+		unsigned head = *async_io->cq_head;
+		const unsigned tail = __atomic_load_n(async_io->cq_tail, __ATOMIC_ACQUIRE);
+		const unsigned n_completed = tail - head;
+		PlatformAsyncRead *again = NULL;
+		PlatformAsyncRead *again_tail = NULL;
+		for (; head != tail; ++head) {
+			const struct io_uring_cqe *cqe = &async_io->cqes[head & async_io->cq_mask];
+			PlatformAsyncRead *read = (PlatformAsyncRead *)(uintptr_t)cqe->user_data;
+			if (!read) {
+				quit = 1;
+				continue;
+			}
+			// Short only at the end of the file, a read that stopped before it goes again for the rest.
+			if (cqe->res > 0 && read->n_read + (unsigned)cqe->res < read->size) {
+				read->n_read += (unsigned)cqe->res;
+				read->next = NULL;
+				if (again_tail)
+					again_tail->next = read;
+				else
+					again = read;
+				again_tail = read;
+				continue;
+			}
+			// Kernels older than IORING_OP_READ reject it, read on this thread instead.
+			const unsigned bytes_read = cqe->res >= 0 ? read->n_read + (unsigned)cqe->res : cqe->res == -EINVAL ? platform_read_blocking(read) : 0;
+			platform_async_read_done(async_io, read, bytes_read);
+		}
+		__atomic_store_n(async_io->cq_head, head, __ATOMIC_RELEASE);
+
+		// The entries just taken are free again, the rest of short reads go first.
+		platform_spin_lock_acquire(&async_io->submit_lock);
+		async_io->in_flight -= n_completed;
+		if (again) {
+			again_tail->next = async_io->queued;
+			if (!async_io->queued)
+				async_io->queued_tail = again_tail;
+			async_io->queued = again;
+		}
+		PlatformAsyncRead *failed = platform_io_uring_submit_queued(async_io);
+		platform_spin_lock_release(&async_io->submit_lock);
+		while (failed) {
+			PlatformAsyncRead *read = failed;
+			failed = read->next;
+			platform_async_read_done(async_io, read, 0);
+		}
+	}
+}
+#endif
+
+PlatformAsyncIo *platform_async_io_create(PlatformReadDone done)
+{
+	PlatformAsyncIo *async_io = malloc(sizeof(PlatformAsyncIo));
+	memset(async_io, 0, sizeof(PlatformAsyncIo));
+	async_io->done = done;
+	pthread_mutex_init(&async_io->lock, NULL);
+	pthread_cond_init(&async_io->cond, NULL);
+
+#if defined(__linux__)
+	async_io->ring_fd = -1;
+	if (platform_io_uring_create(async_io)) {
+		async_io->threads[async_io->n_threads++] = platform_thread_create(platform_io_uring_thread, async_io);
+		return async_io;
+	}
+#endif
+
+	for (unsigned i = 0; i < PLATFORM_ASYNC_IO_THREADS; ++i)
+		async_io->threads[async_io->n_threads++] = platform_thread_create(platform_async_io_reader_thread, async_io);
+	return async_io;
+}
+
+void platform_async_io_destroy(PlatformAsyncIo *async_io)
+{
+#if defined(__linux__)
+	// Nothing else wakes the completion thread, joining it would hang.
+	if (async_io->ring_fd >= 0 && !platform_io_uring_submit(async_io, NULL))
+		abort();
+#endif
+	pthread_mutex_lock(&async_io->lock);
+	async_io->quit = 1;
+	pthread_cond_broadcast(&async_io->cond);
+	pthread_mutex_unlock(&async_io->lock);
+
+	for (unsigned i = 0; i < async_io->n_threads; ++i)
+		platform_thread_join(async_io->threads[i]);
+
+#if defined(__linux__)
+	if (async_io->ring_fd >= 0) {
+		munmap(async_io->sqes, async_io->sqes_size);
+		munmap(async_io->cq_ring, async_io->cq_ring_size);
+		munmap(async_io->sq_ring, async_io->sq_ring_size);
+		close(async_io->ring_fd);
+	}
+#endif
+	pthread_cond_destroy(&async_io->cond);
+	pthread_mutex_destroy(&async_io->lock);
+	free(async_io);
+}
+
+void platform_async_read(PlatformAsyncIo *async_io, const char *path, uint64_t offset, unsigned size, void *dst, void *param)
+{
+	const int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		async_io->done(param, 0);
+		return;
+	}
+
+	PlatformAsyncRead *read = malloc(sizeof(PlatformAsyncRead));
+	read->fd = fd;
+	read->offset = offset;
+	read->size = size;
+	read->dst = dst;
+	read->param = param;
+	read->n_read = 0;
+	read->next = NULL;
+
+#if defined(__linux__)
+	if (async_io->ring_fd >= 0) {
+		// Like a read that fails straight away, the caller still gets its done.
+		if (!platform_io_uring_submit(async_io, read))
+			platform_async_read_done(async_io, read, 0);
+		return;
+	}
+#endif
+
+	pthread_mutex_lock(&async_io->lock);
+	if (async_io->pending_tail)
+		async_io->pending_tail->next = read;
+	else
+		async_io->pending = read;
+	async_io->pending_tail = read;
+	pthread_cond_signal(&async_io->cond);
+	pthread_mutex_unlock(&async_io->lock);
+}
+
+unsigned platform_processor_count(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (unsigned)n : 1;
+}
+
+uint64_t platform_time_ns(void)
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t)time.tv_sec * 1000000000ull + (uint64_t)time.tv_nsec;
+}
+
+// Mirrors _aligned_realloc: the original block pointer and the user size are kept in front of the aligned block.
+typedef struct PlatformAlignedHeader
+{
+	void *block;
+	size_t size;
+} PlatformAlignedHeader;
+
+void *platform_aligned_realloc(void *p, unsigned size, unsigned alignment)
+{
+	PlatformAlignedHeader *old_header = p ? (PlatformAlignedHeader *)p - 1 : NULL;
+	if (!size) {
+		if (old_header)
+			free(old_header->block);
+		return NULL;
+	}
+
+	if (alignment < sizeof(void *))
+		alignment = sizeof(void *);
+	void *block = malloc(size + alignment + sizeof(PlatformAlignedHeader));
+	if (!block)
+		return NULL;
+
+	uintptr_t aligned = ((uintptr_t)block + sizeof(PlatformAlignedHeader) + alignment - 1) & ~((uintptr_t)alignment - 1);
+	PlatformAlignedHeader *header = (PlatformAlignedHeader *)aligned - 1;
+	header->block = block;
+	header->size = size;
+
+	if (old_header) {
+		memcpy((void *)aligned, p, old_header->size < size ? old_header->size : size);
+		free(old_header->block);
+	}
+
+	return (void *)aligned;
+}
+
+unsigned platform_vm_page_size(void)
+{
+	return (unsigned)sysconf(_SC_PAGESIZE);
+}
+
+void *platform_vm_reserve(size_t size)
+{
+	// Over-reserve to trim the start to 64KB like VirtualAlloc does.
+	const size_t granularity = 64 * 1024;
+	size = (size + granularity - 1) & ~(granularity - 1);
+	char *p = mmap(NULL, size + granularity, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	assert(p != MAP_FAILED);
+	char *start = (char *)(((uintptr_t)p + granularity - 1) & ~(uintptr_t)(granularity - 1));
+	if (start != p)
+		munmap(p, start - p);
+	if (start + size != p + size + granularity)
+		munmap(start + size, p + granularity - start);
+	return start;
+}
+
+void platform_vm_commit(void *p, size_t size)
+{
+	const uintptr_t page_size = (uintptr_t)sysconf(_SC_PAGESIZE);
+	const uintptr_t start = (uintptr_t)p & ~(page_size - 1);
+	const uintptr_t end = ((uintptr_t)p + size + page_size - 1) & ~(page_size - 1);
+	int result = mprotect((void *)start, end - start, PROT_READ | PROT_WRITE);
+	assert(result == 0);
+	(void)result;
+}
+
+void platform_vm_release(void *p, size_t size)
+{
+	const size_t granularity = 64 * 1024;
+	munmap(p, (size + granularity - 1) & ~(granularity - 1));
+}
+
+#endif
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Thin layer over the OS primitives used by the fibers system and the allocator, so those build on Win32 as well as POSIX.
+
+#if defined(_WIN32)
+#include <Windows.h>
+#define PLATFORM_THREAD_LOCAL __declspec(thread)
+#define PLATFORM_NOINLINE __declspec(noinline)
+#else
+#include <sched.h>
+#define PLATFORM_THREAD_LOCAL __thread
+#define PLATFORM_NOINLINE __attribute__((noinline))
+#endif
+
+typedef struct PlatformFiber PlatformFiber;
+typedef void (*PlatformFiberEntry)(void *param);
+
+// A stack size of 0 gives the platform default. Stacks have a guard page below them, so an overflow faults instead of
+// writing into whatever is next in memory.
+PlatformFiber *platform_fiber_create(unsigned stack_size, PlatformFiberEntry entry, void *param);
+void platform_fiber_destroy(PlatformFiber *fiber);
+// The most stack the fiber has used so far, rounded up to whole pages on Win32.
+unsigned platform_fiber_stack_high_water(PlatformFiber *fiber);
+PlatformFiber *platform_fiber_convert_thread(void);
+void platform_fiber_convert_to_thread(PlatformFiber *thread_fiber);
+void platform_fiber_switch(PlatformFiber *from, PlatformFiber *to);
+
+typedef struct PlatformThread PlatformThread;
+typedef void (*PlatformThreadEntry)(void *param);
+
+PlatformThread *platform_thread_create(PlatformThreadEntry entry, void *param);
+void platform_thread_join(PlatformThread *thread);
+// Called on every thread started by platform_thread_create once its entry returns. There is one, setting it again
+// replaces it.
+void platform_thread_set_exit_callback(void (*callback)(void));
+void platform_thread_yield(void);
+// Millisecond granularity on Win32.
+void platform_sleep_ns(uint64_t ns);
+unsigned platform_processor_count(void);
+
+// Blocks the thread while *address is expected, futex on Linux and WaitOnAddress on Win32. May return spuriously.
+void platform_wait_on_address(volatile int32_t *address, int32_t expected);
+// Wakes all threads blocked on the address.
+void platform_wake_address(volatile int32_t *address);
+
+// File reads that don't block the thread issuing them: io_uring on Linux, falling back to a few reader threads when it
+// isn't available, an I/O completion port on Win32 and reader threads elsewhere. done is called on an I/O thread with
+// the number of bytes read, which is short at the end of the file and 0 if the file couldn't be opened.
+typedef struct PlatformAsyncIo PlatformAsyncIo;
+typedef void (*PlatformReadDone)(void *param, unsigned bytes_read);
+
+PlatformAsyncIo *platform_async_io_create(PlatformReadDone done);
+// Every read must have completed.
+void platform_async_io_destroy(PlatformAsyncIo *async_io);
+// The file is opened on the calling thread, only the read itself is asynchronous. done may be called before this returns.
+void platform_async_read(PlatformAsyncIo *async_io, const char *path, uint64_t offset, unsigned size, void *dst, void *param);
+
+// Monotonic time in nanoseconds.
+uint64_t platform_time_ns(void);
+
+// Cheapest timestamp there is, the TSC on x86 and nanoseconds elsewhere. Scale against platform_time_ns.
+#if defined(_WIN32)
+#include <intrin.h>
+static inline uint64_t platform_ticks(void) { return __rdtsc(); }
+#elif defined(__x86_64__) || defined(__i386__)
+static inline uint64_t platform_ticks(void) { return __builtin_ia32_rdtsc(); }
+#else
+static inline uint64_t platform_ticks(void) { return platform_time_ns(); }
+#endif
+
+void *platform_aligned_realloc(void *p, unsigned size, unsigned alignment);
+
+// Address space reserved without backing memory. Committed pages are zero filled, touching anything else faults. Reserves
+// start on a 64KB boundary and commits are rounded out to whole pages.
+unsigned platform_vm_page_size(void);
+void *platform_vm_reserve(size_t size);
+void platform_vm_commit(void *p, size_t size);
+// Frees the whole reserve, size is the size it was reserved with.
+void platform_vm_release(void *p, size_t size);
+
+// Loads are acquire, stores are release and read-modify-writes are full barriers.
+#if defined(_WIN32)
+static inline int32_t atomic_load_32(volatile int32_t *p) { int32_t v = *p; _ReadWriteBarrier(); return v; }
+static inline void atomic_store_32(volatile int32_t *p, int32_t v) { _ReadWriteBarrier(); *p = v; }
+static inline int32_t atomic_add_32(volatile int32_t *p, int32_t v) { return InterlockedExchangeAdd((volatile LONG *)p, v) + v; }
+static inline int32_t atomic_exchange_32(volatile int32_t *p, int32_t v) { return InterlockedExchange((volatile LONG *)p, v); }
+static inline int32_t atomic_cas_32(volatile int32_t *p, int32_t expected, int32_t desired) { return InterlockedCompareExchange((volatile LONG *)p, desired, expected); }
+#if defined(_WIN64)
+static inline int64_t atomic_load_64(volatile int64_t *p) { int64_t v = *p; _ReadWriteBarrier(); return v; }
+static inline void atomic_store_64(volatile int64_t *p, int64_t v) { _ReadWriteBarrier(); *p = v; }
+#else
+static inline int64_t atomic_load_64(volatile int64_t *p) { return InterlockedCompareExchange64(p, 0, 0); }
+static inline void atomic_store_64(volatile int64_t *p, int64_t v) { InterlockedExchange64(p, v); }
+#endif
+static inline int64_t atomic_cas_64(volatile int64_t *p, int64_t expected, int64_t desired) { return InterlockedCompareExchange64(p, desired, expected); }
+static inline int64_t atomic_add_64(volatile int64_t *p, int64_t v) { return InterlockedExchangeAdd64(p, v) + v; }
+static inline void *atomic_load_ptr(void *volatile *p) { void *v = *p; _ReadWriteBarrier(); return v; }
+static inline void atomic_store_ptr(void *volatile *p, void *v) { _ReadWriteBarrier(); *p = v; }
+static inline void *atomic_cas_ptr(void *volatile *p, void *expected, void *desired) { return InterlockedCompareExchangePointer(p, desired, expected); }
+static inline void atomic_fence(void) { MemoryBarrier(); }
+static inline void cpu_pause(void) { YieldProcessor(); }
+#else
+static inline int32_t atomic_load_32(volatile int32_t *p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+static inline void atomic_store_32(volatile int32_t *p, int32_t v) { __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+static inline int32_t atomic_add_32(volatile int32_t *p, int32_t v) { return __atomic_add_fetch(p, v, __ATOMIC_SEQ_CST); }
+static inline int32_t atomic_exchange_32(volatile int32_t *p, int32_t v) { return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST); }
+static inline int32_t atomic_cas_32(volatile int32_t *p, int32_t expected, int32_t desired) { __atomic_compare_exchange_n(p, &expected, desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); return expected; }
+static inline int64_t atomic_load_64(volatile int64_t *p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+static inline void atomic_store_64(volatile int64_t *p, int64_t v) { __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+static inline int64_t atomic_cas_64(volatile int64_t *p, int64_t expected, int64_t desired) { __atomic_compare_exchange_n(p, &expected, desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); return expected; }
+static inline int64_t atomic_add_64(volatile int64_t *p, int64_t v) { return __atomic_add_fetch(p, v, __ATOMIC_SEQ_CST); }
+static inline void *atomic_load_ptr(void *volatile *p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+static inline void atomic_store_ptr(void *volatile *p, void *v) { __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+static inline void *atomic_cas_ptr(void *volatile *p, void *expected, void *desired) { __atomic_compare_exchange_n(p, &expected, desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); return expected; }
+static inline void atomic_fence(void) { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+#if defined(__x86_64__) || defined(__i386__)
+static inline void cpu_pause(void) { __builtin_ia32_pause(); }
+#else
+static inline void cpu_pause(void) { }
+#endif
+#endif
+
+typedef volatile int32_t PlatformSpinLock;
+
+static inline void platform_spin_lock_acquire(PlatformSpinLock *lock)
+{
+	while (atomic_exchange_32(lock, 1)) {
+		while (atomic_load_32(lock))
+			cpu_pause();
+	}
+}
+
+static inline void platform_spin_lock_release(PlatformSpinLock *lock)
+{
+	atomic_store_32(lock, 0);
+}
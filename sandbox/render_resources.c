@@ -9,249 +9,93 @@
 #include <assert.h>
 #include <d3dcompiler.h>
 #include "stretchy_buffer.h"
+#include "slot_map.h"
 
+enum { RENDER_RESOURCES_MAX_INPUT_LAYOUTS = 1 << 16 };
+enum { RENDER_RESOURCES_N_TYPES = RESOURCE_RAW_BUFFER + 1 };
+
+// One table per resource type, a Resource's handle is a handle into the table of its type. Pointers from
+// render_resources_vertex_buffer and friends stay valid until that resource is destroyed.
 struct RenderResources
 {
 	Allocator *allocator;
 	ID3D11Device *d3d_device;
 
-	Buffer *vertex_buffers;
-	unsigned *free_vertex_buffers;
-
-	Buffer *index_buffers;
-	unsigned *free_index_buffers;
-
-	RawBuffer *raw_buffers;
-	unsigned *free_raw_buffers;
-
-	VertexDeclaration *vertex_declarations;
-	unsigned *free_vertex_declarations;
-
-	VertexShader *vertex_shaders;
-	unsigned *free_vertex_shaders;
-
-	PixelShader *pixel_shaders;
-	unsigned *free_pixel_shaders;
+	SlotMap tables[RENDER_RESOURCES_N_TYPES];
 
 	InputLayout *input_layouts;
 	UINT64 *input_layout_hashes;
 };
 
-Resource render_resources_allocate_vertex_buffer_handle(RenderResources *resources)
-{
-	if (sb_count(resources->free_vertex_buffers)) {
-		unsigned h = sb_last(resources->free_vertex_buffers);
-		sb_pop(resources->free_vertex_buffers);
-		return resource_encode_handle_type(h, RESOURCE_VERTEX_BUFFER);
-	}
-
-	unsigned h = sb_count(resources->vertex_buffers);
-	Buffer buffer = { .buffer = NULL };
-	sb_push(resources->vertex_buffers, buffer);
-
-	return resource_encode_handle_type(h, RESOURCE_VERTEX_BUFFER);
-}
-
-void render_resources_release_vertex_buffer_handle(RenderResources *resources, Resource resource)
-{
-	assert(resource_type(resource) == RESOURCE_VERTEX_BUFFER);
-	unsigned h = resource_handle(resource);
-	sb_push(resources->free_vertex_buffers, h);
-}
-
-Resource render_resources_allocate_index_buffer_handle(RenderResources *resources)
-{
-	if (sb_count(resources->free_index_buffers)) {
-		unsigned h = sb_last(resources->free_index_buffers);
-		sb_pop(resources->free_index_buffers);
-		return resource_encode_handle_type(h, RESOURCE_INDEX_BUFFER);
-	}
-
-	unsigned h = sb_count(resources->index_buffers);
-	Buffer buffer = { .buffer = NULL };
-	sb_push(resources->index_buffers, buffer);
-
-	return resource_encode_handle_type(h, RESOURCE_INDEX_BUFFER);
-}
-
-void render_resources_release_index_buffer_handle(RenderResources *resources, Resource resource)
-{
-	assert(resource_type(resource) == RESOURCE_INDEX_BUFFER);
-	unsigned h = resource_handle(resource);
-	sb_push(resources->free_index_buffers, h);
-}
-
-Resource render_resources_allocate_raw_buffer_handle(RenderResources *resources)
-{
-	if (sb_count(resources->free_raw_buffers)) {
-		unsigned h = sb_last(resources->free_raw_buffers);
-		sb_pop(resources->free_raw_buffers);
-		return resource_encode_handle_type(h, RESOURCE_RAW_BUFFER);
-	}
-
-	unsigned h = sb_count(resources->raw_buffers);
-	RawBuffer buffer = { .buffer = NULL, .srv = NULL };
-	sb_push(resources->raw_buffers, buffer);
-
-	return resource_encode_handle_type(h, RESOURCE_RAW_BUFFER);
-}
-
-void render_resources_release_raw_buffer_handle(RenderResources *resources, Resource resource)
-{
-	assert(resource_type(resource) == RESOURCE_RAW_BUFFER);
-	unsigned h = resource_handle(resource);
-	sb_push(resources->free_raw_buffers, h);
-}
-
-Resource render_resources_allocate_vertex_declaration_handle(RenderResources *resources)
-{
-	if (sb_count(resources->free_vertex_declarations)) {
-		unsigned h = sb_last(resources->free_vertex_declarations);
-		sb_pop(resources->free_vertex_declarations);
-		return resource_encode_handle_type(h, RESOURCE_VERTEX_DECLARATION);
-	}
-
-	unsigned h = sb_count(resources->vertex_declarations);
-	VertexDeclaration vertex_declaration = { .elements = NULL };
-	sb_push(resources->vertex_declarations, vertex_declaration);
-
-	return resource_encode_handle_type(h, RESOURCE_VERTEX_DECLARATION);
-}
-
-void render_resources_release_vertex_declaration_handle(RenderResources *resources, Resource resource)
-{
-	assert(resource_type(resource) == RESOURCE_VERTEX_DECLARATION);
-	unsigned h = resource_handle(resource);
-	sb_push(resources->free_vertex_declarations, h);
-}
+static const unsigned render_resources_item_sizes[RENDER_RESOURCES_N_TYPES] = {
+	[RESOURCE_VERTEX_BUFFER] = sizeof(Buffer),
+	[RESOURCE_INDEX_BUFFER] = sizeof(Buffer),
+	[RESOURCE_VERTEX_DECLARATION] = sizeof(VertexDeclaration),
+	[RESOURCE_VERTEX_SHADER] = sizeof(VertexShader),
+	[RESOURCE_PIXEL_SHADER] = sizeof(PixelShader),
+	[RESOURCE_RAW_BUFFER] = sizeof(RawBuffer),
+};
 
-Resource render_resources_allocate_vertex_shader_handle(RenderResources *resources)
+static unsigned render_resources_tag(void)
 {
-	if (sb_count(resources->free_vertex_shaders)) {
-		unsigned h = sb_last(resources->free_vertex_shaders);
-		sb_pop(resources->free_vertex_shaders);
-		return resource_encode_handle_type(h, RESOURCE_VERTEX_SHADER);
-	}
-
-	unsigned h = sb_count(resources->vertex_shaders);
-	VertexShader vertex_shader = { .shader = NULL };
-	sb_push(resources->vertex_shaders, vertex_shader);
-
-	return resource_encode_handle_type(h, RESOURCE_VERTEX_SHADER);
+	static unsigned tag;
+	if (!tag)
+		tag = allocator_tag("render_resources");
+	return tag;
 }
 
-void render_resources_release_vertex_shader_handle(RenderResources *resources, Resource resource)
+// The item starts out zeroed.
+static Resource render_resources_allocate_handle(RenderResources *resources, unsigned type)
 {
-	assert(resource_type(resource) == RESOURCE_VERTEX_SHADER);
-	unsigned h = resource_handle(resource);
-	sb_push(resources->free_vertex_shaders, h);
+	return resource_encode_handle_type(slot_map_insert(&resources->tables[type], NULL), type);
 }
 
-Resource render_resources_allocate_pixel_shader_handle(RenderResources *resources)
+static void render_resources_release_handle(RenderResources *resources, Resource resource)
 {
-	if (sb_count(resources->free_pixel_shaders)) {
-		unsigned h = sb_last(resources->free_pixel_shaders);
-		sb_pop(resources->free_pixel_shaders);
-		return resource_encode_handle_type(h, RESOURCE_PIXEL_SHADER);
-	}
-
-	unsigned h = sb_count(resources->pixel_shaders);
-	PixelShader pixel_shader = { .shader = NULL };
-	sb_push(resources->pixel_shaders, pixel_shader);
-
-	return resource_encode_handle_type(h, RESOURCE_PIXEL_SHADER);
+	const int erased = slot_map_erase(&resources->tables[resource_type(resource)], resource_handle(resource));
+	assert(erased);
+	(void)erased;
 }
 
-void render_resources_release_pixel_shader_handle(RenderResources *resources, Resource resource)
+// Asserts on handles to destroyed resources, and returns NULL for them without asserts.
+static void *render_resources_get(RenderResources *resources, Resource resource, unsigned type)
 {
-	assert(resource_type(resource) == RESOURCE_PIXEL_SHADER);
-	unsigned h = resource_handle(resource);
-	sb_push(resources->free_pixel_shaders, h);
+	assert(resource_type(resource) == type);
+	void *item = slot_map_get(&resources->tables[type], resource_handle(resource));
+	assert(item);
+	return item;
 }
 
 void render_resources_create(Allocator *allocator, ID3D11Device *d3d_device, RenderResources **out_resources)
 {
-	RenderResources *resources = *out_resources = allocator_realloc(allocator, NULL, sizeof(RenderResources), 16);
+	RenderResources *resources = *out_resources = allocator_realloc_tagged(allocator, NULL, sizeof(RenderResources), 16, render_resources_tag());
 	resources->allocator = allocator;
 	resources->d3d_device = d3d_device;
 
-	{
-		sb_create(allocator, resources->vertex_buffers, 10);
-		sb_create(allocator, resources->free_vertex_buffers, 10);
-		Resource first_vb = render_resources_allocate_vertex_buffer_handle(resources);
-		assert(resource_handle(first_vb) == 0);
-		(void)first_vb;
-	}
-
-	{
-		sb_create(allocator, resources->index_buffers, 10);
-		sb_create(allocator, resources->free_index_buffers, 10);
-		Resource first_ib = render_resources_allocate_index_buffer_handle(resources);
-		assert(resource_handle(first_ib) == 0);
-		(void)first_ib;
-	}
-
-	{
-		sb_create(allocator, resources->raw_buffers, 10);
-		sb_create(allocator, resources->free_raw_buffers, 10);
-		Resource first_rb = render_resources_allocate_raw_buffer_handle(resources);
-		assert(resource_handle(first_rb) == 0);
-		(void)first_rb;
-	}
-
-	{
-		sb_create(allocator, resources->vertex_declarations, 10);
-		sb_create(allocator, resources->free_vertex_declarations, 10);
-		Resource first_vd = render_resources_allocate_vertex_declaration_handle(resources);
-		assert(resource_handle(first_vd) == 0);
-		(void)first_vd;
-	}
-
-	{
-		sb_create(allocator, resources->vertex_shaders, 10);
-		sb_create(allocator, resources->free_vertex_shaders, 10);
-		Resource first_vs = render_resources_allocate_vertex_shader_handle(resources);
-		assert(resource_handle(first_vs) == 0);
-		(void)first_vs;
-	}
-
-	{
-		sb_create(allocator, resources->pixel_shaders, 10);
-		sb_create(allocator, resources->free_pixel_shaders, 10);
-		Resource first_ps = render_resources_allocate_pixel_shader_handle(resources);
-		assert(resource_handle(first_ps) == 0);
-		(void)first_ps;
-	}
-	{
-		sb_create(allocator, resources->input_layouts, 10);
-		sb_create(allocator, resources->input_layout_hashes, 10);
+	// Handle 0 of every type is taken, so no resource is mistaken for an uninitialized one.
+	for (unsigned type = RESOURCE_VERTEX_BUFFER; type < RENDER_RESOURCES_N_TYPES; ++type) {
+		slot_map_create(&resources->tables[type], allocator, render_resources_item_sizes[type]);
+		Resource first = render_resources_allocate_handle(resources, type);
+		assert(resource_handle(first) == 0);
+		(void)first;
 	}
+	sb_create_reserved(resources->input_layouts, RENDER_RESOURCES_MAX_INPUT_LAYOUTS);
+	sb_create(allocator, resources->input_layout_hashes, 10);
 }
 
 void render_resources_destroy(Allocator *allocator, RenderResources *resources)
 {
-	render_resources_release_vertex_buffer_handle(resources, resource_encode_handle_type(0, RESOURCE_VERTEX_BUFFER));
-	render_resources_release_vertex_declaration_handle(resources, resource_encode_handle_type(0, RESOURCE_VERTEX_DECLARATION));
-	render_resources_release_vertex_shader_handle(resources, resource_encode_handle_type(0, RESOURCE_VERTEX_SHADER));
-	render_resources_release_pixel_shader_handle(resources, resource_encode_handle_type(0, RESOURCE_PIXEL_SHADER));
+	for (unsigned type = RESOURCE_VERTEX_BUFFER; type < RENDER_RESOURCES_N_TYPES; ++type) {
+		render_resources_release_handle(resources, resource_encode_handle_type(0, type));
+		assert(slot_map_count(&resources->tables[type]) == 0);
+		slot_map_destroy(&resources->tables[type]);
+	}
 
 	const unsigned n_input_layouts = sb_count(resources->input_layouts);
 	for (unsigned i = 0; i < n_input_layouts; ++i) {
 		ID3D11InputLayout_Release(resources->input_layouts[i].input_layout);
 	}
 
-	sb_free(resources->vertex_buffers);
-	sb_free(resources->free_vertex_buffers);
-	sb_free(resources->index_buffers);
-	sb_free(resources->free_index_buffers);
-	sb_free(resources->raw_buffers);
-	sb_free(resources->free_raw_buffers);
-	sb_free(resources->vertex_declarations);
-	sb_free(resources->free_vertex_declarations);
-	sb_free(resources->vertex_shaders);
-	sb_free(resources->free_vertex_shaders);
-	sb_free(resources->pixel_shaders);
-	sb_free(resources->free_pixel_shaders);
 	sb_free(resources->input_layouts);
 	sb_free(resources->input_layout_hashes);
 
@@ -260,7 +104,7 @@ void render_resources_destroy(Allocator *allocator, RenderResources *resources)
 
 Buffer *render_resources_vertex_buffer(RenderResources *resources, Resource resource)
 {
-	return &resources->vertex_buffers[resource_handle(resource)];
+	return render_resources_get(resources, resource, RESOURCE_VERTEX_BUFFER);
 }
 
 Resource render_resources_create_vertex_buffer(RenderResources *resources, void *buffer, unsigned vertices, unsigned stride)
@@ -278,7 +122,7 @@ Resource render_resources_create_vertex_buffer(RenderResources *resources, void
 	sub_desc.SysMemSlicePitch = 0;
 	sub_desc.pSysMem = buffer;
 
-	Resource vb_res = render_resources_allocate_vertex_buffer_handle(resources);
+	Resource vb_res = render_resources_allocate_handle(resources, RESOURCE_VERTEX_BUFFER);
 
 	Buffer *vb = render_resources_vertex_buffer(resources, vb_res);
 	vb->stride = stride;
@@ -299,7 +143,7 @@ void render_resources_destroy_vertex_buffer(RenderResources *resources, Resource
 	ID3D11Buffer_Release(vb->buffer);
 	ID3D11Resource_Release(vb->resource);
 
-	render_resources_release_vertex_buffer_handle(resources, resource);
+	render_resources_release_handle(resources, resource);
 }
 
 void render_resource_vertex_buffer_update(RenderResources *resources, Resource resource, void *buffer, unsigned size)
@@ -322,7 +166,7 @@ void render_resource_vertex_buffer_update(RenderResources *resources, Resource r
 
 Buffer *render_resources_index_buffer(RenderResources *resources, Resource resource)
 {
-	return &resources->index_buffers[resource_handle(resource)];
+	return render_resources_get(resources, resource, RESOURCE_INDEX_BUFFER);
 }
 
 Resource render_resources_create_index_buffer(RenderResources *resources, void *buffer, unsigned indices, unsigned stride)
@@ -340,7 +184,7 @@ Resource render_resources_create_index_buffer(RenderResources *resources, void *
 	sub_desc.SysMemSlicePitch = 0;
 	sub_desc.pSysMem = buffer;
 
-	Resource ib_res = render_resources_allocate_index_buffer_handle(resources);
+	Resource ib_res = render_resources_allocate_handle(resources, RESOURCE_INDEX_BUFFER);
 
 	Buffer *vb = render_resources_index_buffer(resources, ib_res);
 	vb->stride = stride;
@@ -358,12 +202,12 @@ void render_resources_destroy_index_buffer(RenderResources *resources, Resource
 	Buffer *ib = render_resources_index_buffer(resources, resource);
 	ID3D11Buffer_Release(ib->buffer);
 
-	render_resources_release_index_buffer_handle(resources, resource);
+	render_resources_release_handle(resources, resource);
 }
 
 RawBuffer *render_resources_raw_buffer(RenderResources *resources, Resource resource)
 {
-	return &resources->raw_buffers[resource_handle(resource)];
+	return render_resources_get(resources, resource, RESOURCE_RAW_BUFFER);
 }
 
 Resource render_resources_create_raw_buffer(RenderResources *resources, void *buffer, unsigned size)
@@ -381,7 +225,7 @@ Resource render_resources_create_raw_buffer(RenderResources *resources, void *bu
 	sub_desc.SysMemSlicePitch = 0;
 	sub_desc.pSysMem = buffer;
 
-	Resource rb_res = render_resources_allocate_raw_buffer_handle(resources);
+	Resource rb_res = render_resources_allocate_handle(resources, RESOURCE_RAW_BUFFER);
 
 	RawBuffer *rb = render_resources_raw_buffer(resources, rb_res);
 	HRESULT hr = ID3D11Device_CreateBuffer(resources->d3d_device, &desc, buffer ? &sub_desc : 0, &rb->buffer);
@@ -409,7 +253,7 @@ void render_resources_destroy_raw_buffer(RenderResources *resources, Resource re
 	ID3D11Buffer_Release(rb->buffer);
 	ID3D11ShaderResourceView_Release(rb->srv);
 
-	render_resources_release_raw_buffer_handle(resources, resource);
+	render_resources_release_handle(resources, resource);
 }
 
 void render_resource_raw_buffer_update(RenderResources *resources, Resource resource, void *buffer, unsigned size)
@@ -432,12 +276,12 @@ void render_resource_raw_buffer_update(RenderResources *resources, Resource reso
 
 VertexDeclaration *render_resources_vertex_declaration(RenderResources *resources, Resource resource)
 {
-	return &resources->vertex_declarations[resource_handle(resource)];
+	return render_resources_get(resources, resource, RESOURCE_VERTEX_DECLARATION);
 }
 
 Resource render_resources_create_vertex_declaration(RenderResources *resources, VertexElement *vertex_elements, unsigned n_vertex_elements)
 {
-	Resource vd_res = render_resources_allocate_vertex_declaration_handle(resources);
+	Resource vd_res = render_resources_allocate_handle(resources, RESOURCE_VERTEX_DECLARATION);
 
 	VertexDeclaration *vd = render_resources_vertex_declaration(resources, vd_res);
 
@@ -478,17 +322,17 @@ void render_resources_destroy_vertex_declaration(RenderResources *resources, Res
 	VertexDeclaration *vd = render_resources_vertex_declaration(resources, resource);
 	sb_free(vd->elements);
 
-	render_resources_release_vertex_declaration_handle(resources, resource);
+	render_resources_release_handle(resources, resource);
 }
 
 VertexShader *render_resources_vertex_shader(RenderResources *resources, Resource resource)
 {
-	return &resources->vertex_shaders[resource_handle(resource)];
+	return render_resources_get(resources, resource, RESOURCE_VERTEX_SHADER);
 }
 
 PixelShader *render_resources_pixel_shader(RenderResources *resources, Resource resource)
 {
-	return &resources->pixel_shaders[resource_handle(resource)];
+	return render_resources_get(resources, resource, RESOURCE_PIXEL_SHADER);
 }
 
 Resource render_resources_create_shader_program(RenderResources *resources, unsigned shader_program_type, const char *program, unsigned program_length)
@@ -505,7 +349,7 @@ Resource render_resources_create_shader_program(RenderResources *resources, unsi
 	switch (shader_program_type) {
 	case SPT_VERTEX:
 	{
-		Resource shader = render_resources_allocate_vertex_shader_handle(resources);
+		Resource shader = render_resources_allocate_handle(resources, RESOURCE_VERTEX_SHADER);
 		VertexShader *vs = render_resources_vertex_shader(resources, shader);
 		vs->bytecode = shader_program;
 		hr = ID3D11Device_CreateVertexShader(resources->d3d_device, ID3D10Blob_GetBufferPointer(shader_program), ID3D10Blob_GetBufferSize(shader_program), NULL, &vs->shader);
@@ -515,7 +359,7 @@ Resource render_resources_create_shader_program(RenderResources *resources, unsi
 	break;
 	case SPT_PIXEL:
 	{
-		Resource shader = render_resources_allocate_pixel_shader_handle(resources);
+		Resource shader = render_resources_allocate_handle(resources, RESOURCE_PIXEL_SHADER);
 		PixelShader *ps = render_resources_pixel_shader(resources, shader);
 		hr = ID3D11Device_CreatePixelShader(resources->d3d_device, ID3D10Blob_GetBufferPointer(shader_program), ID3D10Blob_GetBufferSize(shader_program), NULL, &ps->shader);
 		assert(SUCCEEDED(hr));
@@ -539,14 +383,14 @@ void render_resources_destroy_shader_program(RenderResources *resources, Resourc
 	{
 		VertexShader *vs = render_resources_vertex_shader(resources, shader_program);
 		ID3D11VertexShader_Release(vs->shader);
-		render_resources_release_vertex_shader_handle(resources, shader_program);
+		render_resources_release_handle(resources, shader_program);
 	}
 	break;
 	case RESOURCE_PIXEL_SHADER:
 	{
 		PixelShader *ps = render_resources_pixel_shader(resources, shader_program);
 		ID3D11PixelShader_Release(ps->shader);
-		render_resources_release_pixel_shader_handle(resources, shader_program);
+		render_resources_release_handle(resources, shader_program);
 	}
 	break;
 	default:
@@ -584,7 +428,7 @@ InputLayout *render_resources_input_layout(RenderResources *resources, Resource
 
 RenderPackage *create_render_package(Allocator *allocator, const Resource *resources, unsigned n_resources, unsigned n_vertices, unsigned n_indices)
 {
-	RenderPackage *package = (RenderPackage*)allocator_realloc(allocator, NULL, sizeof(RenderPackage) + sizeof(Resource) * n_resources, 16);
+	RenderPackage *package = (RenderPackage*)allocator_realloc_tagged(allocator, NULL, sizeof(RenderPackage) + sizeof(Resource) * n_resources, 16, render_resources_tag());
 	package->allocator = allocator;
 	package->n_resources = n_resources;
 	package->resources = (Resource*)((uintptr_t)package + sizeof(RenderPackage));
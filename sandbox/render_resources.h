@@ -24,23 +24,23 @@ typedef struct Resource
 
 enum ResourceTypes { RESOURCE_NOT_INITIALIZED = 0, RESOURCE_VERTEX_BUFFER, RESOURCE_INDEX_BUFFER, RESOURCE_VERTEX_DECLARATION, RESOURCE_VERTEX_SHADER, RESOURCE_PIXEL_SHADER, RESOURCE_RAW_BUFFER };
 
-inline unsigned resource_type(Resource resource)
+static inline unsigned resource_type(Resource resource)
 {
 	return (resource.handle & 0xFF000000U) >> 24U;
 }
 
-inline unsigned resource_handle(Resource resource)
+static inline unsigned resource_handle(Resource resource)
 {
 	return resource.handle & 0x00FFFFFFU;
 }
 
-inline Resource resource_encode_handle_type(unsigned handle, unsigned type)
+static inline Resource resource_encode_handle_type(unsigned handle, unsigned type)
 {
 	Resource resource = { .handle = (handle & 0x00FFFFFFU) | ((type & 0xFFU) << 24U) };
 	return resource;
 }
 
-inline int resource_is_valid(Resource resource)
+static inline int resource_is_valid(Resource resource)
 {
 	return resource_handle(resource) != RESOURCE_NOT_INITIALIZED;
 }
@@ -0,0 +1,209 @@
+#include "slab.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+enum { SLAB_PAGE_SIZE = 16 * 1024 };
+enum { SLAB_NO_CLASS = 0xFFFF };
+
+static const unsigned slab_class_sizes[SLAB_N_CLASSES] = {
+	16, 32, 48, 64, 80, 96, 112, 128,
+	160, 192, 224, 256, 320, 384, 448, 512,
+	640, 768, 896, 1024,
+};
+
+// Smallest class for every multiple of 16 bytes.
+static const uint8_t slab_class_for_size[SLAB_MAX_SIZE / 16 + 1] = {
+	0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 8, 9, 9, 10, 10, 11,
+	11, 12, 12, 12, 12, 13, 13, 13, 13, 14, 14, 14, 14, 15, 15, 15,
+	15, 16, 16, 16, 16, 16, 16, 16, 16, 17, 17, 17, 17, 17, 17, 17,
+	17, 18, 18, 18, 18, 18, 18, 18, 18, 19, 19, 19, 19, 19, 19, 19,
+	19,
+};
+
+typedef struct SlabPage
+{
+	void *free_list;
+	// Slots from here to the end of the page have never been handed out.
+	unsigned bump;
+	unsigned n_used;
+	unsigned size_class;
+	unsigned tag;
+	// In the partial list of its class and tag while it has a free slot, in the free page list when it's empty.
+	struct SlabPage *next;
+	struct SlabPage *prev;
+} SlabPage;
+
+struct Slab
+{
+	char *page_memory;
+	SlabPage *pages;
+	unsigned n_pages;
+	unsigned n_used_pages;
+	SlabPage *free_pages;
+	SlabPage *partial_pages[SLAB_N_TAGS][SLAB_N_CLASSES];
+};
+
+static unsigned slab_page_capacity(SlabPage *page)
+{
+	return SLAB_PAGE_SIZE / slab_class_sizes[page->size_class];
+}
+
+static char *slab_page_memory(Slab *slab, SlabPage *page)
+{
+	return slab->page_memory + (size_t)(page - slab->pages) * SLAB_PAGE_SIZE;
+}
+
+static void slab_list_push(SlabPage **list, SlabPage *page)
+{
+	page->prev = NULL;
+	page->next = *list;
+	if (*list)
+		(*list)->prev = page;
+	*list = page;
+}
+
+static void slab_list_remove(SlabPage **list, SlabPage *page)
+{
+	if (page->prev)
+		page->prev->next = page->next;
+	else
+		*list = page->next;
+	if (page->next)
+		page->next->prev = page->prev;
+}
+
+Slab *slab_create(void *memory, unsigned size)
+{
+	assert(size >= sizeof(Slab));
+	Slab *slab = memory;
+	memset(slab, 0, sizeof(Slab));
+
+	// Page table entries and pages come in pairs, plus room to align the first page to 64.
+	const uintptr_t table = ((uintptr_t)memory + sizeof(Slab) + 15) & ~(uintptr_t)15;
+	const uintptr_t end = (uintptr_t)memory + size;
+	const uintptr_t available = end > table + 64 ? end - table - 64 : 0;
+	slab->n_pages = (unsigned)(available / (SLAB_PAGE_SIZE + sizeof(SlabPage)));
+	slab->pages = (SlabPage *)table;
+	slab->page_memory = (char *)(((uintptr_t)(slab->pages + slab->n_pages) + 63) & ~(uintptr_t)63);
+
+	for (unsigned i = slab->n_pages; i-- > 0;) {
+		SlabPage *page = &slab->pages[i];
+		page->size_class = SLAB_NO_CLASS;
+		slab_list_push(&slab->free_pages, page);
+	}
+	return slab;
+}
+
+unsigned slab_size_class(unsigned size, unsigned alignment)
+{
+	if (size > SLAB_MAX_SIZE || alignment > 64)
+		return SLAB_N_CLASSES;
+	unsigned size_class = slab_class_for_size[(size + 15) / 16];
+	// Pages are 64 byte aligned, a class is aligned to the largest power of two its size is a multiple of.
+	while (alignment > 16 && size_class < SLAB_N_CLASSES && slab_class_sizes[size_class] % alignment)
+		size_class++;
+	return size_class;
+}
+
+unsigned slab_class_size(unsigned size_class)
+{
+	return slab_class_sizes[size_class];
+}
+
+void *slab_alloc(Slab *slab, unsigned size, unsigned alignment, unsigned tag)
+{
+	assert(tag < SLAB_N_TAGS);
+	const unsigned size_class = slab_size_class(size, alignment);
+	if (size_class == SLAB_N_CLASSES)
+		return NULL;
+
+	SlabPage **partial = &slab->partial_pages[tag][size_class];
+	SlabPage *page = *partial;
+	if (!page) {
+		page = slab->free_pages;
+		if (!page)
+			return NULL;
+		slab_list_remove(&slab->free_pages, page);
+		page->free_list = NULL;
+		page->bump = 0;
+		page->n_used = 0;
+		page->size_class = size_class;
+		page->tag = tag;
+		slab_list_push(partial, page);
+		slab->n_used_pages++;
+	}
+
+	void *p;
+	if (page->free_list) {
+		p = page->free_list;
+		page->free_list = *(void **)p;
+	} else {
+		p = slab_page_memory(slab, page) + page->bump * slab_class_sizes[size_class];
+		page->bump++;
+	}
+	page->n_used++;
+
+	if (!page->free_list && page->bump == slab_page_capacity(page))
+		slab_list_remove(partial, page);
+	return p;
+}
+
+int slab_owns(Slab *slab, void *p)
+{
+	return (char *)p >= slab->page_memory && (char *)p < slab->page_memory + (size_t)slab->n_pages * SLAB_PAGE_SIZE;
+}
+
+static SlabPage *slab_page(Slab *slab, void *p)
+{
+	assert(slab_owns(slab, p));
+	return &slab->pages[((char *)p - slab->page_memory) / SLAB_PAGE_SIZE];
+}
+
+void slab_free(Slab *slab, void *p)
+{
+	SlabPage *page = slab_page(slab, p);
+	assert(page->size_class != SLAB_NO_CLASS && page->n_used);
+	SlabPage **partial = &slab->partial_pages[page->tag][page->size_class];
+	if (page->n_used == slab_page_capacity(page))
+		slab_list_push(partial, page);
+
+	*(void **)p = page->free_list;
+	page->free_list = p;
+	page->n_used--;
+
+	if (!page->n_used) {
+		slab_list_remove(partial, page);
+		page->size_class = SLAB_NO_CLASS;
+		slab_list_push(&slab->free_pages, page);
+		slab->n_used_pages--;
+	}
+}
+
+unsigned slab_size(Slab *slab, void *p)
+{
+	return slab_class_sizes[slab_page(slab, p)->size_class];
+}
+
+unsigned slab_lookup(Slab *slab, void *p, unsigned *tag)
+{
+	if (!slab_owns(slab, p))
+		return SLAB_N_CLASSES;
+	SlabPage *page = slab_page(slab, p);
+	*tag = page->tag;
+	return page->size_class;
+}
+
+void slab_stats(Slab *slab, SlabStats *stats)
+{
+	memset(stats, 0, sizeof(SlabStats));
+	stats->n_pages = slab->n_pages;
+	stats->n_used_pages = slab->n_used_pages;
+	stats->page_bytes = (unsigned long long)slab->n_used_pages * SLAB_PAGE_SIZE;
+	for (unsigned i = 0; i < slab->n_pages; ++i) {
+		SlabPage *page = &slab->pages[i];
+		if (page->size_class != SLAB_NO_CLASS)
+			stats->used_bytes += (unsigned long long)page->n_used * slab_class_sizes[page->size_class];
+	}
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+// Size class allocator for small fixed size objects. The memory is cut into 16KB pages and each page in use holds
+// objects of one of 20 size classes between 16 bytes and 1KB and of one of 32 tags, handed out from a free list or
+// bumped off the never used end of the page. Pages that empty go back to be reused by any class and tag. Not thread
+// safe.
+typedef struct Slab Slab;
+
+enum { SLAB_MAX_SIZE = 1024 };
+enum { SLAB_N_CLASSES = 20 };
+enum { SLAB_N_TAGS = 32 };
+
+// The smallest class that fits size with the alignment, SLAB_N_CLASSES if none does.
+unsigned slab_size_class(unsigned size, unsigned alignment);
+unsigned slab_class_size(unsigned size_class);
+
+// The page table is placed at the start of memory, the pages after it.
+Slab *slab_create(void *memory, unsigned size);
+
+// Returns NULL for sizes over SLAB_MAX_SIZE, alignments over 64 or when all pages are in use.
+void *slab_alloc(Slab *slab, unsigned size, unsigned alignment, unsigned tag);
+void slab_free(Slab *slab, void *p);
+int slab_owns(Slab *slab, void *p);
+// Size of the class the allocation came from.
+unsigned slab_size(Slab *slab, void *p);
+// Size class of the allocation and tag of its page, SLAB_N_CLASSES if the slab doesn't own it. One lookup for what
+// slab_owns and slab_size tell and the tag.
+unsigned slab_lookup(Slab *slab, void *p, unsigned *tag);
+
+typedef struct SlabStats
+{
+	unsigned n_pages;
+	unsigned n_used_pages;
+	// Bytes of objects handed out, by class size, against the bytes of the pages they are in.
+	unsigned long long used_bytes;
+	unsigned long long page_bytes;
+} SlabStats;
+
+void slab_stats(Slab *slab, SlabStats *stats);
@@ -0,0 +1,99 @@
+#include "slot_map.h"
+#include "stretchy_buffer.h"
+
+#include <string.h>
+#include <assert.h>
+
+enum { SLOT_MAP_SLOT_BITS = 16 };
+enum { SLOT_MAP_NO_SLOT = 0xFFFFFFFFU, SLOT_MAP_IN_USE = 0xFFFFFFFEU };
+
+struct SlotMapSlot
+{
+	// SLOT_MAP_IN_USE while the slot holds an item, the next free slot while it's free.
+	unsigned next_free;
+	// Only 0 on the first use of a slot, so handle 0 of slot 0 is never handed out again once it's erased.
+	unsigned generation;
+};
+
+static unsigned slot_map_handle(unsigned slot, unsigned generation)
+{
+	return (generation << SLOT_MAP_SLOT_BITS) | slot;
+}
+
+void slot_map_create(SlotMap *map, Allocator *allocator, unsigned item_size)
+{
+	sb_create_reserved(map->items, SLOT_MAP_MAX_ITEMS * item_size);
+	sb_create(allocator, map->slots, 16);
+	map->free_slot = SLOT_MAP_NO_SLOT;
+	map->count = 0;
+	map->item_size = item_size;
+}
+
+void slot_map_destroy(SlotMap *map)
+{
+	sb_free(map->items);
+	sb_free(map->slots);
+}
+
+unsigned slot_map_insert(SlotMap *map, const void *item)
+{
+	unsigned slot = map->free_slot;
+	if (slot != SLOT_MAP_NO_SLOT) {
+		map->free_slot = map->slots[slot].next_free;
+		map->slots[slot].next_free = SLOT_MAP_IN_USE;
+	} else {
+		slot = sb_count(map->slots);
+		assert(slot < SLOT_MAP_MAX_ITEMS);
+		SlotMapSlot new_slot = { .next_free = SLOT_MAP_IN_USE, .generation = 0 };
+		sb_push(map->slots, new_slot);
+		(void)sb_add(map->items, map->item_size);
+	}
+	map->count++;
+
+	char *dst = map->items + slot * map->item_size;
+	if (item)
+		memcpy(dst, item, map->item_size);
+	else
+		memset(dst, 0, map->item_size);
+	return slot_map_handle(slot, map->slots[slot].generation);
+}
+
+// The slot the handle's item is in, SLOT_MAP_NO_SLOT if the handle doesn't resolve.
+static unsigned slot_map_slot(SlotMap *map, unsigned handle)
+{
+	const unsigned slot = handle & (SLOT_MAP_MAX_ITEMS - 1);
+	if (slot >= sb_count(map->slots))
+		return SLOT_MAP_NO_SLOT;
+	const SlotMapSlot *entry = &map->slots[slot];
+	return entry->next_free == SLOT_MAP_IN_USE && slot_map_handle(slot, entry->generation) == handle ? slot : SLOT_MAP_NO_SLOT;
+}
+
+int slot_map_contains(SlotMap *map, unsigned handle)
+{
+	return slot_map_slot(map, handle) != SLOT_MAP_NO_SLOT;
+}
+
+int slot_map_erase(SlotMap *map, unsigned handle)
+{
+	// Freeing the slot again would put it on the free list twice and hand it out to two inserts.
+	const unsigned slot = slot_map_slot(map, handle);
+	if (slot == SLOT_MAP_NO_SLOT)
+		return 0;
+	SlotMapSlot *freed = &map->slots[slot];
+	freed->generation = freed->generation == 0xFF ? 1 : freed->generation + 1;
+	freed->next_free = map->free_slot;
+	map->free_slot = slot;
+	map->count--;
+	return 1;
+}
+
+void *slot_map_get(SlotMap *map, unsigned handle)
+{
+	const unsigned slot = slot_map_slot(map, handle);
+	return slot != SLOT_MAP_NO_SLOT ? map->items + slot * map->item_size : NULL;
+}
+
+unsigned slot_map_count(SlotMap *map)
+{
+	return map->count;
+}
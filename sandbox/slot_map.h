@@ -0,0 +1,36 @@
+#pragma once
+
+typedef struct Allocator Allocator;
+
+// Items stay in their slot from insert to erase, handles find them through the slot index and a generation bumped
+// whenever the slot is freed, so a handle to an erased item no longer resolves even if the slot is reused. Handles fit
+// the 24 bits of a Resource: the slot in the low 16, the generation in the high 8. A slot has to be reused 255 times
+// before an old handle to it matches again. Not thread safe.
+enum { SLOT_MAP_MAX_ITEMS = 1 << 16 };
+
+typedef struct SlotMapSlot SlotMapSlot;
+
+typedef struct SlotMap
+{
+	// item_size bytes per slot, reserved for SLOT_MAP_MAX_ITEMS so adding slots never moves the items.
+	char *items;
+	SlotMapSlot *slots;
+	unsigned free_slot;
+	unsigned count;
+	unsigned item_size;
+} SlotMap;
+
+void slot_map_create(SlotMap *map, Allocator *allocator, unsigned item_size);
+void slot_map_destroy(SlotMap *map);
+
+// Copies item in, or zeroes the new item if it's NULL. O(1), reuses the most recently freed slot.
+unsigned slot_map_insert(SlotMap *map, const void *item);
+// O(1), no other item moves. Returns 0 and leaves the map alone for handles slot_map_contains refuses, erased ones
+// included, in every build.
+int slot_map_erase(SlotMap *map, unsigned handle);
+int slot_map_contains(SlotMap *map, unsigned handle);
+// NULL for handles slot_map_contains refuses, in every build. The pointer is good until the item is erased.
+void *slot_map_get(SlotMap *map, unsigned handle);
+
+// Items inserted and not erased.
+unsigned slot_map_count(SlotMap *map);
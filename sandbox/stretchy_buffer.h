@@ -1,11 +1,18 @@
 #pragma once
 
 #include "allocator.h"
+#include "platform.h"
+
+#include <stdint.h>
+#include <assert.h>
 
 // Heavily inspired by https://github.com/nothings/stb/blob/master/stretchy_buffer.h
 
-#define sb_create(alloc, a, n)	( (a) = __sbcreatef(alloc, n, sizeof(*(a))))
-#define sb_free(a)			((a) ? (a) = allocator_realloc(sb_allocator(a), __sbraw(a), 0, 0) : 0)
+#define sb_create(alloc, a, n)	( (a) = __sbcreatef(alloc, n, sizeof(*(a)), ALLOCATOR_CALLSITE))
+// Reserves address space for max_n items and commits pages as the buffer grows, so items never move and growing
+// doesn't copy. Pushing past max_n aborts. sb_allocator is NULL for these.
+#define sb_create_reserved(a, max_n)	( (a) = __sbcreatereservedf(max_n, sizeof(*(a))))
+#define sb_free(a)			((a) ? (a) = __sbfreef(__sbraw(a)) : 0)
 
 #define sb_push(a,v)		(__sbmaybegrow(a,1), (a)[__sbn(a)++] = (v))
 #define sb_count(a)			((a) ? (unsigned)__sbn(a) : 0)
@@ -16,7 +23,7 @@
 
 #define sb_allocator(a)		( __sba(a) )
 
-#define __sbraw(a) ((unsigned __int64 *) (a) - 3)
+#define __sbraw(a) ((uint64_t *) (a) - 3)
 #define __sba(a)   (Allocator *)__sbraw(a)[0]
 #define __sbm(a)   __sbraw(a)[1]
 #define __sbn(a)   __sbraw(a)[2]
@@ -25,11 +32,25 @@
 #define __sbmaybegrow(a,n) (__sbneedgrow(a,(n)) ? __sbgrow(a,n) : 0)
 #define __sbgrow(a,n)      ((a) = __sbgrowf((a), (n), sizeof(*(a))))
 
+// Reserved buffers keep the size of the reserve in front of the usual header, which then starts 8 bytes into the
+// reserve so items are 16 byte aligned.
+#define __sbreserved(a)    __sbraw(a)[-1]
+enum { SB_RESERVED_MIN_COMMIT = 64 * 1024 };
+
 #include <stdlib.h>
 
-static void *__sbcreatef(Allocator *allocator, unsigned initial_capacity, int item_size)
+// Stretchy buffers are counted under their own tag and the file and line that created them.
+static inline unsigned __sbtag(void)
+{
+	static unsigned tag;
+	if (!tag)
+		tag = allocator_tag("sb");
+	return tag;
+}
+
+static inline void *__sbcreatef(Allocator *allocator, unsigned initial_capacity, int item_size, const char *file, unsigned line)
 {
-	unsigned __int64 *p = (unsigned __int64*)allocator_realloc(allocator, NULL, item_size * initial_capacity + sizeof(unsigned __int64*) * 3, 16);
+	uint64_t *p = (uint64_t*)allocator_realloc_at(allocator, NULL, item_size * initial_capacity + sizeof(uint64_t*) * 3, 16, __sbtag(), file, line);
 
 	p[0] = (uintptr_t)allocator;
 	p[1] = initial_capacity;
@@ -38,13 +59,60 @@ static void *__sbcreatef(Allocator *allocator, unsigned initial_capacity, int it
 	return p + 3;
 }
 
-static void *__sbgrowf(void *arr, int increment, int item_size)
+static inline void *__sbcreatereservedf(unsigned max_count, int item_size)
+{
+	const size_t reserved = sizeof(uint64_t) * 4 + (size_t)item_size * max_count;
+	const size_t committed = reserved < SB_RESERVED_MIN_COMMIT ? reserved : SB_RESERVED_MIN_COMMIT;
+	uint64_t *p = (uint64_t *)platform_vm_reserve(reserved);
+	platform_vm_commit(p, committed);
+
+	p[0] = reserved;
+	p[1] = 0;
+	p[2] = (committed - sizeof(uint64_t) * 4) / item_size;
+	p[3] = 0;
+
+	return p + 4;
+}
+
+static inline void *__sbfreef(uint64_t *raw)
+{
+	Allocator *alloc = (Allocator *)raw[0];
+	if (alloc)
+		return allocator_realloc(alloc, raw, 0, 0);
+	platform_vm_release(raw - 1, raw[-1]);
+	return NULL;
+}
+
+// Doubles what is committed, or commits what was asked for if that is more, so there are as few commits as there would
+// be reallocations but nothing is copied. Pages are only backed by memory once they are written.
+static inline void *__sbgrowreservedf(void *arr, int increment, int item_size)
+{
+	const size_t header = sizeof(uint64_t) * 4;
+	const size_t committed = header + (size_t)item_size * __sbm(arr);
+	const size_t needed = header + (size_t)item_size * (sb_count(arr) + increment);
+	size_t size = committed * 2 > needed ? committed * 2 : needed;
+	const size_t reserved = __sbreserved(arr);
+	if (size > reserved)
+		size = reserved;
+	// Pushed past the reserve, there is nothing mapped to grow into.
+	if (needed > size)
+		abort();
+
+	char *base = (char *)arr - header;
+	platform_vm_commit(base + committed, size - committed);
+	__sbm(arr) = (size - header) / item_size;
+	return arr;
+}
+
+static inline void *__sbgrowf(void *arr, int increment, int item_size)
 {
+	if (!sb_allocator(arr))
+		return __sbgrowreservedf(arr, increment, item_size);
 	int dbl_cur = 2 * (int)__sbm(arr);
 	int min_needed = (int)sb_count(arr) + increment;
 	int m = dbl_cur > min_needed ? dbl_cur : min_needed;
 	Allocator *alloc = sb_allocator(arr);
-	unsigned __int64 *p = (unsigned __int64 *)allocator_realloc(alloc, __sbraw(arr), item_size * m + sizeof(unsigned __int64*) * 3, 16);
+	uint64_t *p = (uint64_t *)allocator_realloc(alloc, __sbraw(arr), item_size * m + sizeof(uint64_t*) * 3, 16);
 	if (p) {
 		p[1] = m;
 		return p + 3;
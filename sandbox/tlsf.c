@@ -0,0 +1,378 @@
+#include "tlsf.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#if defined(_WIN32)
+#include <intrin.h>
+#endif
+
+enum
+{
+	TLSF_ALIGN_LOG2 = 4,
+	TLSF_ALIGN = 1 << TLSF_ALIGN_LOG2,
+	TLSF_SL_COUNT_LOG2 = 5,
+	TLSF_SL_COUNT = 1 << TLSF_SL_COUNT_LOG2,
+	// Blocks below this are all in first level 0, split linearly in steps of TLSF_ALIGN.
+	TLSF_FL_SHIFT = TLSF_SL_COUNT_LOG2 + TLSF_ALIGN_LOG2,
+	TLSF_SMALL_BLOCK = 1 << TLSF_FL_SHIFT,
+	// Blocks are smaller than 4GB, pools are sized by the Allocator API's unsigned.
+	TLSF_FL_MAX = 32,
+	TLSF_FL_COUNT = TLSF_FL_MAX - TLSF_FL_SHIFT + 1,
+};
+
+enum { TLSF_BLOCK_FREE = 1 };
+
+// The header is the first 16 bytes, next_free and prev_free are only valid in free blocks where they overlap the
+// payload on 64 bit. prev_phys is always valid so merging never needs boundary tags.
+typedef struct TlsfBlock
+{
+	struct TlsfBlock *prev_phys;
+	size_t size;
+	struct TlsfBlock *next_free;
+	struct TlsfBlock *prev_free;
+} TlsfBlock;
+
+enum { TLSF_HEADER = 16 };
+enum { TLSF_MIN_PAYLOAD = 16 };
+
+// At the start of every pool, followed by its blocks and a zero sized used block that stops merging at the end.
+typedef struct TlsfPool
+{
+	struct TlsfPool *next;
+	size_t size;
+} TlsfPool;
+
+struct Tlsf
+{
+	unsigned fl_bitmap;
+	unsigned sl_bitmap[TLSF_FL_COUNT];
+	TlsfBlock *free_blocks[TLSF_FL_COUNT][TLSF_SL_COUNT];
+	TlsfPool *pools;
+};
+
+static int tlsf_fls(size_t x)
+{
+#if defined(_WIN64)
+	unsigned long index;
+	_BitScanReverse64(&index, x);
+	return (int)index;
+#elif defined(_WIN32)
+	unsigned long index;
+	_BitScanReverse(&index, (unsigned long)x);
+	return (int)index;
+#else
+	return (int)(sizeof(unsigned long long) * 8 - 1) - __builtin_clzll((unsigned long long)x);
+#endif
+}
+
+static int tlsf_ffs(unsigned x)
+{
+#if defined(_WIN32)
+	unsigned long index;
+	_BitScanForward(&index, x);
+	return (int)index;
+#else
+	return __builtin_ctz(x);
+#endif
+}
+
+static size_t tlsf_align_up(size_t x, size_t alignment)
+{
+	return (x + alignment - 1) & ~(alignment - 1);
+}
+
+static size_t block_size(TlsfBlock *block)
+{
+	return block->size & ~(size_t)(TLSF_ALIGN - 1);
+}
+
+static int block_is_free(TlsfBlock *block)
+{
+	return (int)(block->size & TLSF_BLOCK_FREE);
+}
+
+static void *block_payload(TlsfBlock *block)
+{
+	return (char *)block + TLSF_HEADER;
+}
+
+static TlsfBlock *block_from_payload(void *p)
+{
+	return (TlsfBlock *)((char *)p - TLSF_HEADER);
+}
+
+static TlsfBlock *block_next(TlsfBlock *block)
+{
+	return (TlsfBlock *)((char *)block_payload(block) + block_size(block));
+}
+
+static void mapping_insert(size_t size, int *fl, int *sl)
+{
+	if (size < TLSF_SMALL_BLOCK) {
+		*fl = 0;
+		*sl = (int)(size / (TLSF_SMALL_BLOCK / TLSF_SL_COUNT));
+	} else {
+		const int f = tlsf_fls(size);
+		*sl = (int)(size >> (f - TLSF_SL_COUNT_LOG2)) ^ TLSF_SL_COUNT;
+		*fl = f - (TLSF_FL_SHIFT - 1);
+	}
+}
+
+// Rounds up to the next list boundary so any block in the list found is big enough.
+static void mapping_search(size_t size, int *fl, int *sl)
+{
+	if (size >= TLSF_SMALL_BLOCK)
+		size += ((size_t)1 << (tlsf_fls(size) - TLSF_SL_COUNT_LOG2)) - 1;
+	mapping_insert(size, fl, sl);
+}
+
+static void insert_free_block(Tlsf *tlsf, TlsfBlock *block)
+{
+	int fl, sl;
+	mapping_insert(block_size(block), &fl, &sl);
+	TlsfBlock *head = tlsf->free_blocks[fl][sl];
+	block->next_free = head;
+	block->prev_free = NULL;
+	if (head)
+		head->prev_free = block;
+	tlsf->free_blocks[fl][sl] = block;
+	tlsf->fl_bitmap |= 1u << fl;
+	tlsf->sl_bitmap[fl] |= 1u << sl;
+}
+
+static void remove_free_block(Tlsf *tlsf, TlsfBlock *block)
+{
+	int fl, sl;
+	mapping_insert(block_size(block), &fl, &sl);
+	if (block->prev_free)
+		block->prev_free->next_free = block->next_free;
+	else
+		tlsf->free_blocks[fl][sl] = block->next_free;
+	if (block->next_free)
+		block->next_free->prev_free = block->prev_free;
+
+	if (!tlsf->free_blocks[fl][sl]) {
+		tlsf->sl_bitmap[fl] &= ~(1u << sl);
+		if (!tlsf->sl_bitmap[fl])
+			tlsf->fl_bitmap &= ~(1u << fl);
+	}
+}
+
+static TlsfBlock *search_free_block(Tlsf *tlsf, size_t size)
+{
+	int fl, sl;
+	mapping_search(size, &fl, &sl);
+	if (fl >= TLSF_FL_COUNT)
+		return NULL;
+
+	unsigned sl_map = tlsf->sl_bitmap[fl] & (~0u << sl);
+	if (!sl_map) {
+		const unsigned fl_map = tlsf->fl_bitmap & (~0u << (fl + 1));
+		if (!fl_map)
+			return NULL;
+		fl = tlsf_ffs(fl_map);
+		sl_map = tlsf->sl_bitmap[fl];
+	}
+	sl = tlsf_ffs(sl_map);
+	return tlsf->free_blocks[fl][sl];
+}
+
+// Free blocks are never next to each other, merging keeps it that way.
+static TlsfBlock *merge_free_neighbours(Tlsf *tlsf, TlsfBlock *block)
+{
+	TlsfBlock *prev = block->prev_phys;
+	if (prev && block_is_free(prev)) {
+		remove_free_block(tlsf, prev);
+		prev->size += TLSF_HEADER + block_size(block);
+		block = prev;
+		block_next(block)->prev_phys = block;
+	}
+	TlsfBlock *next = block_next(block);
+	if (block_is_free(next)) {
+		remove_free_block(tlsf, next);
+		block->size += TLSF_HEADER + block_size(next);
+		block_next(block)->prev_phys = block;
+	}
+	return block;
+}
+
+// Splits off whatever is past size in a used block and frees it.
+static void trim_used_block(Tlsf *tlsf, TlsfBlock *block, size_t size)
+{
+	const size_t current = block_size(block);
+	if (current < size + TLSF_HEADER + TLSF_MIN_PAYLOAD)
+		return;
+
+	TlsfBlock *remainder = (TlsfBlock *)((char *)block_payload(block) + size);
+	remainder->prev_phys = block;
+	remainder->size = (current - size - TLSF_HEADER) | TLSF_BLOCK_FREE;
+	block->size = size;
+	block_next(remainder)->prev_phys = remainder;
+	insert_free_block(tlsf, merge_free_neighbours(tlsf, remainder));
+}
+
+static size_t adjust_size(size_t size)
+{
+	return size < TLSF_MIN_PAYLOAD ? TLSF_MIN_PAYLOAD : tlsf_align_up(size, TLSF_ALIGN);
+}
+
+size_t tlsf_overhead(void)
+{
+	return tlsf_align_up(sizeof(Tlsf), TLSF_ALIGN);
+}
+
+Tlsf *tlsf_create(void *memory, size_t size)
+{
+	assert(((uintptr_t)memory & (TLSF_ALIGN - 1)) == 0);
+	assert(size >= tlsf_overhead());
+	Tlsf *tlsf = memory;
+	memset(tlsf, 0, sizeof(Tlsf));
+
+	const size_t overhead = tlsf_overhead();
+	if (size > overhead)
+		tlsf_add_pool(tlsf, (char *)memory + overhead, size - overhead);
+	return tlsf;
+}
+
+void tlsf_add_pool(Tlsf *tlsf, void *memory, size_t size)
+{
+	const uintptr_t start = tlsf_align_up((uintptr_t)memory, TLSF_ALIGN);
+	const uintptr_t end = ((uintptr_t)memory + size) & ~(uintptr_t)(TLSF_ALIGN - 1);
+	// Pool header, one block with the smallest payload and the end block.
+	if (end <= start || end - start < sizeof(TlsfPool) + 2 * TLSF_HEADER + TLSF_MIN_PAYLOAD)
+		return;
+
+	TlsfPool *pool = (TlsfPool *)start;
+	pool->size = end - start;
+	pool->next = tlsf->pools;
+	tlsf->pools = pool;
+
+	TlsfBlock *block = (TlsfBlock *)(start + tlsf_align_up(sizeof(TlsfPool), TLSF_ALIGN));
+	size_t payload = end - (uintptr_t)block - 2 * TLSF_HEADER;
+	// Keep blocks under the largest size class.
+	if ((uint64_t)payload >= ((uint64_t)1 << TLSF_FL_MAX))
+		payload = (size_t)(((uint64_t)1 << TLSF_FL_MAX) - TLSF_ALIGN);
+	block->prev_phys = NULL;
+	block->size = payload | TLSF_BLOCK_FREE;
+
+	TlsfBlock *end_block = block_next(block);
+	end_block->prev_phys = block;
+	end_block->size = 0;
+	insert_free_block(tlsf, block);
+}
+
+void *tlsf_malloc(Tlsf *tlsf, size_t size, size_t alignment)
+{
+	if (alignment < TLSF_ALIGN)
+		alignment = TLSF_ALIGN;
+	assert((alignment & (alignment - 1)) == 0);
+	if ((uint64_t)size + alignment + TLSF_HEADER + TLSF_MIN_PAYLOAD >= ((uint64_t)1 << TLSF_FL_MAX))
+		return NULL;
+	const size_t adjusted = adjust_size(size);
+
+	// Over aligned blocks need room to split a free block off the front, which has a header and a payload of its own.
+	const size_t gap_minimum = TLSF_HEADER + TLSF_MIN_PAYLOAD;
+	const size_t search_size = alignment > TLSF_ALIGN ? adjusted + alignment + gap_minimum : adjusted;
+	TlsfBlock *block = search_free_block(tlsf, search_size);
+	if (!block)
+		return NULL;
+	remove_free_block(tlsf, block);
+	block->size &= ~(size_t)TLSF_BLOCK_FREE;
+
+	if (alignment > TLSF_ALIGN) {
+		const uintptr_t payload = (uintptr_t)block_payload(block);
+		uintptr_t aligned = tlsf_align_up(payload, alignment);
+		if (aligned != payload && aligned - payload < gap_minimum)
+			aligned = tlsf_align_up(payload + gap_minimum, alignment);
+
+		if (aligned != payload) {
+			// The front becomes a free block. Its neighbour before it is used, the one it was split from was free.
+			const size_t gap = aligned - payload;
+			TlsfBlock *aligned_block = block_from_payload((void *)aligned);
+			aligned_block->prev_phys = block;
+			aligned_block->size = block_size(block) - gap;
+			block_next(aligned_block)->prev_phys = aligned_block;
+			block->size = (gap - TLSF_HEADER) | TLSF_BLOCK_FREE;
+			insert_free_block(tlsf, block);
+			block = aligned_block;
+		}
+	}
+
+	trim_used_block(tlsf, block, adjusted);
+	return block_payload(block);
+}
+
+void tlsf_free(Tlsf *tlsf, void *p)
+{
+	if (!p)
+		return;
+	TlsfBlock *block = block_from_payload(p);
+	assert(!block_is_free(block));
+	block->size |= TLSF_BLOCK_FREE;
+	insert_free_block(tlsf, merge_free_neighbours(tlsf, block));
+}
+
+void *tlsf_realloc(Tlsf *tlsf, void *p, size_t size, size_t alignment)
+{
+	if (!p)
+		return tlsf_malloc(tlsf, size, alignment);
+	if (!size) {
+		tlsf_free(tlsf, p);
+		return NULL;
+	}
+
+	TlsfBlock *block = block_from_payload(p);
+	const size_t current = block_size(block);
+	const size_t adjusted = adjust_size(size);
+	if (((uintptr_t)p & ((alignment ? alignment : TLSF_ALIGN) - 1)) == 0) {
+		TlsfBlock *next = block_next(block);
+		if (adjusted > current && block_is_free(next) && current + TLSF_HEADER + block_size(next) >= adjusted) {
+			remove_free_block(tlsf, next);
+			block->size += TLSF_HEADER + block_size(next);
+			block_next(block)->prev_phys = block;
+		}
+		if (adjusted <= block_size(block)) {
+			trim_used_block(tlsf, block, adjusted);
+			return p;
+		}
+	}
+
+	void *q = tlsf_malloc(tlsf, size, alignment);
+	if (q) {
+		memcpy(q, p, current < size ? current : size);
+		tlsf_free(tlsf, p);
+	}
+	return q;
+}
+
+size_t tlsf_block_size(void *p)
+{
+	return block_size(block_from_payload(p));
+}
+
+void tlsf_stats(Tlsf *tlsf, TlsfStats *stats)
+{
+	memset(stats, 0, sizeof(TlsfStats));
+	for (TlsfPool *pool = tlsf->pools; pool; pool = pool->next) {
+		stats->pool_bytes += pool->size;
+		TlsfBlock *prev = NULL;
+		TlsfBlock *block = (TlsfBlock *)((char *)pool + tlsf_align_up(sizeof(TlsfPool), TLSF_ALIGN));
+		for (; block_size(block); prev = block, block = block_next(block)) {
+			assert(block->prev_phys == prev);
+			const size_t size = block_size(block);
+			if (block_is_free(block)) {
+				assert(!prev || !block_is_free(prev));
+				stats->free_bytes += size;
+				stats->largest_free_block = size > stats->largest_free_block ? size : stats->largest_free_block;
+				stats->n_free_blocks++;
+			} else {
+				stats->used_bytes += size;
+				stats->n_used_blocks++;
+			}
+		}
+		assert(block->prev_phys == prev && !block_is_free(block));
+		(void)prev;
+	}
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stddef.h>
+
+// Two-level segregated fit allocator over caller supplied memory. Allocating and freeing are O(1): free blocks are
+// binned by size into power of two classes split 32 ways, a bitmap search finds a big enough one and neighbours are
+// merged on free. Every block has a 16 byte header and payloads are multiples of 16 bytes. Not thread safe.
+typedef struct Tlsf Tlsf;
+
+// The control structure is placed at the start of memory, the rest of it becomes the first pool.
+Tlsf *tlsf_create(void *memory, size_t size);
+// Adds another block of memory to allocate from, pools don't have to be contiguous.
+void tlsf_add_pool(Tlsf *tlsf, void *memory, size_t size);
+size_t tlsf_overhead(void);
+
+// Alignment is a power of two, 0 is the default of 16. Return NULL when no free block is big enough.
+void *tlsf_malloc(Tlsf *tlsf, size_t size, size_t alignment);
+// Grows in place into a free neighbour when it can.
+void *tlsf_realloc(Tlsf *tlsf, void *p, size_t size, size_t alignment);
+void tlsf_free(Tlsf *tlsf, void *p);
+// Usable size of an allocated block, at least what was asked for.
+size_t tlsf_block_size(void *p);
+
+typedef struct TlsfStats
+{
+	size_t pool_bytes;
+	size_t used_bytes;
+	size_t free_bytes;
+	size_t largest_free_block;
+	unsigned n_used_blocks;
+	unsigned n_free_blocks;
+} TlsfStats;
+
+// Walks every block and asserts the heap is consistent, for tests and debugging.
+void tlsf_stats(Tlsf *tlsf, TlsfStats *stats);
@@ -3,6 +3,7 @@
 
 #include <windows.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 
 #include "window_resources.h"
@@ -12,6 +13,7 @@
 #include "render_resources.h"
 #include "stb_easy_font.h"
 #include "fibers_system.h"
+#include "frame_pipeline.h"
 
 #define MAX_LOADSTRING 100
 
@@ -56,25 +58,20 @@ int not_quit = 1;
 
 typedef struct UpdatePosition
 {
-	FibersSystem *fibers_system;
 	float *positions;
 	float *directions;
 	float dt;
 	float unit_scale;
-	unsigned start_entry;
-	unsigned count;
 } UpdatePosition;
-void update_position_job(void *job_data)
+void update_position_range(void *job_data, unsigned begin, unsigned end)
 {
 	UpdatePosition *update_position = job_data;
 	float *positions = update_position->positions;
 	float *directions = update_position->directions;
 	const float dt = update_position->dt;
 	const float unit_scale = update_position->unit_scale;
-	const unsigned count = update_position->count;
-	const unsigned start_entry = update_position->start_entry;
 
-	for (unsigned i = start_entry; i < (start_entry + count); ++i) {
+	for (unsigned i = begin; i < end; ++i) {
 		const unsigned index = 2 * i;
 		if (positions[index] < -unit_scale) {
 			positions[index] = -unit_scale;
@@ -89,43 +86,90 @@ void update_position_job(void *job_data)
 	}
 }
 
-void recursive_update(void *job_data)
+// Frames simulated ahead of the one being rendered, 1 is the serial loop.
+#define FRAME_PIPELINE_DEPTH 2
+
+enum { n_instances = 10 };
+enum { n_types = 10 };
+
+// The simulation state is kept per pipeline slot, frame n is simulated into slot n % depth from the slot before it
+// while the frames before it are rendered from theirs.
+typedef struct FrameLoop
 {
-	UpdatePosition *update_position = job_data;
-	FibersSystemCounter *counters[10];
-	UpdatePosition new_update_positions[10];
-	while (update_position->start_entry < update_position->count) {
-		new_update_positions[update_position->start_entry] = *update_position;
-		new_update_positions[update_position->start_entry].count = 1;
-		FibersSystemJobDecl job_decl = { .job_entry = update_position_job, .job_data = &new_update_positions[update_position->start_entry] };
-		FibersSystemCounter *counter = NULL;
-		fibers_system_run_jobs(update_position->fibers_system, &job_decl, 1, &counters[update_position->start_entry]);
-		//fibers_system_wait_for_counter(update_position->fibers_system, counter, 0);
-		update_position->start_entry++;
+	FibersSystem *fibers_system;
+	D3D11Device *device;
+	RenderResources *resources;
+	FramePipeline *pipeline;
+	float unit_scale;
+	float positions[FRAME_PIPELINE_DEPTH][n_instances * 2];
+	float directions[FRAME_PIPELINE_DEPTH][n_instances];
+	float update_pos_time[FRAME_PIPELINE_DEPTH];
+	FibersSystemCounter update_counter;
+	float smoothed_dt;
+
+	Resource positions_rb_resource;
+	Resource font_vb_resource;
+	RenderPackage *render_package;
+	RenderPackage *font_render_package;
+	// Only used by the submission, reset as it starts a frame.
+	Allocator *frame_allocator;
+	Allocator *heap;
+	unsigned font_buffer_size;
+	float smoothed_frame_time;
+	float smoothed_update_pos_time;
+} FrameLoop;
+
+void simulate_frame(void *data, unsigned frame, unsigned slot, float dt)
+{
+	FrameLoop *loop = data;
+	const unsigned previous = (slot + FRAME_PIPELINE_DEPTH - 1) % FRAME_PIPELINE_DEPTH;
+	if (previous != slot) {
+		memcpy(loop->positions[slot], loop->positions[previous], sizeof(loop->positions[slot]));
+		memcpy(loop->directions[slot], loop->directions[previous], sizeof(loop->directions[slot]));
 	}
 
-	for (unsigned i = 0; i < 10; ++i) {
-		fibers_system_wait_for_counter(update_position->fibers_system, counters[i], 0);
-	}
+	Timer update_pos_timer;
+	delta_time(&update_pos_timer);
+	loop->smoothed_dt = loop->smoothed_dt * 0.9f + dt * 0.1f;
+	UpdatePosition update_position = { .positions = loop->positions[slot],.directions = loop->directions[slot],.dt = loop->smoothed_dt,.unit_scale = loop->unit_scale };
 
-	/*{
-		float *positions = update_position->positions;
-		float *directions = update_position->directions;
-		const float dt = update_position->dt;
-		const float unit_scale = update_position->unit_scale;
-		const unsigned i = update_position->start_entry;
-		const unsigned index = 2 * i;
-		if (positions[index] < -unit_scale) {
-			positions[index] = -unit_scale;
-			directions[i] *= -1.0f;
-		}
-		else if (positions[index] > unit_scale) {
-			positions[index] = unit_scale;
-			directions[i] *= -1.0f;
-		}
+	fibers_system_parallel_for(loop->fibers_system, 0, n_instances, update_position_range, &update_position, 0, &loop->update_counter);
+	fibers_system_wait_for_counter(loop->fibers_system, loop->update_counter, 0);
 
-		positions[index] += directions[i] * dt;
-	}*/
+	loop->update_pos_time[slot] = delta_time(&update_pos_timer);
+}
+
+void submit_frame(void *data, unsigned frame, unsigned slot)
+{
+	FrameLoop *loop = data;
+	RenderResources *resources = loop->resources;
+	allocator_frame_reset(loop->frame_allocator);
+	render_resource_raw_buffer_update(resources, loop->positions_rb_resource, loop->positions[slot], sizeof(loop->positions[slot]));
+
+	FramePipelineStats stats;
+	frame_pipeline_stats(loop->pipeline, &stats);
+	allocator_stats_end_frame(loop->heap);
+	AllocatorStats heap_stats;
+	allocator_stats(loop->heap, &heap_stats);
+	loop->smoothed_frame_time = loop->smoothed_frame_time * 0.9f + stats.last_frame_ns * 1e-9f * 0.1f;
+	loop->smoothed_update_pos_time = loop->smoothed_update_pos_time * 0.9f + loop->update_pos_time[slot] * 0.1f;
+
+	int num_quads;
+	unsigned char color[4] = { 255, 255, 255, 255 };
+	unsigned char text_buffer[1024];
+	sprintf_s(text_buffer, 1024, "Instance count: %u\nUpdate loop time: %.2f\nUpdate pos time: %.10f\nPipeline depth: %u\nLatency: %.2f (max %.2f)\nHeap: %.1f KB (peak %.1f), %u allocations/frame",
+		n_instances, loop->smoothed_frame_time * 1000.0f, loop->smoothed_update_pos_time * 1000.0f, stats.depth, stats.last_latency_ns * 1e-6f, stats.max_latency_ns * 1e-6f,
+		heap_stats.total.live_bytes / 1024.0f, heap_stats.total.peak_bytes / 1024.0f, heap_stats.total.allocations_per_frame);
+	char *font_buffer = allocator_realloc(loop->frame_allocator, NULL, loop->font_buffer_size, 16);
+	num_quads = stb_easy_font_print(0, 0, text_buffer, color, font_buffer, loop->font_buffer_size);
+	render_resource_vertex_buffer_update(resources, loop->font_vb_resource, font_buffer, num_quads * 4 * sizeof(float) * 4);
+	loop->font_render_package->n_vertices = num_quads * 4;
+	loop->font_render_package->n_indices = num_quads * 6;
+
+	d3d11_device_clear(loop->device);
+	d3d11_device_render(loop->device, loop->render_package);
+	d3d11_device_render(loop->device, loop->font_render_package);
+	d3d11_device_present(loop->device);
 }
 
 int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
@@ -156,11 +200,14 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
 
 	MSG msg;
 
-	program.fibers_system = fibers_system_create(program.allocator, 32);
+	FibersSystemStackPool stack_pools[FIBERS_SYSTEM_N_STACK_CLASSES] = { { 64 * 1024, 64, 256 }, { 512 * 1024, 16, 32 } };
+	program.fibers_system = fibers_system_create(program.allocator, stack_pools, 0);
 	RenderResources *resources = d3d11_device_render_resources(program.device);
+	// Render packages and other small objects come from size class pages.
+	static char object_allocator_buffer[64 * 1024];
+	Allocator *object_allocator = create_slab_allocator(object_allocator_buffer, sizeof(object_allocator_buffer), program.allocator);
 
 	static const unsigned n_font_verts = 9999;
-	static char buffer[1024 * 1024]; // ~500 chars
 	UINT16 font_index_buffer[6 * 9999];
 	for (unsigned i = 0, q = 0; i < 6 * 9999; i += 6, ++q) {
 		const unsigned index = q * 6;
@@ -230,9 +277,7 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
 	};
 	const unsigned n_font_resources = sizeof(font_render_resources) / sizeof(font_render_resources[0]);
 
-	RenderPackage *font_render_package = create_render_package(program.allocator, font_render_resources, n_font_resources, 0, 0);
-	enum { n_instances = 10 };
-	enum { n_types = 10 };
+	RenderPackage *font_render_package = create_render_package(object_allocator, font_render_resources, n_font_resources, 0, 0);
 
 	const unsigned stride = 3 * sizeof(float);
 	const float square_size = 100.0f;
@@ -260,8 +305,16 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
 	}
 	Resource types_rb_resource = render_resources_create_raw_buffer(resources, types_raw_buffer, sizeof(types_raw_buffer));
 
-	float positions_raw_buffer[n_instances * 2];
-	const float unit_scale = 1000.0f;
+	// Static, it's too big for the stack with a few frames of simulation state in it.
+	static FrameLoop loop;
+	loop.fibers_system = program.fibers_system;
+	loop.device = program.device;
+	loop.resources = resources;
+	loop.unit_scale = 1000.0f;
+	const float unit_scale = loop.unit_scale;
+
+	// The first frame is simulated from the slot before it.
+	float *positions_raw_buffer = loop.positions[FRAME_PIPELINE_DEPTH - 1];
 	for (unsigned i = 0; i < n_instances; ++i) {
 		unsigned index = 2 * i;
 		int value;
@@ -276,9 +329,9 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
 	}
 	positions_raw_buffer[0] = -0.5f;
 	positions_raw_buffer[1] = 0.5f;
-	Resource positions_rb_resource = render_resources_create_raw_buffer(resources, positions_raw_buffer, sizeof(positions_raw_buffer));
+	Resource positions_rb_resource = render_resources_create_raw_buffer(resources, positions_raw_buffer, sizeof(loop.positions[0]));
 
-	float directions[n_instances];
+	float *directions = loop.directions[FRAME_PIPELINE_DEPTH - 1];
 	for (unsigned i = 0; i < n_instances; ++i) {
 		directions[i] = 25.0f;
 	}
@@ -367,71 +420,34 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
 	};
 	const unsigned n_resources = sizeof(render_resources) / sizeof(render_resources[0]);
 
-	RenderPackage *render_package = create_render_package(program.allocator, render_resources, n_resources, n_vertices, n_indices);
+	RenderPackage *render_package = create_render_package(object_allocator, render_resources, n_resources, n_vertices, n_indices);
 	render_package->n_instances = n_instances;
 
-	Timer timer;
-	float dt = 0.0f;
-	delta_time(&timer);
-	float smoothed_dt = 0.0f;
-	float smoothed_update_pos_time = 0.0f;
+	loop.positions_rb_resource = positions_rb_resource;
+	loop.font_vb_resource = font_vb_resource;
+	loop.render_package = render_package;
+	loop.font_render_package = font_render_package;
+	// Two frames, so the font vertices of a frame are still there while the next one is submitted.
+	static char frame_allocator_buffer[512 * 1024];
+	loop.frame_allocator = create_frame_allocator(frame_allocator_buffer, sizeof(frame_allocator_buffer), 2);
+	loop.font_buffer_size = n_font_verts * 4 * sizeof(float);
+	loop.heap = program.allocator;
+#if defined(_DEBUG)
+	allocator_frame_assert_no_heap_allocations(loop.frame_allocator, program.allocator, 8);
+#endif
+	loop.update_counter = fibers_system_counter_create(program.fibers_system);
+
+	FramePipelineDesc pipeline_desc = { .depth = FRAME_PIPELINE_DEPTH, .simulate = simulate_frame, .submit = submit_frame, .data = &loop };
+	loop.pipeline = frame_pipeline_create(program.allocator, program.fibers_system, &pipeline_desc);
 	while (not_quit) {
-		dt = delta_time(&timer);
-
 		while (PeekMessage(&msg, 0, 0, 0, PM_REMOVE)) {
 			TranslateMessage(&msg);
 			DispatchMessage(&msg);
 		}
 
-		Timer update_pos_timer;
-		delta_time(&update_pos_timer);
-		UpdatePosition job_data[n_instances];
-		FibersSystemJobDecl job_decls[n_instances];
-		/*for (unsigned i = 0; i < n_instances; ++i) */{
-			unsigned i = 0;
-			UpdatePosition data = { .fibers_system = program.fibers_system, .positions = positions_raw_buffer,.directions = directions,.dt = smoothed_dt,.unit_scale = unit_scale,.start_entry = 0,.count = 10 };
-			job_data[i] = data;
-			job_decls[i].job_entry = recursive_update;
-			job_decls[i].job_data = &job_data[i];
-		}
-
-		FibersSystemCounter *job_counter = NULL;
-		fibers_system_run_jobs(program.fibers_system, job_decls, 1, &job_counter);
-		fibers_system_wait_for_counter(program.fibers_system, job_counter, 0);
-		
-
-		/*for (unsigned i = 0; i < n_instances; ++i) {
-			const unsigned index = 2 * i;
-			if (positions_raw_buffer[index] < -unit_scale) {
-				positions_raw_buffer[index] = -unit_scale;
-				directions[i] *= -1.0f;
-			} else if (positions_raw_buffer[index] > unit_scale) {
-				positions_raw_buffer[index] = unit_scale;
-				directions[i] *= -1.0f;
-			}
-
-			positions_raw_buffer[index] += directions[i] * smoothed_dt;
-		}*/
-		float update_pos_time = delta_time(&update_pos_timer);
-		smoothed_update_pos_time = smoothed_update_pos_time * 0.9f + update_pos_time * 0.1f;
-
-		render_resource_raw_buffer_update(resources, positions_rb_resource, positions_raw_buffer, sizeof(positions_raw_buffer));
-
-		int num_quads;
-		unsigned char color[4] = { 255, 255, 255, 255 };
-		unsigned char text_buffer[1024];
-		smoothed_dt = smoothed_dt * 0.9f + dt * 0.1f;
-		sprintf_s(text_buffer, 1024, "Instance count: %u\nUpdate loop time: %.2f\nUpdate pos time: %.10f", n_instances, smoothed_dt * 1000.0f, smoothed_update_pos_time* 1000.0f);
-		num_quads = stb_easy_font_print(0, 0, text_buffer, color, buffer, sizeof(buffer));
-		render_resource_vertex_buffer_update(resources, font_vb_resource, buffer, num_quads * 4 * sizeof(float) * 4);
-		font_render_package->n_vertices = num_quads * 4;
-		font_render_package->n_indices = num_quads * 6;
-
-		d3d11_device_clear(program.device);
-		d3d11_device_render(program.device, render_package);
-		d3d11_device_render(program.device, font_render_package);
-		d3d11_device_present(program.device);		
+		frame_pipeline_frame(loop.pipeline);
 	}
+	frame_pipeline_destroy(program.allocator, loop.pipeline);
 
 	render_resources_destroy_raw_buffer(resources, positions_rb_resource);
 	render_resources_destroy_raw_buffer(resources, types_rb_resource);
@@ -442,6 +458,7 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
 	render_resources_destroy_index_buffer(resources, ib_resource);
 	render_resources_destroy_vertex_buffer(resources, vb_resource);
 
+	fibers_system_counter_destroy(program.fibers_system, loop.update_counter);
 	destroy_render_package(render_package);
 
 	render_resources_destroy_vertex_buffer(resources, font_vb_resource);
@@ -453,6 +470,8 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
 
 	d3d11_device_destroy(program.allocator, program.device);
 	fibers_system_destroy(program.allocator, program.fibers_system);
+	destroy_allocator(loop.frame_allocator);
+	destroy_allocator(object_allocator);
 	destroy_allocator(program.allocator);
 
 	return (int) msg.wParam;